@@ -35,263 +35,421 @@
 #include "defs.h"
 #include "igmpproxy.h"
 
-/* the code below implements a callout queue */
-static int id = 0;
-static struct timeOutQueue  *queue = 0; /* pointer to the beginning of timeout queue */
+#include <limits.h>
+#include <stddef.h>
+
+/*
+ * The code below implements a hierarchical timing wheel (see Varghese &
+ * Lauck, "Hashed and Hierarchical Timing Wheels"). Timers live in one of
+ * five levels of slots depending on how far in the future they expire.
+ * The first level holds one slot per tick; every time the first level
+ * wraps around, the next slot of the level above is cascaded down. This
+ * gives O(1) insert, cancel and remaining-time lookup regardless of the
+ * number of pending timers.
+ */
+#define TVR_BITS        8
+#define TVN_BITS        6
+#define TVR_SIZE        (1 << TVR_BITS)
+#define TVN_SIZE        (1 << TVN_BITS)
+#define TVR_MASK        (TVR_SIZE - 1)
+#define TVN_MASK        (TVN_SIZE - 1)
+#define TVN_LEVELS      4
+
+#define TVN_SHIFT(n)    (TVR_BITS + (n) * TVN_BITS)
+
+/*
+ * Timer handles are indexes into a slot table tagged with a generation
+ * count: (generation << TIMER_SLOT_BITS) | (slot + 1). The generation is
+ * bumped every time a slot is released, so a stale handle never matches
+ * a reused slot. A slot whose generation would wrap is retired and only
+ * recycled when the table can not grow any more.
+ */
+#define TIMER_SLOT_BITS 20
+#define TIMER_GEN_BITS  11
+#define TIMER_SLOT_MASK ((1U << TIMER_SLOT_BITS) - 1)
+#define TIMER_GEN_MASK  ((1U << TIMER_GEN_BITS) - 1)
+#define TIMER_SLOTS_MIN 256
+#define TIMER_SLOTS_MAX TIMER_SLOT_MASK
+
+#define TIMER_NO_SLOT   ((uint32_t)-1)
 
 struct timeOutQueue {
-    struct timeOutQueue    *next;   // Next event in queue
-    int                     id;  
+    struct list_node        list;   // Slot in the timing wheel
+    int                     id;
     timer_f                 func;   // function to call
     void                    *data;  // Data for function
-    int                     time;   // Time offset for next event
+    uint32_t                expires;// Absolute tick the timer expires at
 };
 
-// Method for dumping the Queue to the log.
-static void debugQueue(void);
+struct timerSlot {
+    struct timeOutQueue     *node;  // Timer using the slot, NULL if free
+    uint32_t                gen;    // Generation of the current handle
+    uint32_t                next;   // Next slot in the free or retired list
+};
 
+static uint32_t wheel_now = 0;      /* current tick of the wheel */
+static int ntimers = 0;             /* number of pending timers */
 
-/**
- * Is this timer in callout queue.
- */
-int timer_inQueue(int timer_id) {
-    //assert(timer_id != 0);    
+static struct list_head tv1[TVR_SIZE];
+static struct list_head tvn[TVN_LEVELS][TVN_SIZE];
 
-    struct timeOutQueue  *ptr;
+static struct timerSlot *slots = NULL;
+static uint32_t nslots = 0;
+static uint32_t free_head = TIMER_NO_SLOT, free_tail = TIMER_NO_SLOT;
+static uint32_t retired_head = TIMER_NO_SLOT, retired_tail = TIMER_NO_SLOT;
+
+#define timer_of(node, member) \
+    ((struct timeOutQueue *)((char *)(node) - offsetof(struct timeOutQueue, member)))
 
-    for (ptr = queue; ptr; ptr = ptr->next) {
-            if(ptr->id == timer_id)
-		return 1;
-            //my_log(LOG_DEBUG, 0, "(Id:%d, Time:%d) ", ptr->id, ptr->time);
+
+static void timer_slotPush(uint32_t *head, uint32_t *tail, uint32_t slot) {
+    slots[slot].next = TIMER_NO_SLOT;
+    if (*tail == TIMER_NO_SLOT)
+        *head = slot;
+    else
+        slots[*tail].next = slot;
+    *tail = slot;
+}
+
+/**
+ * Makes sure the free list is not empty, growing the slot table or
+ * recycling retired slots. Returns 0 when no slot could be found.
+ */
+static int timer_slotRefill(void) {
+    struct timerSlot *tmp;
+    uint32_t size, i;
+
+    if (free_head != TIMER_NO_SLOT)
+        return 1;
+
+    if (nslots < TIMER_SLOTS_MAX) {
+        size = nslots ? nslots * 2 : TIMER_SLOTS_MIN;
+        if (size > TIMER_SLOTS_MAX)
+            size = TIMER_SLOTS_MAX;
+        tmp = realloc(slots, size * sizeof(*slots));
+        if (tmp != NULL) {
+            slots = tmp;
+            for (i = nslots; i < size; i++) {
+                slots[i].node = NULL;
+                slots[i].gen = 0;
+                timer_slotPush(&free_head, &free_tail, i);
+            }
+            nslots = size;
+            return 1;
+        }
+        my_log(LOG_WARNING, 0, "Malloc Failed in timer_slotRefill");
     }
 
+    if (retired_head != TIMER_NO_SLOT) {
+        my_log(LOG_NOTICE, 0, "Timer table full, recycling retired timer ids");
+        free_head = retired_head;
+        free_tail = retired_tail;
+        retired_head = retired_tail = TIMER_NO_SLOT;
+        return 1;
+    }
     return 0;
 }
 
 /**
  *  timer_newTimerid	-	allocate an timer id
  *
- *  Returns a suitable unique value for a new timer id
- *    number.
+ *  Takes the oldest free slot and returns its handle, or -1 if none is
+ *  available.
  */
-static int timer_newTimerid(void) {
-    for (;;) {
-        if (++id <= 0)
-            id = 1;
-        if (!timer_inQueue(id))
-            return id;
+static int timer_newTimerid(struct timeOutQueue *node) {
+    uint32_t slot;
+
+    if (!timer_slotRefill())
+        return -1;
+
+    slot = free_head;
+    free_head = slots[slot].next;
+    if (free_head == TIMER_NO_SLOT)
+        free_tail = TIMER_NO_SLOT;
+
+    slots[slot].node = node;
+    return (int)((slots[slot].gen << TIMER_SLOT_BITS) | (slot + 1));
+}
+
+/**
+ * Releases the slot of a timer, invalidating its handle.
+ */
+static void timer_releaseTimerid(int timer_id) {
+    uint32_t slot = ((uint32_t)timer_id & TIMER_SLOT_MASK) - 1;
+
+    slots[slot].node = NULL;
+    slots[slot].gen = (slots[slot].gen + 1) & TIMER_GEN_MASK;
+    if (slots[slot].gen == 0)
+        timer_slotPush(&retired_head, &retired_tail, slot);
+    else
+        timer_slotPush(&free_head, &free_tail, slot);
+}
+
+static struct timeOutQueue *timer_find(int timer_id) {
+    uint32_t slot;
+
+    if (timer_id <= 0)
+        return NULL;
+
+    slot = ((uint32_t)timer_id & TIMER_SLOT_MASK) - 1;
+    if (slot >= nslots
+        || slots[slot].gen != ((uint32_t)timer_id >> TIMER_SLOT_BITS))
+        return NULL;
+
+    return slots[slot].node;
+}
+
+/**
+ * Puts a timer in the wheel slot matching its expiry time.
+ */
+static void timer_link(struct timeOutQueue *node) {
+    uint32_t idx = node->expires - wheel_now;
+    struct list_head *slot;
+    int n;
+
+    if ((int32_t)idx < 0) {
+        /* Already due, run it on the current tick */
+        slot = &tv1[wheel_now & TVR_MASK];
+    } else if (idx < TVR_SIZE) {
+        slot = &tv1[node->expires & TVR_MASK];
+    } else {
+        for (n = 0; n < TVN_LEVELS - 1; n++) {
+            if (idx < (1U << TVN_SHIFT(n + 1)))
+                break;
+        }
+        slot = &tvn[n][(node->expires >> TVN_SHIFT(n)) & TVN_MASK];
+    }
+    list_add_tail(slot, &node->list);
+}
+
+/**
+ * Moves all timers of a slot in an upper level down the wheel.
+ */
+static void timer_cascade(int level, int index) {
+    struct list_head *slot = &tvn[level][index];
+    struct list_head work;
+
+    if (list_empty(slot))
+        return;
+
+    /* Detach the slot first, a timer may link back into it */
+    work.n.next = slot->n.next;
+    work.n.prev = slot->n.prev;
+    work.n.next->prev = &work.n;
+    work.n.prev->next = &work.n;
+    list_head_init(slot);
+
+    while (!list_empty(&work)) {
+        struct timeOutQueue *ptr = timer_of(work.n.next, list);
+        list_del(&ptr->list);
+        timer_link(ptr);
     }
 }
 
+/**
+ * Unlinks a timer from the wheel, releases its id and frees it.
+ */
+static void timer_free(struct timeOutQueue *ptr) {
+    list_del(&ptr->list);
+    timer_releaseTimerid(ptr->id);
+    ntimers--;
+    poolFree(POOL_TIMER, ptr);
+}
+
+/**
+ * Is this timer in callout queue.
+ */
+int timer_inQueue(int timer_id) {
+    return timer_find(timer_id) != NULL;
+}
+
 /**
 *   Initializes the callout queue
 */
 void callout_init(void) {
-    queue = NULL;
+    int i, n;
+
+    for (i = 0; i < TVR_SIZE; i++)
+        list_head_init(&tv1[i]);
+    for (n = 0; n < TVN_LEVELS; n++)
+        for (i = 0; i < TVN_SIZE; i++)
+            list_head_init(&tvn[n][i]);
+
+    wheel_now = 0;
+    ntimers = 0;
+
+    poolInit(POOL_TIMER, sizeof(struct timeOutQueue));
 }
 
 /**
 *   Clears all scheduled timeouts...
 */
 void free_all_callouts(void) {
-    struct timeOutQueue *p;
+    uint32_t i;
 
-    while (queue) {
-        p = queue;
-        queue = queue->next;
-        free(p);
+    for (i = 0; i < nslots; i++) {
+        if (slots[i].node != NULL)
+            timer_free(slots[i].node);
     }
 }
 
 
 /**
- * elapsed_time seconds have passed; perform all the events that should
- * happen.
+ * elapsed_time milliseconds have passed; perform all the events that
+ * should happen. Time not making up a whole tick is the caller's to keep.
  */
 void age_callout_queue(int elapsed_time) {
-    struct timeOutQueue *ptr;
-    int i = 0;
-
-    for (ptr = queue; ptr; ptr = queue, i++) {
-        if (ptr->time > elapsed_time) {
-            ptr->time -= elapsed_time;
-            return;
-        } else {
-            elapsed_time -= ptr->time;
-            queue = queue->next;
-            my_log(LOG_DEBUG, 0, "About to call timeout %d (#%d)", ptr->id, i);
-
-            if (ptr->func)
-                ptr->func(ptr->data);
-            free(ptr);
+    uint32_t target = wheel_now + elapsed_time / TIMER_TICK_MS;
+    int n, index;
+
+    for (;;) {
+        struct list_head *slot = &tv1[wheel_now & TVR_MASK];
+
+        /* Timers added by a callback with no delay run in this pass too */
+        while (!list_empty(slot)) {
+            struct timeOutQueue *ptr = timer_of(slot->n.next, list);
+            timer_f func = ptr->func;
+            void *data = ptr->data;
+
+            my_log(LOG_DEBUG, 0, "About to call timeout %d", ptr->id);
+            timer_free(ptr);
+            if (func)
+                func(data);
+        }
+
+        if (wheel_now == target)
+            break;
+
+        /* Advance one tick, cascading the upper levels on wrap around */
+        wheel_now++;
+        if ((wheel_now & TVR_MASK) == 0) {
+            for (n = 0; n < TVN_LEVELS; n++) {
+                index = (wheel_now >> TVN_SHIFT(n)) & TVN_MASK;
+                timer_cascade(n, index);
+                if (index != 0)
+                    break;
+            }
         }
     }
 }
 
 /**
- * Return in how many seconds age_callout_queue() would like to be called.
- * Return -1 if there are no events pending.
+ * Return in how many milliseconds age_callout_queue() would like to be
+ * called, always a whole number of ticks. Return -1 if there are no
+ * events pending.
+ *
+ * Timers in the first level are exact. For the upper levels the time of
+ * the next cascade is returned, which is never later than the expiry.
  */
 int timer_nextTimer(void) {
-    if (queue) {
-        if (queue->time < 0) {
-            my_log(LOG_WARNING, 0, "timer_nextTimer top of queue says %d", 
-                queue->time);
-            return 0;
+    uint32_t next = 0, delay;
+    int found = 0;
+    int i, n, base;
+
+    if (ntimers == 0)
+        return -1;
+
+    for (i = 0; i < TVR_SIZE; i++) {
+        if (!list_empty(&tv1[(wheel_now + i) & TVR_MASK]))
+            return i * TIMER_TICK_MS;
+    }
+
+    for (n = 0; n < TVN_LEVELS; n++) {
+        base = (wheel_now >> TVN_SHIFT(n)) & TVN_MASK;
+        for (i = 1; i <= TVN_SIZE; i++) {
+            if (!list_empty(&tvn[n][(base + i) & TVN_MASK])) {
+                delay = (((wheel_now >> TVN_SHIFT(n)) + i) << TVN_SHIFT(n)) - wheel_now;
+                if (!found || delay < next)
+                    next = delay;
+                found = 1;
+                break;
+            }
         }
-        return queue->time;
     }
-    return -1;
+
+    if (!found) {
+        my_log(LOG_WARNING, 0, "timer_nextTimer found no slot for %d timers",
+            ntimers);
+        return 0;
+    }
+    return next > INT_MAX / TIMER_TICK_MS ? INT_MAX : (int)next * TIMER_TICK_MS;
 }
 
 /**
  *  Inserts a timer in queue.
- *  @param delay - Number of seconds the timeout should happen in.
+ *  @param delay - Number of milliseconds the timeout should happen in,
+ *                 rounded up to a whole tick.
  *  @param action - The function to call on timeout.
  *  @param data - Pointer to the function data to supply...
  */
 int timer_setTimer(int delay, timer_f action, void *data) {
-    struct     timeOutQueue  *ptr, *node, *prev;
-    int i = 0;
+    struct     timeOutQueue  *node;
 
     assert(delay >= 0);
 
     /* create a node */ 
-    node = (struct timeOutQueue *)malloc(sizeof(struct timeOutQueue));
+    node = poolAlloc(POOL_TIMER);
     if (node == 0) {
         my_log(LOG_WARNING, 0, "Malloc Failed in timer_settimer\n");
         return -1;
     }
-    node->func = action; 
-    node->data = data;
-    node->time = delay; 
-    node->next = 0; 
-    node->id   = timer_newTimerid( );
+    node->func    = action; 
+    node->data    = data;
+    node->expires = wheel_now + (delay + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    node->id      = timer_newTimerid(node);
+    if (node->id < 0) {
+        my_log(LOG_WARNING, 0, "No free timer id in timer_settimer");
+        poolFree(POOL_TIMER, node);
+        return -1;
+    }
 
-    prev = ptr = queue;
+    timer_link(node);
+    ntimers++;
 
-    /* insert node in the queue */
-
-    /* if the queue is empty, insert the node and return */
-    if (!queue) {
-        queue = node;
-    }
-    else {
-        /* chase the pointer looking for the right place */
-        while (ptr) {
-            if (delay < ptr->time) {
-                // We found the correct node
-                node->next = ptr;
-                if (ptr == queue) {
-                    queue = node;
-                }
-                else {
-                    prev->next = node;
-                }
-                ptr->time -= node->time;
-		my_log(LOG_DEBUG, 0,
-			"Created timeout %d (#%d) - delay %d secs",
-			node->id, i, node->time);
-		debugQueue();
-                return node->id;
-            } else {
-                // Continur to check nodes.
-                delay -= ptr->time; node->time = delay;
-                prev = ptr;
-                ptr = ptr->next;
-            }
-            i++;
-        }
-        prev->next = node;
-    }
-    my_log(LOG_DEBUG, 0, "Created timeout %d (#%d) - delay %d secs", 
-            node->id, i, node->time);
-    debugQueue();
+    my_log(LOG_DEBUG, 0, "Created timeout %d - delay %d ms", 
+            node->id, delay);
 
     return node->id;
 }
 
 /**
-*   returns the time until the timer is scheduled 
+*   returns the time in milliseconds until the timer is scheduled 
 */
 int timer_leftTimer(int timer_id) {
     struct timeOutQueue *ptr;
-    int left = 0;
+    int32_t left;
 
     if (!timer_id) {
         return -1;
     }
 
-    for (ptr = queue; ptr; ptr = ptr->next) {
-        left += ptr->time;
-        if (ptr->id == timer_id) {
-            return left;
-        }
-    }
-    
-    return -1;
+    ptr = timer_find(timer_id);
+    if (ptr == NULL)
+        return -1;
+
+    left = (int32_t)(ptr->expires - wheel_now);
+    if (left <= 0)
+        return 0;
+    return left > INT_MAX / TIMER_TICK_MS ? INT_MAX : left * TIMER_TICK_MS;
 }
 
 /**
 *   clears the associated timer.  Returns 1 if succeeded. 
 */
 int timer_clearTimer(int  timer_id) {
-    struct timeOutQueue  *ptr, *prev;
-    int i = 0;
+    struct timeOutQueue  *ptr;
 
     if (timer_id == INVAILD_TIMER)
         return 0;
 
-    prev = ptr = queue;
-
-    /*
-     * find the right node, delete it. the subsequent node's time
-     * gets bumped up
-     */
-
-    debugQueue();
-    while (ptr) {
-        if (ptr->id == timer_id) {
-            /* got the right node */
-
-            /* unlink it from the queue */
-            if (ptr == queue)
-                queue = queue->next;
-            else
-                prev->next = ptr->next;
-
-            /* increment next node if any */
-            if (ptr->next != 0)
-                (ptr->next)->time += ptr->time;
-#if 0
-            if (ptr->data)
-                free(ptr->data);
-#endif
-            my_log(LOG_DEBUG, 0, "Deleted timer %d (#%d)", ptr->id, i);
-            free(ptr);
-            debugQueue();
-            return 1;
-        }
-        prev = ptr;
-        ptr = ptr->next;
-        i++;
+    ptr = timer_find(timer_id);
+    if (ptr == NULL) {
+        // If we get here, the timer was not deleted.
+        my_log(LOG_DEBUG, 0, "failed to delete timer %d", timer_id);
+        return 0;
     }
-    // If we get here, the timer was not deleted.
-    my_log(LOG_DEBUG, 0, "failed to delete timer %d (#%d)", timer_id, i);
-    debugQueue();
-    return 0;
-}
 
-/**
- * debugging utility
- */
-static void debugQueue(void) {
-    struct timeOutQueue  *ptr;
-
-    my_log(LOG_DEBUG, 0, "\nTimer in queue ============== start");
-    for (ptr = queue; ptr; ptr = ptr->next) {
-            my_log(LOG_DEBUG, 0, "(Id:%d, Time:%d) ", ptr->id, ptr->time);
-    }
-    my_log(LOG_DEBUG, 0, "Timer in queue ============== end\n");
+    my_log(LOG_DEBUG, 0, "Deleted timer %d", timer_id);
+    timer_free(ptr);
+    return 1;
 }
-
@@ -44,6 +44,7 @@ struct vifconfig {
     short               state;
     int                 ratelimit;
     int                 threshold;
+    bool                explicitTracking;
 
     // Keep allowed nets for VIF.
     struct SubnetList*  allowednets;
@@ -79,12 +80,36 @@ void initCommonConfig(void) {
     commonConfig.startupQueryCount = DEFAULT_ROBUSTNESS;
 
     // Default values for leave intervals...
-    commonConfig.lastMemberQueryInterval = INTERVAL_QUERY_RESPONSE;
+    commonConfig.lastMemberQueryInterval = DEFAULT_LMQI;
     commonConfig.lastMemberQueryCount    = DEFAULT_ROBUSTNESS;
 
     // If 1, a leave message is sent upstream on leave messages from downstream.
     commonConfig.fastUpstreamLeave = 0;
 
+    // Pools grow on demand unless a size is configured.
+    memset(commonConfig.poolSize, 0, sizeof(commonConfig.poolSize));
+
+    // Packets drained from the IGMP socket per system call.
+    commonConfig.recvBatch = DEFAULT_RECV_BATCH;
+
+    // Kernel routes are set one at a time by setsockopt() by default.
+    commonConfig.mfcNetlink = 0;
+
+    // Removed routes are passed on to the FPP with cmm.
+    commonConfig.offloadBackend = OFFLOAD_CMM;
+
+    // The kernel route counters are not polled, and idle routes stay.
+    commonConfig.mfcPollInterval = 0;
+    commonConfig.mfcIdleTimeout = 0;
+
+    // The kernel routes are checked against the ones set every few minutes.
+    commonConfig.mfcReconcileInterval = DEFAULT_MFC_RECONCILE;
+
+    // Every start is a cold start.
+    commonConfig.stateFile = NULL;
+
+    // Messages are written by the daemon itself.
+    commonConfig.logRingSize = 0;
 }
 
 /**
@@ -148,6 +173,201 @@ int loadConfig(char *configFile) {
             my_log(LOG_DEBUG, 0, "Config: Quick leave mode enabled.");
             commonConfig.fastUpstreamLeave = 1;
             
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
+        else if(strcmp("poolsize", token)==0) {
+            // Got a poolsize token....
+            int type, count;
+
+            token = nextConfigToken();
+            type = token ? poolLookupName(token) : -1;
+            if(type < 0) {
+                closeConfigFile();
+                my_log(LOG_WARNING, 0, "Unknown pool '%s' in configfile", token ? token : "");
+                return 0;
+            }
+
+            token = nextConfigToken();
+            count = token ? atoi(token) : -1;
+            if(count < 0) {
+                closeConfigFile();
+                my_log(LOG_WARNING, 0, "Pool size must be 0 or more.");
+                return 0;
+            }
+            my_log(LOG_DEBUG, 0, "Config: Pool %d size %d.", type, count);
+            commonConfig.poolSize[type] = count;
+
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
+        else if(strcmp("lastmemberqueryinterval", token)==0) {
+            // Got a lastmemberqueryinterval token....
+            int interval;
+
+            token = nextConfigToken();
+            interval = token ? atoi(token) : 0;
+            if(interval < 100 || interval > 25500) {
+                closeConfigFile();
+                my_log(LOG_WARNING, 0, "Last member query interval must be between 100 and 25500 ms.");
+                return 0;
+            }
+            my_log(LOG_DEBUG, 0, "Config: Last member query interval %d ms.", interval);
+            commonConfig.lastMemberQueryInterval = interval;
+
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
+        else if(strcmp("lastmemberquerycount", token)==0) {
+            // Got a lastmemberquerycount token....
+            int count;
+
+            token = nextConfigToken();
+            count = token ? atoi(token) : 0;
+            if(count < 1 || count > 7) {
+                closeConfigFile();
+                my_log(LOG_WARNING, 0, "Last member query count must be between 1 and 7.");
+                return 0;
+            }
+            my_log(LOG_DEBUG, 0, "Config: Last member query count %d.", count);
+            commonConfig.lastMemberQueryCount = count;
+
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
+        else if(strcmp("recvbatch", token)==0) {
+            // Got a recvbatch token....
+            int count;
+
+            token = nextConfigToken();
+            count = token ? atoi(token) : 0;
+            if(count < 1 || count > MAX_RECV_BATCH) {
+                closeConfigFile();
+                my_log(LOG_WARNING, 0, "Receive batch must be between 1 and %d.", MAX_RECV_BATCH);
+                return 0;
+            }
+            my_log(LOG_DEBUG, 0, "Config: Receive batch %d.", count);
+            commonConfig.recvBatch = count;
+
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
+        else if(strcmp("mfcnetlink", token)==0) {
+            // Got a mfcnetlink token....
+            my_log(LOG_DEBUG, 0, "Config: Kernel routes over rtnetlink.");
+            commonConfig.mfcNetlink = 1;
+
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
+        else if(strcmp("offload", token)==0) {
+            // Got an offload token....
+            int type;
+
+            token = nextConfigToken();
+            type = token ? offloadLookupName(token) : -1;
+            if(type < 0) {
+                closeConfigFile();
+                my_log(LOG_WARNING, 0, "Unknown offload backend '%s' in configfile", token ? token : "");
+                return 0;
+            }
+            my_log(LOG_DEBUG, 0, "Config: Offload backend %s.", token);
+            commonConfig.offloadBackend = type;
+
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
+        else if(strcmp("mfcpollinterval", token)==0) {
+            // Got a mfcpollinterval token....
+            int interval;
+
+            token = nextConfigToken();
+            interval = token ? atoi(token) : -1;
+            if(interval < 0 || interval > 3600) {
+                closeConfigFile();
+                my_log(LOG_WARNING, 0, "MFC poll interval must be between 0 and 3600 s.");
+                return 0;
+            }
+            my_log(LOG_DEBUG, 0, "Config: MFC poll interval %d s.", interval);
+            commonConfig.mfcPollInterval = interval;
+
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
+        else if(strcmp("mfcidletimeout", token)==0) {
+            // Got a mfcidletimeout token....
+            int timeout;
+
+            token = nextConfigToken();
+            timeout = token ? atoi(token) : -1;
+            if(timeout < 0) {
+                closeConfigFile();
+                my_log(LOG_WARNING, 0, "MFC idle timeout must be 0 or more seconds.");
+                return 0;
+            }
+            my_log(LOG_DEBUG, 0, "Config: MFC idle timeout %d s.", timeout);
+            commonConfig.mfcIdleTimeout = timeout;
+
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
+        else if(strcmp("mfcreconcile", token)==0) {
+            // Got a mfcreconcile token....
+            int interval;
+
+            token = nextConfigToken();
+            interval = token ? atoi(token) : -1;
+            if(interval < 0) {
+                closeConfigFile();
+                my_log(LOG_WARNING, 0, "MFC reconcile interval must be 0 or more seconds.");
+                return 0;
+            }
+            my_log(LOG_DEBUG, 0, "Config: MFC reconcile interval %d s.", interval);
+            commonConfig.mfcReconcileInterval = interval;
+
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
+        else if(strcmp("warmrestart", token)==0) {
+            // Got a warmrestart token....
+            token = nextConfigToken();
+            if(token == NULL) {
+                closeConfigFile();
+                my_log(LOG_WARNING, 0, "The warmrestart option needs a state file.");
+                return 0;
+            }
+            my_log(LOG_DEBUG, 0, "Config: Warm restart with state file %s.", token);
+            free(commonConfig.stateFile);
+            commonConfig.stateFile = strdup(token);
+
+            // Read next token...
+            token = nextConfigToken();
+            continue;
+        }
+        else if(strcmp("asynclog", token)==0) {
+            // Got an asynclog token....
+            int slots;
+
+            token = nextConfigToken();
+            slots = token ? atoi(token) : -1;
+            if(slots < 0 || slots > MAX_LOG_RING) {
+                closeConfigFile();
+                my_log(LOG_WARNING, 0, "Log ring must have between 0 and %d slots.", MAX_LOG_RING);
+                return 0;
+            }
+            my_log(LOG_DEBUG, 0, "Config: Log ring of %d slots.", slots);
+            commonConfig.logRingSize = slots;
+
             // Read next token...
             token = nextConfigToken();
             continue;
@@ -164,6 +384,12 @@ int loadConfig(char *configFile) {
     // Close the configfile...
     closeConfigFile();
 
+    // Idle routes are found by polling their counters.
+    if(commonConfig.mfcIdleTimeout > 0 && commonConfig.mfcPollInterval == 0) {
+        commonConfig.mfcPollInterval = DEFAULT_MFC_POLL < commonConfig.mfcIdleTimeout ?
+                                       DEFAULT_MFC_POLL : commonConfig.mfcIdleTimeout;
+    }
+
     return 1;
 }
 
@@ -203,6 +429,7 @@ void configureVifs(void) {
                     
                     Dp->threshold = confPtr->threshold;
                     Dp->ratelimit = confPtr->ratelimit;
+                    Dp->explicitTracking = confPtr->explicitTracking;
 
                     // Go to last allowed net on VIF...
                     for(vifLast = Dp->allowednets; vifLast->next; vifLast = vifLast->next);
@@ -247,6 +474,7 @@ struct vifconfig *parsePhyintToken(void) {
     tmpPtr->next = NULL;    // Important to avoid seg fault...
     tmpPtr->ratelimit = 0;
     tmpPtr->threshold = 1;
+    tmpPtr->explicitTracking = false;
     tmpPtr->state = IF_STATE_DOWNSTREAM;
     tmpPtr->allowednets = NULL;
     tmpPtr->allowedgroups = NULL;
@@ -321,6 +549,11 @@ struct vifconfig *parsePhyintToken(void) {
                 break;
             }
         }
+        else if(strcmp("explicittracking", token)==0) {
+            // Explicit host tracking
+            my_log(LOG_DEBUG, 0, "Config: IF: Got explicittracking token.");
+            tmpPtr->explicitTracking = true;
+        }
         else if(strcmp("threshold", token)==0) {
             // Threshold
             token = nextConfigToken();
@@ -355,6 +588,7 @@ struct vifconfig *parsePhyintToken(void) {
 struct SubnetList *parseSubnetAddress(char *addrstr) {
     struct SubnetList *tmpSubnet;
     char        *tmpStr;
+    char        FmtBu[ INET_FMT_SIZE ];
     uint32_t      addr = 0x00000000;
     uint32_t      mask = 0xFFFFFFFF;
 
@@ -384,7 +618,7 @@ struct SubnetList *parseSubnetAddress(char *addrstr) {
     tmpSubnet->next = NULL;
 
     my_log(LOG_DEBUG, 0, "Config: IF: Altnet: Parsed altnet to %s.",
-	    inetFmts(tmpSubnet->subnet_addr, tmpSubnet->subnet_mask,s1));
+	    inetFmts(tmpSubnet->subnet_addr, tmpSubnet->subnet_mask, FmtBu));
 
     return tmpSubnet;
 }
@@ -0,0 +1,228 @@
+/*
+**  igmpproxy - IGMP proxy based multicast router 
+**  Copyright (C) 2005 Johnny Egeland <johnny@rlo.org>
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**
+**----------------------------------------------------------------------------
+**
+**  This software is derived work from the following software. The original
+**  source code has been modified from it's original state by the author
+**  of igmpproxy.
+**
+**  smcroute 0.92 - Copyright (C) 2001 Carsten Schill <carsten@cschill.de>
+**  - Licensed under the GNU General Public License, version 2
+**  
+**  mrouted 3.9-beta3 - COPYRIGHT 1989 by The Board of Trustees of 
+**  Leland Stanford Junior University.
+**  - Original license can be found in the "doc/mrouted-LINCESE" file.
+**
+*/
+/**
+*   hash.c - Open addressing hash table keyed by IPv4 address, or by
+*   a (source, group) address pair.
+*
+*   Keys are hashed with a multiplicative (Fibonacci) hash and collisions
+*   are resolved by linear probing. Removal shifts the following entries
+*   back, so no tombstones are needed and lookups stay short. The table
+*   doubles once it is more than 70% full. A table holds either kind of
+*   key, not both.
+*/
+
+#include "defs.h"
+#include "igmpproxy.h"
+
+#define ADDR_HASH_MIN_BITS  4       /* 16 slots */
+
+#define SG_KEY(src, grp)    (((uint64_t)(src) << 32) | (grp))
+
+static unsigned addrHashSlot(const struct addr_hash *h, uint64_t key) {
+    return (unsigned)((key * 0x9E3779B97F4A7C15ULL) >> (64 - h->bits));
+}
+
+/**
+*   Initializes an empty hash table. Memory is allocated on the first
+*   insert.
+*/
+void addrHashInit(struct addr_hash *h) {
+    h->keys = NULL;
+    h->vals = NULL;
+    h->bits = 0;
+    h->size = 0;
+    h->count = 0;
+}
+
+/**
+*   Frees the memory of a hash table. The stored values are not freed.
+*/
+void addrHashFree(struct addr_hash *h) {
+    free(h->keys);
+    free(h->vals);
+    addrHashInit(h);
+}
+
+/**
+*   Resizes the table to 2^bits slots and rehashes all entries.
+*   Returns 0 if no memory was available.
+*/
+static int addrHashResize(struct addr_hash *h, unsigned bits) {
+    struct addr_hash nh;
+    unsigned i, j;
+
+    nh.bits = bits;
+    nh.size = 1U << bits;
+    nh.count = h->count;
+    nh.keys = malloc(nh.size * sizeof(*nh.keys));
+    nh.vals = calloc(nh.size, sizeof(*nh.vals));
+    if (nh.keys == NULL || nh.vals == NULL) {
+        my_log(LOG_WARNING, 0, "Malloc Failed in addrHashResize");
+        free(nh.keys);
+        free(nh.vals);
+        return 0;
+    }
+
+    for (i = 0; i < h->size; i++) {
+        if (h->vals[i] == NULL)
+            continue;
+        for (j = addrHashSlot(&nh, h->keys[i]); nh.vals[j]; j = (j + 1) & (nh.size - 1))
+            ;
+        nh.keys[j] = h->keys[i];
+        nh.vals[j] = h->vals[i];
+    }
+
+    free(h->keys);
+    free(h->vals);
+    *h = nh;
+    return 1;
+}
+
+/*
+*   Returns the value stored for 'key', or NULL if there is none.
+*/
+static void *hashLookup(const struct addr_hash *h, uint64_t key) {
+    unsigned i;
+
+    if (h->count == 0)
+        return NULL;
+
+    for (i = addrHashSlot(h, key); h->vals[i]; i = (i + 1) & (h->size - 1)) {
+        if (h->keys[i] == key)
+            return h->vals[i];
+    }
+    return NULL;
+}
+
+/*
+*   Stores 'val' for 'key', replacing any value already stored.
+*   Returns 0 if no memory was available.
+*/
+static int hashInsert(struct addr_hash *h, uint64_t key, void *val) {
+    unsigned i;
+
+    assert(val != NULL);
+
+    if ((h->count + 1) * 10 > h->size * 7) {
+        if (!addrHashResize(h, h->bits ? h->bits + 1 : ADDR_HASH_MIN_BITS))
+            return 0;
+    }
+
+    for (i = addrHashSlot(h, key); h->vals[i]; i = (i + 1) & (h->size - 1)) {
+        if (h->keys[i] == key) {
+            h->vals[i] = val;
+            return 1;
+        }
+    }
+    h->keys[i] = key;
+    h->vals[i] = val;
+    h->count++;
+    return 1;
+}
+
+/*
+*   Removes 'key' from the table. Returns the value that was stored,
+*   or NULL if the key was not found.
+*/
+static void *hashRemove(struct addr_hash *h, uint64_t key) {
+    unsigned i, j, home;
+    void *val;
+
+    if (h->count == 0)
+        return NULL;
+
+    for (i = addrHashSlot(h, key); h->vals[i]; i = (i + 1) & (h->size - 1)) {
+        if (h->keys[i] == key)
+            break;
+    }
+    if (h->vals[i] == NULL)
+        return NULL;
+
+    val = h->vals[i];
+    h->count--;
+
+    /* Shift back entries whose probe sequence passes the hole */
+    for (j = (i + 1) & (h->size - 1); h->vals[j]; j = (j + 1) & (h->size - 1)) {
+        home = addrHashSlot(h, h->keys[j]);
+        if (((j - home) & (h->size - 1)) >= ((j - i) & (h->size - 1))) {
+            h->keys[i] = h->keys[j];
+            h->vals[i] = h->vals[j];
+            i = j;
+        }
+    }
+    h->vals[i] = NULL;
+    return val;
+}
+
+/**
+*   Calls fn for every value in the table. fn must not insert into or
+*   remove from the table.
+*/
+void addrHashForEach(const struct addr_hash *h, void (*fn)(void *val, void *arg), void *arg) {
+    unsigned i;
+
+    for(i = 0; i < h->size; i++) {
+        if(h->vals[i] != NULL)
+            fn(h->vals[i], arg);
+    }
+}
+
+/**
+*   Lookup, insert and remove by address.
+*/
+void *addrHashLookup(const struct addr_hash *h, uint32_t key) {
+    return hashLookup(h, key);
+}
+
+int addrHashInsert(struct addr_hash *h, uint32_t key, void *val) {
+    return hashInsert(h, key, val);
+}
+
+void *addrHashRemove(struct addr_hash *h, uint32_t key) {
+    return hashRemove(h, key);
+}
+
+/**
+*   Lookup, insert and remove by (source, group) pair.
+*/
+void *sgHashLookup(const struct addr_hash *h, uint32_t src, uint32_t grp) {
+    return hashLookup(h, SG_KEY(src, grp));
+}
+
+int sgHashInsert(struct addr_hash *h, uint32_t src, uint32_t grp, void *val) {
+    return hashInsert(h, SG_KEY(src, grp), val);
+}
+
+void *sgHashRemove(struct addr_hash *h, uint32_t src, uint32_t grp) {
+    return hashRemove(h, SG_KEY(src, grp));
+}
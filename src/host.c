@@ -0,0 +1,297 @@
+/*
+**  igmpproxy - IGMP proxy based multicast router 
+**  Copyright (C) 2005 Johnny Egeland <johnny@rlo.org>
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**
+**----------------------------------------------------------------------------
+**
+**  This software is derived work from the following software. The original
+**  source code has been modified from it's original state by the author
+**  of igmpproxy.
+**
+**  smcroute 0.92 - Copyright (C) 2001 Carsten Schill <carsten@cschill.de>
+**  - Licensed under the GNU General Public License, version 2
+**  
+**  mrouted 3.9-beta3 - COPYRIGHT 1989 by The Board of Trustees of 
+**  Leland Stanford Junior University.
+**  - Original license can be found in the "doc/mrouted-LINCESE" file.
+**
+*/
+/**
+*   host.c - Explicit tracking of the receivers on a downstream.
+*
+*   On interfaces configured with explicittracking every group keeps a
+*   record per reporting host, holding the filter mode and the source
+*   list of that host. When a host leaves, the proxy can then tell
+*   whether somebody else still wants the group or a source, and prune
+*   at once instead of running a round of specific queries.
+*/
+
+#include "defs.h"
+#include "igmpproxy.h"
+
+static void hostTimerTimeout(void *arg);
+
+/*
+ * Find the record of a host in the group.
+ */
+static struct host *hostLookup(struct group *gp, uint32_t hostAddr)
+{
+    struct host *hp;
+
+    list_for_each(&gp->hosts, hp, list) {
+        if(hp->addr == hostAddr)
+            return hp;
+    }
+    return NULL;
+}
+
+static struct host *hostCreate(struct group *gp, uint32_t hostAddr)
+{
+    struct host *hp = poolAlloc(POOL_HOST);
+
+    if(hp == NULL)
+        return NULL;
+
+    hp->addr     = hostAddr;
+    hp->fmode    = IGMP_V3_FMODE_INCLUDE;
+    hp->srcaddrs = NULL;
+    hp->nsrcs    = 0;
+    hp->srcsize  = 0;
+    hp->timer    = INVAILD_TIMER;
+    hp->gp       = gp;
+
+    list_add(&gp->hosts, &hp->list);
+    gp->nhosts++;
+
+    return hp;
+}
+
+static void hostDestroy(struct host *hp)
+{
+    list_del(&hp->list);
+    hp->gp->nhosts--;
+
+    timer_clearTimer(hp->timer);
+    free(hp->srcaddrs);
+    poolFree(POOL_HOST, hp);
+}
+
+/*
+ * Binary search a source in the sorted list of the host.
+ */
+static int hostHasSource(struct host *hp, uint32_t srcAddr)
+{
+    int lo = 0, hi = hp->nsrcs - 1;
+
+    while(lo <= hi) {
+        int mid = (lo + hi) / 2;
+
+        if(hp->srcaddrs[mid] < srcAddr)
+            lo = mid + 1;
+        else if(hp->srcaddrs[mid] > srcAddr)
+            hi = mid - 1;
+        else
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Set operations on the source list of the host, B is sorted.
+ */
+#define HOST_SET_REPLACE    0   /* S = B */
+#define HOST_SET_UNION      1   /* S = S+B */
+#define HOST_SET_MINUS      2   /* S = S-B */
+
+static int hostSourceSet(struct host *hp, int op, int numsrc, uint32_t *sources)
+{
+    uint32_t *set;
+    int i = 0, k = 0, n = 0;
+
+    if(op == HOST_SET_MINUS) {
+        /* In place, the list can only shrink */
+        for(i = 0; i < hp->nsrcs; i++) {
+            while(k < numsrc && sources[k] < hp->srcaddrs[i])
+                k++;
+            if(k >= numsrc || sources[k] != hp->srcaddrs[i])
+                hp->srcaddrs[n++] = hp->srcaddrs[i];
+        }
+        hp->nsrcs = n;
+        return 1;
+    }
+
+    if(op == HOST_SET_REPLACE)
+        hp->nsrcs = 0;
+
+    if(hp->nsrcs + numsrc == 0) {
+        hp->nsrcs = 0;
+        return 1;
+    }
+
+    set = malloc((hp->nsrcs + numsrc) * sizeof(uint32_t));
+    if(set == NULL)
+        return 0;
+
+    while(i < hp->nsrcs || k < numsrc) {
+        if(k >= numsrc || (i < hp->nsrcs && hp->srcaddrs[i] < sources[k])) {
+            set[n++] = hp->srcaddrs[i++];
+        } else {
+            if(i < hp->nsrcs && hp->srcaddrs[i] == sources[k])
+                i++;
+            set[n++] = sources[k++];
+        }
+    }
+
+    free(hp->srcaddrs);
+    hp->srcaddrs = set;
+    hp->srcsize = hp->nsrcs + numsrc;
+    hp->nsrcs = n;
+    return 1;
+}
+
+/**
+ * Apply a group record reported by a host to its record. The sources
+ * are sorted, see sourceSetSort(). A host left with INCLUDE{} is
+ * forgotten.
+ */
+void hostReport(struct group *gp, uint32_t hostAddr, int type, int numsrc, uint32_t *sources)
+{
+    struct host *hp;
+    int ok = 1;
+
+    assert(gp != NULL);
+
+    hp = hostLookup(gp, hostAddr);
+    if(hp == NULL) {
+        /* A host unknown in the group can only leave it INCLUDE{} */
+        if(type == IGMP_BLOCK_OLD_SOURCES)
+            return;
+        if(numsrc == 0 && type != IGMP_MODE_IS_EXCLUDE && type != IGMP_CHANGE_TO_EXCLUDE_MODE)
+            return;
+        hp = hostCreate(gp, hostAddr);
+        if(hp == NULL) {
+            /* The host is not known, fall back to queries */
+            my_log(LOG_WARNING, 0, "Can't track host %I in group %I.",
+                hostAddr, gp->mcast.s_addr);
+            gp->untracked = 1;
+            return;
+        }
+    }
+
+    switch(type) {
+    case IGMP_MODE_IS_INCLUDE:
+    case IGMP_CHANGE_TO_INCLUDE_MODE:
+        hp->fmode = IGMP_V3_FMODE_INCLUDE;
+        ok = hostSourceSet(hp, HOST_SET_REPLACE, numsrc, sources);
+        break;
+
+    case IGMP_MODE_IS_EXCLUDE:
+    case IGMP_CHANGE_TO_EXCLUDE_MODE:
+        hp->fmode = IGMP_V3_FMODE_EXCLUDE;
+        ok = hostSourceSet(hp, HOST_SET_REPLACE, numsrc, sources);
+        break;
+
+    case IGMP_ALLOW_NEW_SOURCES:
+        ok = hostSourceSet(hp, hp->fmode == IGMP_V3_FMODE_INCLUDE ?
+                           HOST_SET_UNION : HOST_SET_MINUS, numsrc, sources);
+        break;
+
+    case IGMP_BLOCK_OLD_SOURCES:
+        ok = hostSourceSet(hp, hp->fmode == IGMP_V3_FMODE_INCLUDE ?
+                           HOST_SET_MINUS : HOST_SET_UNION, numsrc, sources);
+        break;
+
+    default:
+        return;
+    }
+
+    if(!ok) {
+        /* The state of the host is unknown now, fall back to queries */
+        my_log(LOG_WARNING, 0, "Can't track host %I in group %I.",
+            hostAddr, gp->mcast.s_addr);
+        hostDestroy(hp);
+        gp->untracked = 1;
+        return;
+    }
+
+    if(hp->fmode == IGMP_V3_FMODE_INCLUDE && hp->nsrcs == 0) {
+        hostDestroy(hp);
+        return;
+    }
+
+    timer_clearTimer(hp->timer);
+    hp->timer = timer_setTimer(IGMP_GMI, hostTimerTimeout, hp);
+}
+
+/*
+ * The host didn't report for a group membership interval.
+ */
+static void hostTimerTimeout(void *arg)
+{
+    struct host *hp = (struct host *)arg;
+
+    hp->timer = INVAILD_TIMER;
+    hostDestroy(hp);
+}
+
+/**
+ * Tell if a tracked host still wants the traffic of a group in
+ * EXCLUDE mode.
+ */
+int hostWantsGroup(struct group *gp)
+{
+    struct host *hp;
+
+    list_for_each(&gp->hosts, hp, list) {
+        if(hp->fmode == IGMP_V3_FMODE_EXCLUDE)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Tell if a tracked host still wants the traffic of a source.
+ */
+int hostWantsSource(struct group *gp, uint32_t srcAddr)
+{
+    struct host *hp;
+
+    list_for_each(&gp->hosts, hp, list) {
+        if(hostHasSource(hp, srcAddr) == (hp->fmode == IGMP_V3_FMODE_INCLUDE))
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Forget all the hosts of a group.
+ */
+void hostFlush(struct group *gp)
+{
+    struct host *hp, *next;
+
+    list_for_each_safe(&gp->hosts, hp, next, list)
+        hostDestroy(hp);
+}
+
+/**
+ * Set up the host pool.
+ */
+void hostInit(void)
+{
+    poolInit(POOL_HOST, sizeof(struct host));
+}
@@ -34,9 +34,173 @@
 #include "defs.h"
 #include "igmpproxy.h"
 #include <linux/sockios.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#if MC4_CHANGES
+#include <linux/if_vlan.h>
+#endif
 
 struct IfDesc IfDescVc[ MAX_IF ], *IfDescEp = IfDescVc;
 
+// rtnetlink socket reporting link changes, -1 if not watched
+static int linkFd = -1;
+
+#if MC4_CHANGES
+/* This function checks if the given interface is VLAN if or not
+ * If its VLAN interface the forwarding is done by FPP
+ * so we disable forwarding on those interfaces by Linux
+ * The only interface allowed is wifi(ath0) interface
+ */
+static int IsIfVlan(char * ifName)
+{
+    int err, rc = 1;
+    struct vlan_ioctl_args if_request;
+    int vlan_fd;
+	
+    memset(&if_request, 0, sizeof(if_request));
+
+    /*Open a socket fd */
+    if ((vlan_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    {
+	my_log(LOG_DEBUG, 0,  "%s:, Unable to create a soket\n", __func__);
+	return 0;
+    }   
+
+    /*
+     * Check if the interface has real device, then its VLAN interface
+     */
+    if_request.cmd = GET_VLAN_REALDEV_NAME_CMD;
+    strcpy(&if_request.device1[0], (char *)ifName);
+
+    if ((err = ioctl(vlan_fd, SIOCGIFVLAN, &if_request)) < 0)
+    {
+	switch(errno)
+	{
+	    case EINVAL:
+    		my_log(LOG_DEBUG, 0, "EINVAL\n");
+		rc = 0;
+		break;
+	    case ENODEV:
+		my_log(LOG_DEBUG, 0, "%s: Warning, Found no information about %s interface\n", __func__, ifName);
+		rc = 0;
+		break;
+	    default:
+		my_log(LOG_DEBUG, 0, "%s: ioctl error %d\n", __func__, errno);
+		rc = 0;
+		break;
+	}
+    }
+    //my_log(LOG_DEBUG, 0, "Real devname:%s\n",if_request.u.device2);
+    close(vlan_fd);
+    return rc;
+}
+#endif
+
+/*
+** Works out once per interface whether the FPP or the kernel forwards
+** it, instead of on every route update.
+**
+** returns: - 1 if the classification of the interface changed
+**          - 0 otherwise
+*/
+int classifyIf( struct IfDesc *Dp ) {
+    bool fpp = false;
+
+#if MC4_CHANGES
+    /* Ethernet and VLAN interfaces are forwarded by the FPP */
+    fpp = !strncasecmp(Dp->Name, "eth", 3) || IsIfVlan(Dp->Name);
+#endif
+
+    if ( fpp == Dp->fppForwarded )
+        return 0;
+
+    Dp->fppForwarded = fpp;
+    my_log( LOG_INFO, 0, "Interface %s is forwarded by the %s.",
+         Dp->Name, fpp ? "FPP" : "kernel" );
+    return 1;
+}
+
+/*
+** Classifies all interfaces again, and reloads the kernel routes
+** if any of them changed.
+*/
+void refreshIfClasses( void ) {
+    struct IfDesc *Dp;
+    int changed = 0;
+
+    for ( Dp = IfDescVc; Dp < IfDescEp; Dp++ )
+        if ( Dp->InAdr.s_addr )
+            changed |= classifyIf( Dp );
+
+    if ( changed )
+        reloadKernelRoutes();
+}
+
+/*
+** Reads link changes from rtnetlink and classifies the interfaces
+** they are about again.
+*/
+static void linkInput( int fd, void *data ) {
+    char buf[ 8192 ] __attribute__(( aligned( NLMSG_ALIGNTO ) ));
+    struct nlmsghdr *nh;
+    struct IfDesc *Dp;
+    int changed = 0;
+    ssize_t len;
+
+    while ( (len = recv( fd, buf, sizeof( buf ), MSG_DONTWAIT )) > 0 ) {
+        for ( nh = (struct nlmsghdr *)buf; NLMSG_OK( nh, len ); nh = NLMSG_NEXT( nh, len ) ) {
+            struct ifinfomsg *ifi = NLMSG_DATA( nh );
+
+            if ( nh->nlmsg_type != RTM_NEWLINK && nh->nlmsg_type != RTM_DELLINK )
+                continue;
+
+            for ( Dp = IfDescVc; Dp < IfDescEp; Dp++ )
+                if ( Dp->InAdr.s_addr && Dp->ifindex == ifi->ifi_index )
+                    changed |= classifyIf( Dp );
+        }
+    }
+
+    // Events were lost, so any interface may have changed
+    if ( len < 0 && errno == ENOBUFS ) {
+        my_log( LOG_INFO, 0, "Link events lost, classifying all interfaces." );
+        refreshIfClasses();
+        return;
+    }
+
+    if ( changed )
+        reloadKernelRoutes();
+}
+
+/*
+** Subscribes to the link changes of the system, so the interface
+** classification follows them.
+**
+** returns: - 1 if the link changes are watched
+**          - 0 otherwise
+*/
+int watchIfChanges( void ) {
+    struct sockaddr_nl sa;
+
+    linkFd = socket( AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE );
+    if ( linkFd < 0 ) {
+        my_log( LOG_WARNING, errno, "rtnetlink socket, link changes not watched" );
+        return 0;
+    }
+
+    memset( &sa, 0, sizeof( sa ) );
+    sa.nl_family = AF_NETLINK;
+    sa.nl_groups = RTMGRP_LINK;
+    if ( bind( linkFd, (struct sockaddr *)&sa, sizeof( sa ) ) < 0
+         || ! reactorAddFd( linkFd, linkInput, NULL ) ) {
+        my_log( LOG_WARNING, errno, "rtnetlink bind, link changes not watched" );
+        close( linkFd );
+        linkFd = -1;
+        return 0;
+    }
+
+    return 1;
+}
+
 /*
 ** Builds up a vector with the interface of the machine. Calls to the other functions of 
 ** the module will fail if they are called before the vector is build.
@@ -75,7 +239,7 @@ void buildIfVc(void) {
 
         for ( IfPt = IfVc; IfPt < IfEp; IfPt = IfNext ) {
             struct ifreq IfReq;
-            char FmtBu[ 32 ];
+            char FmtBu[ 32 ], FmtBuN[ INET_FMT_SIZE ];
 
 	    IfNext = (struct ifreq *)((char *)&IfPt->ifr_addr +
 #ifdef HAVE_STRUCT_SOCKADDR_SA_LEN
@@ -94,6 +258,8 @@ void buildIfVc(void) {
 
             // Set the index to -1 by default.
             IfDescEp->index = -1;
+            IfDescEp->ifindex = 0;
+            IfDescEp->fppForwarded = false;
 
             /* don't retrieve more info for non-IP interfaces
              */
@@ -123,6 +289,7 @@ void buildIfVc(void) {
             
             my_log(LOG_DEBUG, 0, "Physical Index value of IF '%s' is %d",
                 IfDescEp->Name, IfReq.ifr_ifindex);
+            IfDescEp->ifindex = IfReq.ifr_ifindex;
 
 
             /* get if flags
@@ -153,19 +320,23 @@ void buildIfVc(void) {
             IfDescEp->robustness    = DEFAULT_ROBUSTNESS;
             IfDescEp->threshold     = DEFAULT_THRESHOLD;   /* ttl limit */
             IfDescEp->ratelimit     = DEFAULT_RATELIMIT; 
+            IfDescEp->explicitTracking = false;
             
             IfDescEp->isQuerier     = false;
             IfDescEp->otherQuerierPresentTimer = INVAILD_TIMER;
 
             list_head_init(&IfDescEp->groups);
+            addrHashInit(&IfDescEp->groupHash);
             IfDescEp->ngps          = 0;
 
+            classifyIf(IfDescEp);
+
             // Debug log the result...
             my_log( LOG_DEBUG, 0, "buildIfVc: Interface %s Addr: %s, Flags: 0x%04x, Network: %s ngps %d",
                  IfDescEp->Name,
                  fmtInAdr( FmtBu, IfDescEp->InAdr ),
                  IfDescEp->Flags,
-                 inetFmts(subnet,mask, s1),
+                 inetFmts(subnet,mask, FmtBuN),
                  IfDescEp->ngps);
 
             IfDescEp++;
@@ -35,7 +35,11 @@
 *            appropriately...
 */
 
+#define _GNU_SOURCE     /* recvmmsg() */
 #include "igmpproxy.h"
+
+#include <stddef.h>
+#include <linux/filter.h>
  
 // Globals                  
 uint32_t     allhosts_group;          /* All hosts addr in net order */
@@ -46,15 +50,46 @@ uint32_t     allv3routers_group;          /* All IGMPv3 router addr in net order
               
 extern int MRouterFD;
 
+/*
+ * Input ring, recvBatch buffers of RECV_BUF_SIZE starting at recv_buf,
+ * filled by one recvmmsg() call.
+ */
+static struct mmsghdr   *recv_msgs;
+static struct iovec     *recv_iovs;
+static unsigned int     recv_batch;
+
+/* Input counters, logged on SIGUSR1 */
+static struct {
+    unsigned long   calls;      /* recvmmsg() calls returning packets */
+    unsigned long   packets;    /* packets received */
+    unsigned long   full;       /* calls that filled the whole ring */
+    unsigned long   errors;     /* failed calls */
+    unsigned long   badsum;     /* packets dropped for a bad checksum */
+    unsigned int    maxbatch;   /* largest batch seen */
+} recv_stats;
+
 /*
  * Open and initialize the igmp socket, and fill in the non-changing
  * IP header fields in the output packet buffer.
  */
 void initIgmp() {
     struct ip *ip;
-
-    recv_buf = malloc(RECV_BUF_SIZE);
-    send_buf = malloc(RECV_BUF_SIZE);
+    unsigned int i;
+
+    recv_batch = getCommonConfig()->recvBatch;
+    recv_buf  = malloc(recv_batch * RECV_BUF_SIZE);
+    recv_msgs = calloc(recv_batch, sizeof(struct mmsghdr));
+    recv_iovs = calloc(recv_batch, sizeof(struct iovec));
+    send_buf  = malloc(RECV_BUF_SIZE);
+    if(recv_buf == NULL || recv_msgs == NULL || recv_iovs == NULL || send_buf == NULL)
+        my_log(LOG_ERR, errno, "Unable to allocate the IGMP buffers");
+
+    for(i = 0; i < recv_batch; i++) {
+        recv_iovs[i].iov_base = recv_buf + i * RECV_BUF_SIZE;
+        recv_iovs[i].iov_len  = RECV_BUF_SIZE;
+        recv_msgs[i].msg_hdr.msg_iov    = &recv_iovs[i];
+        recv_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
 
     k_hdr_include(true);    /* include IP header when sending */
     k_set_rcvbuf(256*1024,48*1024); /* lots of input buffering        */
@@ -80,6 +115,125 @@ void initIgmp() {
 #if defined(IGMPv3_PROXY)
     allv3routers_group = htonl(INADDR_ALLV3RTRS_GROUP);
 #endif
+
+    // Leave the messages that are ignored anyway in the kernel.
+    igmpUpdateFilter();
+}
+
+/*
+ * A subnet of an interface, in host order, as matched by getIfByAddress().
+ */
+struct filterNet {
+    uint32_t        addr;
+    uint32_t        mask;
+    struct IfDesc   *Dp;
+};
+
+/*
+ * Orders the subnets longest prefix first. Of equal prefixes the first
+ * interface wins, like in getIfByAddress().
+ */
+static int filterNetCmp(const void *a, const void *b) {
+    const struct filterNet *x = a, *y = b;
+
+    if (x->mask != y->mask)
+        return x->mask > y->mask ? -1 : 1;
+    return x->Dp < y->Dp ? -1 : x->Dp > y->Dp;
+}
+
+/*
+ * Builds a socket filter from the interface states and subnets, and
+ * attaches it to the IGMP socket. It passes the kernel upcalls, and the
+ * queries, reports and leaves that acceptIgmp() would act on: those
+ * whose source getIfByAddress() puts on a downstream interface, other
+ * than its own address. Must be called again when the interfaces change.
+ */
+void igmpUpdateFilter(void) {
+    struct sock_filter *code;
+    struct sock_fprog prog;
+    struct filterNet *nets;
+    struct SubnetList *sn;
+    struct IfDesc *Dp;
+    unsigned Ix, count = 0, n = 0, i;
+
+    for (Ix = 0; (Dp = getIfByIx(Ix)); Ix++)
+        for (sn = Dp->allowednets; sn; sn = sn->next)
+            count++;
+
+    // Header, up to seven instructions per subnet, and the final drop.
+    if (14 + 7 * count > BPF_MAXINSNS) {
+        my_log(LOG_WARNING, 0, "Too many subnets (%u) for the IGMP socket filter", count);
+        setsockopt(MRouterFD, SOL_SOCKET, SO_DETACH_FILTER, NULL, 0);
+        return;
+    }
+    nets = calloc(count + 1, sizeof(*nets));
+    code = calloc(14 + 7 * count, sizeof(*code));
+    if (nets == NULL || code == NULL) {
+        my_log(LOG_WARNING, errno, "No memory for the IGMP socket filter");
+        free(nets);
+        free(code);
+        return;
+    }
+
+    count = 0;
+    for (Ix = 0; (Dp = getIfByIx(Ix)); Ix++) {
+        for (sn = Dp->allowednets; sn; sn = sn->next) {
+            // A zero mask never beats the best match of none
+            if (sn->subnet_mask == 0)
+                continue;
+            nets[count].addr = ntohl(sn->subnet_addr);
+            nets[count].mask = ntohl(sn->subnet_mask);
+            nets[count].Dp   = Dp;
+            count++;
+        }
+    }
+    qsort(nets, count, sizeof(*nets), filterNetCmp);
+
+    // Kernel upcalls have a zero protocol.
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS, offsetof(struct ip, ip_p));
+    code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 1);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, ~0U);
+
+    // Only the messages handled by acceptIgmp().
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0);
+    code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IGMP_MEMBERSHIP_QUERY, 5, 0);
+    code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IGMP_V1_MEMBERSHIP_REPORT, 4, 0);
+    code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IGMP_V2_MEMBERSHIP_REPORT, 3, 0);
+    code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IGMP_V2_LEAVE_GROUP, 2, 0);
+    code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IGMP_V3_MEMBERSHIP_REPORT, 1, 0);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+
+    // The source is kept in X, and matched against the subnets in turn.
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct ip, ip_src));
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_MISC | BPF_TAX, 0);
+    for (i = 0; i < count; i++) {
+        int downstream = nets[i].Dp->state == IF_STATE_DOWNSTREAM;
+
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_MISC | BPF_TXA, 0);
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_AND | BPF_K, nets[i].mask);
+        code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, nets[i].addr, 0, downstream ? 4 : 1);
+        if (downstream) {
+            code[n++] = (struct sock_filter)BPF_STMT(BPF_MISC | BPF_TXA, 0);
+            code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                                     ntohl(nets[i].Dp->InAdr.s_addr), 0, 1);
+            code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+            code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, ~0U);
+        } else {
+            code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+        }
+    }
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+
+    prog.len    = n;
+    prog.filter = code;
+    if (setsockopt(MRouterFD, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0)
+        my_log(LOG_WARNING, errno, "Unable to attach the IGMP socket filter");
+    else
+        my_log(LOG_DEBUG, 0, "IGMP socket filter of %u instructions for %u subnets", n, count);
+
+    free(nets);
+    free(code);
 }
 
 /**
@@ -105,10 +259,54 @@ char *igmpPacketKind(u_int type, u_int code) {
 
 
 /**
- * Process a newly received IGMP packet that is sitting in the input
- * packet buffer.
+ * Drain the IGMP socket: read up to recvBatch packets with one
+ * recvmmsg() call and process them, and read again while the ring
+ * comes back full. The number of rounds is bounded so that timers
+ * still run under a flood.
+ */
+#define MAX_RECV_ROUNDS 8
+
+void igmpRecvBatch(void) {
+    unsigned int i;
+    int n, round;
+
+    for(round = 0; round < MAX_RECV_ROUNDS; round++) {
+        n = recvmmsg(MRouterFD, recv_msgs, recv_batch, MSG_DONTWAIT, NULL);
+        if(n < 0) {
+            if(errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+                recv_stats.errors++;
+                my_log(LOG_ERR, errno, "recvmmsg");
+            }
+            return;
+        }
+
+        recv_stats.calls++;
+        recv_stats.packets += n;
+        if((unsigned int)n > recv_stats.maxbatch)
+            recv_stats.maxbatch = n;
+
+        for(i = 0; i < (unsigned int)n; i++)
+            acceptIgmp(recv_iovs[i].iov_base, recv_msgs[i].msg_len);
+
+        if((unsigned int)n < recv_batch)
+            return;
+        recv_stats.full++;
+    }
+}
+
+/**
+ * Log the input counters.
+ */
+void igmpLogStats(void) {
+    my_log(LOG_NOTICE, 0, "IGMP input: %lu packets in %lu batches (max %u of %u), %lu full, %lu errors, %lu bad checksums",
+        recv_stats.packets, recv_stats.calls, recv_stats.maxbatch, recv_batch,
+        recv_stats.full, recv_stats.errors, recv_stats.badsum);
+}
+
+/**
+ * Process a newly received IGMP packet that is sitting in buf.
  */
-void acceptIgmp(int recvlen) {
+void acceptIgmp(char *buf, int recvlen) {
     register uint32_t src, dst, group;
     struct ip *ip;
     struct igmp *igmp;
@@ -121,7 +319,7 @@ void acceptIgmp(int recvlen) {
         return;
     }
 
-    ip        = (struct ip *)recv_buf;
+    ip        = (struct ip *)buf;
     src       = ip->ip_src.s_addr;
     dst       = ip->ip_dst.s_addr;
 
@@ -146,20 +344,22 @@ void acceptIgmp(int recvlen) {
                 return;
             } 
             else if(src == checkVIF->InAdr.s_addr) {
-                my_log(LOG_NOTICE, 0, "Route activation request from %s for %s is from myself. Ignoring.",
-                    inetFmt(src, s1), inetFmt(dst, s2));
+                my_log(LOG_NOTICE, 0, "Route activation request from %I for %I is from myself. Ignoring.",
+                    src, dst);
                 return;
             }
             else if(!isAdressValidForIf(checkVIF, src)) {
-                my_log(LOG_WARNING, 0, "The source address %s for group %s, is not in any valid net for upstream VIF.",
-                    inetFmt(src, s1), inetFmt(dst, s2));
+                my_log(LOG_WARNING, 0, "The source address %I for group %I, is not in any valid net for upstream VIF.",
+                    src, dst);
                 return;
             }
             
             // Activate the route.
-            my_log(LOG_DEBUG, 0, "Route activate request from %s to %s",
-		    inetFmt(src,s1), inetFmt(dst,s2));
+            my_log(LOG_DEBUG, 0, "Route activate request from %I to %I",
+		    src, dst);
 
+            // The kernel has no route for it, whatever was set before.
+            forgetMRoute(src, dst);
             activateRoute(dst, src);
         }
         return;
@@ -170,25 +370,34 @@ void acceptIgmp(int recvlen) {
 
     if (iphdrlen + ipdatalen != recvlen) {
         my_log(LOG_WARNING, 0,
-            "received packet from %s shorter (%u bytes) than hdr+data length (%u+%u)",
-            inetFmt(src, s1), recvlen, iphdrlen, ipdatalen);
+            "received packet from %I shorter (%u bytes) than hdr+data length (%u+%u)",
+            src, recvlen, iphdrlen, ipdatalen);
         return;
     }
 
-    buffer      = recv_buf + iphdrlen;
+    buffer      = buf + iphdrlen;
     igmp        = (struct igmp *)buffer;
 //    group       = igmp->igmp_group.s_addr;
     igmpdatalen = ipdatalen - IGMP_MINLEN;
     if (igmpdatalen < 0) {
         my_log(LOG_WARNING, 0,
-            "received IP data field too short (%u bytes) for IGMP, from %s",
-            ipdatalen, inetFmt(src, s1));
+            "received IP data field too short (%u bytes) for IGMP, from %I",
+            ipdatalen, src);
+        return;
+    }
+
+    // The checksum covers the whole IGMP message, sources included.
+    if (inetChksum((uint16_t *)buffer, ipdatalen) != 0) {
+        recv_stats.badsum++;
+        my_log(LOG_WARNING, 0,
+            "received IGMP message with a bad checksum (%u bytes) from %I",
+            ipdatalen, src);
         return;
     }
 
-    my_log(LOG_NOTICE, 0, "RECV %s from %-15s to %s",
+    my_log(LOG_NOTICE, 0, "RECV %s from %-15I to %I",
         igmpPacketKind(igmp->igmp_type, igmp->igmp_code),
-        inetFmt(src, s1), inetFmt(dst, s2) );
+        src, dst );
 
     switch (igmp->igmp_type) {
     case IGMP_V1_MEMBERSHIP_REPORT:
@@ -203,7 +412,7 @@ void acceptIgmp(int recvlen) {
         break;
     
     case IGMP_V3_MEMBERSHIP_REPORT:
-        acceptIGMPv3GroupReport(src, igmp->igmp_type, buffer);    
+        acceptIGMPv3GroupReport(src, igmp->igmp_type, buffer, ipdatalen);    
 	break;	
 
     case IGMP_MEMBERSHIP_QUERY:
@@ -215,9 +424,9 @@ void acceptIgmp(int recvlen) {
 
     default:
         my_log(LOG_INFO, 0,
-            "ignoring unknown IGMP message type %x from %s to %s",
-            igmp->igmp_type, inetFmt(src, s1),
-            inetFmt(dst, s2));
+            "ignoring unknown IGMP message type %x from %I to %I",
+            igmp->igmp_type, src,
+            dst);
         break;
     }
 
@@ -313,6 +522,7 @@ void sendIgmpv3query(uint32_t src, uint32_t dst, uint32_t len)
     struct sockaddr_in sdst;
     int setloop = 0, setigmpsource = 0;
     size_t send_len = 0;
+    char FmtBu[ INET_FMT_SIZE ];
 
     uint8_t type = IGMP_MEMBERSHIP_QUERY; /* XXX: This is hacking code */
 
@@ -338,8 +548,8 @@ void sendIgmpv3query(uint32_t src, uint32_t dst, uint32_t len)
             my_log(LOG_ERR, errno, "Sender VIF was down.");
         else
             my_log(LOG_INFO, errno,
-                "sendto to %s on %s, len %d",
-                inetFmt(dst, s1), inetFmt(src, s2), send_len);
+                "sendto to %I on %I, len %d",
+                dst, src, send_len);
     }
 
     if(setigmpsource) {
@@ -350,9 +560,9 @@ void sendIgmpv3query(uint32_t src, uint32_t dst, uint32_t len)
         k_set_if(INADDR_ANY);
     }
 
-    my_log(LOG_DEBUG, 0, "SENT %s from %-15s to %s. len %d",
+    my_log(LOG_DEBUG, 0, "SENT %s from %-15s to %I. len %d",
 	    igmpPacketKind(type, 0), src == INADDR_ANY ? "INADDR_ANY" :
-	    inetFmt(src, s1), inetFmt(dst, s2), send_len);
+	    inetFmt(src, FmtBu), dst, send_len);
 
 }
 
@@ -364,6 +574,7 @@ void sendIgmpv3query(uint32_t src, uint32_t dst, uint32_t len)
 void sendIgmp(uint32_t src, uint32_t dst, int type, int code, uint32_t group, int datalen) {
     struct sockaddr_in sdst;
     int setloop = 0, setigmpsource = 0;
+    char FmtBu[ INET_FMT_SIZE ];
 
     buildIgmp(src, dst, type, code, group, datalen);
 
@@ -389,8 +600,8 @@ void sendIgmp(uint32_t src, uint32_t dst, int type, int code, uint32_t group, in
             my_log(LOG_ERR, errno, "Sender VIF was down.");
         else
             my_log(LOG_INFO, errno,
-                "sendto to %s on %s",
-                inetFmt(dst, s1), inetFmt(src, s2));
+                "sendto to %I on %I",
+                dst, src);
     }
 
     if(setigmpsource) {
@@ -401,8 +612,8 @@ void sendIgmp(uint32_t src, uint32_t dst, int type, int code, uint32_t group, in
         k_set_if(INADDR_ANY);
     }
 
-    my_log(LOG_DEBUG, 0, "SENT %s from %-15s to %s",
+    my_log(LOG_DEBUG, 0, "SENT %s from %-15s to %I",
 	    igmpPacketKind(type, code), src == INADDR_ANY ? "INADDR_ANY" :
-	    inetFmt(src, s1), inetFmt(dst, s2));
+	    inetFmt(src, FmtBu), dst);
 }
 
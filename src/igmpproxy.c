@@ -42,6 +42,8 @@
 #include "version.h"
 #include "build.h"
 
+#include <sys/signalfd.h>
+
 
 
 // Constants
@@ -61,17 +63,14 @@ static const char Usage[] =
 ;
 
 // Local function Prototypes
-static void signalHandler(int);
+static void igmpInput(int fd, void *data);
+static void signalInput(int fd, void *data);
 int     igmpProxyInit(void);
 void    igmpProxyCleanUp(void);
 void    igmpProxyRun(void);
 
 // Global vars...
-static int sighandled = 0;
-#define	GOT_SIGINT	0x01
-#define	GOT_SIGHUP	0x02
-#define	GOT_SIGUSR1	0x04
-#define	GOT_SIGUSR2	0x08
+static int signalFd = -1;
 
 // The upstream VIF index
 int         upStreamVif;   
@@ -104,6 +103,7 @@ int main( int ArgCn, char *ArgVc[] ) {
 
             case 'd':
                 Log2Stderr = LOG_INFO;
+                LogLevel = LOG_DEBUG;
                 /*
             case 'v':
                 // Enable debug mode...
@@ -176,15 +176,27 @@ int main( int ArgCn, char *ArgVc[] ) {
 *   Handles the initial startup of the daemon.
 */
 int igmpProxyInit(void) {
-    struct sigaction sa;
+    sigset_t mask;
     int Err;
 
+    // The signals are read from a signalfd in the main loop...
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    signalFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signalFd < 0) {
+        my_log(LOG_ERR, errno, "signalfd");
+        return 0;
+    }
+
+    // Messages are written by a thread from here on, if configured...
+    logRingInit(getCommonConfig()->logRingSize);
 
-    sa.sa_handler = signalHandler;
-    sa.sa_flags = 0;    /* Interrupt system calls */
-    sigemptyset(&sa.sa_mask);
-    sigaction(SIGTERM, &sa, NULL);
-    sigaction(SIGINT, &sa, NULL);
+    if (!reactorInit())
+        return 0;
 
     // Loads configuration for Physical interfaces...
     buildIfVc();    
@@ -192,6 +204,9 @@ int igmpProxyInit(void) {
     // Configures IF states and settings
     configureVifs();
 
+    // Follow link changes of the interfaces...
+    watchIfChanges();
+
     switch ( Err = enableMRouter() ) {
     case 0: break;
     case EADDRINUSE: my_log( LOG_ERR, EADDRINUSE, "MC-Router API already in use" ); break;
@@ -243,6 +258,18 @@ int igmpProxyInit(void) {
     // Initialize member database for merge each of downstream statas.
     memberDatabaseInit();
 
+    // Initialize the explicit tracking of hosts.
+    hostInit();
+
+    // Start passing route removals on to the forwarding engine.
+    offloadInit();
+
+    // Pick up the groups and routes of the previous run.
+    stateInit();
+
+    // Start from what the kernel really holds.
+    reconcileMRoutes();
+
     return 1;
 }
 
@@ -253,9 +280,16 @@ void igmpProxyCleanUp(void) {
 
     my_log( LOG_DEBUG, 0, "clean handler called" );
     
+    stateCleanUp();         // Save the state for a warm restart.
     free_all_callouts();    // No more timeouts.
     clearAllRoutes();       // Remove all routes.
     disableMRouter();       // Disable the multirout API
+    offloadCleanUp();       // Finish and report the forwarding engine updates.
+    poolLogStats();         // Report the memory used.
+    igmpLogStats();         // Report the input counters.
+    reactorCleanUp();       // Close the event loop.
+    logRingLogStats();      // Report the messages dropped.
+    logRingCleanUp();       // Write the messages left, and log directly.
 
 }
 
@@ -263,137 +297,54 @@ void igmpProxyCleanUp(void) {
 *   Main daemon loop.
 */
 void igmpProxyRun(void) {
-    // Get the config.
-    //struct Config *config = getCommonConfig();
-    // Set some needed values.
-    register int recvlen;
-    int     MaxFD, Rt, secs;
-    fd_set  ReadFDS;
-    socklen_t dummy = 0;
-    struct sockaddr_in	saddr;
-    struct  timeval  curtime, lasttime, difftime, tv; 
-    // The timeout is a pointer in order to set it to NULL if nessecary.
-    struct  timeval  *timeout = &tv;
-
-    // Initialize timer vars
-    difftime.tv_usec = 0;
-    gettimeofday(&curtime, NULL);
-    lasttime = curtime;
-
     // First thing we send a membership query in downstream VIF's...
     struct  IfDesc  *Dp;
     int             Ix;
     for ( Ix = 0; (Dp = getIfByIx(Ix)); Ix++ ) 
         sendGeneralMembershipQuery(Dp);
 
-    // Loop until the end...
-    for (;;) {
-
-        // Process signaling...
-        if (sighandled) {
-            if (sighandled & GOT_SIGINT) {
-                sighandled &= ~GOT_SIGINT;
-                my_log(LOG_NOTICE, 0, "Got a interupt signal. Exiting.");
-                break;
-            }
-        }
-
-        // Prepare timeout...
-        secs = timer_nextTimer();
-        if(secs == -1) {
-            timeout = NULL;
-        } else {
-            timeout->tv_usec = 0;
-            timeout->tv_sec = secs;
-        }
-
-        // Prepare for select.
-        MaxFD = MRouterFD;
-
-        FD_ZERO( &ReadFDS );
-        FD_SET( MRouterFD, &ReadFDS );
+    // Read IGMP requests, and handle them...
+    reactorAddFd(MRouterFD, igmpInput, NULL);
+    reactorAddFd(signalFd, signalInput, NULL);
 
-        // wait for input or time out
-        Rt = select( MaxFD +1, &ReadFDS, NULL, NULL, timeout );
-
-        // log and ignore failures
-        if( Rt < 0 ) {
-            my_log( LOG_WARNING, errno, "select() failure" );
-            continue;
-        }
-        else if( Rt > 0 ) {
-
-            // Read IGMP request, and handle it...
-            if( FD_ISSET( MRouterFD, &ReadFDS ) ) {
-                dummy = sizeof(saddr);
-                recvlen = recvfrom(MRouterFD, recv_buf, RECV_BUF_SIZE,
-                                   0, (struct sockaddr *)&saddr, &dummy);
-                if (recvlen < 0) {
-                    if (errno != EINTR) my_log(LOG_ERR, errno, "recvfrom");
-                    continue;
-                }
-                
-
-                acceptIgmp(recvlen);
-            }
-        }
-
-        // At this point, we can handle timeouts...
-        do {
-            /*
-             * If the select timed out, then there's no other
-             * activity to account for and we don't need to
-             * call gettimeofday.
-             */
-            if (Rt == 0) {
-                curtime.tv_sec = lasttime.tv_sec + secs;
-                curtime.tv_usec = lasttime.tv_usec;
-                Rt = -1; /* don't do this next time through the loop */
-            } else {
-                gettimeofday(&curtime, NULL);
-            }
-            difftime.tv_sec = curtime.tv_sec - lasttime.tv_sec;
-            difftime.tv_usec += curtime.tv_usec - lasttime.tv_usec;
-            while (difftime.tv_usec > 1000000) {
-                difftime.tv_sec++;
-                difftime.tv_usec -= 1000000;
-            }
-            if (difftime.tv_usec < 0) {
-                difftime.tv_sec--;
-                difftime.tv_usec += 1000000;
-            }
-            lasttime = curtime;
-            if (secs == 0 || difftime.tv_sec > 0)
-                age_callout_queue(difftime.tv_sec);
-            secs = -1;
-        } while (difftime.tv_sec > 0);
-
-    }
+    // Loop until the end...
+    reactorRun();
+}
 
+/*
+ * Read the IGMP requests pending on the socket.
+ */
+static void igmpInput(int fd, void *data) {
+    igmpRecvBatch();
 }
 
 /*
- * Signal handler.  Take note of the fact that the signal arrived
- * so that the main loop can take care of it.
+ * Signal handler. The signals are blocked and read from a signalfd,
+ * so they are handled synchronously in the main loop.
  */
-static void signalHandler(int sig) {
-    switch (sig) {
-    case SIGINT:
-    case SIGTERM:
-        sighandled |= GOT_SIGINT;
-        break;
-        /* XXX: Not in use.
-        case SIGHUP:
-            sighandled |= GOT_SIGHUP;
+static void signalInput(int fd, void *data) {
+    struct signalfd_siginfo si;
+
+    while (read(fd, &si, sizeof(si)) == sizeof(si)) {
+        switch (si.ssi_signo) {
+        case SIGINT:
+        case SIGTERM:
+            my_log(LOG_NOTICE, 0, "Got a interupt signal. Exiting.");
+            reactorStop();
             break;
-    
         case SIGUSR1:
-            sighandled |= GOT_SIGUSR1;
+            poolLogStats();
+            igmpLogStats();
+            offloadLogStats();
+            logRouteCounters();
+            logRingLogStats();
             break;
-    
-        case SIGUSR2:
-            sighandled |= GOT_SIGUSR2;
+        case SIGHUP:
+            /* XXX: The config is not reloaded. */
+            my_log(LOG_INFO, 0, "Got a SIGHUP signal. Classifying interfaces.");
+            refreshIfClasses();
+            igmpUpdateFilter();
             break;
-        */
+        }
     }
 }
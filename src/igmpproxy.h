@@ -62,6 +62,11 @@
 
 #define IGMPv3_PROXY                           (1)
 
+// Ethernet and VLAN interfaces are forwarded by the FPP, not the kernel.
+#ifndef MC4_CHANGES
+#define MC4_CHANGES                            1
+#endif
+
 #define INVAILD_TIMER                          (0)
 
 static const unsigned short endian_test_word = 0x0101;
@@ -234,14 +239,20 @@ struct igmpv3_query {
  * External declarations for global variables and functions.
  */
 #define RECV_BUF_SIZE 8192
+#define DEFAULT_RECV_BATCH  32
+#define MAX_RECV_BATCH      256
+
+// Seconds between counter polls when only an idle timeout is set.
+#define DEFAULT_MFC_POLL    30
+
+// Seconds between reconciliations of the kernel routes by default.
+#define DEFAULT_MFC_RECONCILE 300
+
+// Most slots in the asynchronous log ring.
+#define MAX_LOG_RING        65536
 extern char     *recv_buf;
 extern char     *send_buf;
 
-extern char     s1[];
-extern char     s2[];
-extern char		s3[];
-extern char		s4[];
-
 
 
 //#################################################################################
@@ -253,7 +264,49 @@ extern char		s4[];
 extern bool Log2Stderr;           // Log to stderr instead of to syslog
 extern int  LogLevel;             // Log threshold, LOG_WARNING .... LOG_DEBUG 
 
-void my_log( int Serverity, int Errno, const char *FmtSt, ... );
+// Levels above this one are left out of the build, for example
+// -DLOG_COMPILE_LEVEL=LOG_INFO drops all debug messages.
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL   LOG_DEBUG
+#endif
+
+// Set if messages of the level are written at all...
+#define LOG_ENABLED(Severity) \
+    ((Severity) <= LOG_COMPILE_LEVEL && Log2Stderr && (Severity) <= LogLevel)
+
+// The arguments are only evaluated for messages that are written. On
+// top of the printf() conversions, %I formats an IPv4 address passed
+// as a uint32_t in network order.
+#define my_log(Severity, Errno, ...)                            \
+    do {                                                        \
+        if (LOG_ENABLED(Severity))                              \
+            logWrite((Severity), (Errno), __VA_ARGS__);         \
+    } while (0)
+
+void logWrite( int Serverity, int Errno, const char *FmtSt, ... );
+int logRingInit( unsigned slots );
+void logRingLogStats( void );
+void logRingCleanUp( void );
+
+/* hash.c
+ */
+struct addr_hash {
+    uint64_t            *keys;      /* address, or (source << 32) | group */
+    void                **vals;     /* NULL marks an empty slot */
+    unsigned            bits;
+    unsigned            size;
+    unsigned            count;
+};
+
+void addrHashInit(struct addr_hash *h);
+void addrHashFree(struct addr_hash *h);
+void addrHashForEach(const struct addr_hash *h, void (*fn)(void *val, void *arg), void *arg);
+void *addrHashLookup(const struct addr_hash *h, uint32_t key);
+int addrHashInsert(struct addr_hash *h, uint32_t key, void *val);
+void *addrHashRemove(struct addr_hash *h, uint32_t key);
+void *sgHashLookup(const struct addr_hash *h, uint32_t src, uint32_t grp);
+int sgHashInsert(struct addr_hash *h, uint32_t src, uint32_t grp, void *val);
+void *sgHashRemove(struct addr_hash *h, uint32_t src, uint32_t grp);
 
 /* ifvc.c
  */
@@ -274,8 +327,11 @@ void my_log( int Serverity, int Errno, const char *FmtSt, ... );
 #define INTERVAL_QUERY_RESPONSE  10
 //#define INTERVAL_QUERY_RESPONSE  10
 
-#define IGMP_OQPI		((DEFAULT_ROBUSTNESS * INTERVAL_QUERY) + INTERVAL_QUERY_RESPONSE/2)
-#define IGMP_GMI		((DEFAULT_ROBUSTNESS * INTERVAL_QUERY) + INTERVAL_QUERY_RESPONSE)
+#define DEFAULT_LMQI           1000  // Last member query interval (ms)
+
+// Timers in milliseconds
+#define IGMP_OQPI		(((DEFAULT_ROBUSTNESS * INTERVAL_QUERY) + INTERVAL_QUERY_RESPONSE/2) * 1000)
+#define IGMP_GMI		(((DEFAULT_ROBUSTNESS * INTERVAL_QUERY) + INTERVAL_QUERY_RESPONSE) * 1000)
 
 #define ROUTESTATE_NOTJOINED            0   // The group corresponding to route is not joined
 #define ROUTESTATE_JOINED               1   // The group corresponding to route is joined
@@ -292,7 +348,6 @@ void my_log( int Serverity, int Errno, const char *FmtSt, ... );
  * @is_scheduled: is this source in the group&source specific query scheduling?
  * @query_retransmission_count: group&source specific query retransmission count
  * @gp: the source belong to the group
- * @list: source list
  */
 struct source {
     struct in_addr   addr;
@@ -302,8 +357,6 @@ struct source {
     int              query_retransmission_count;
 
     struct group     *gp;
-
-    struct list_node list;
 };
 
 /**
@@ -318,9 +371,19 @@ struct source {
  * @is_scheduled: is it in the group specific query scheduling
  * @query_retransmission_count: group specific query retransmission count
  * @query_timer: timer for periodic queries
- * @sources: sources record list head
+ * @srcaddrs: source addresses, sorted
+ * @srcs: source records, in the same order as srcaddrs
  * @nsrcs: sources record number
+ * @srcsize: allocated size of srcaddrs and srcs
  * @nscheduled_src: the number of sources in the scheduling
+ * @contributing: the group is counted in the member database
+ * @contrib_fmode: filter mode the group was counted with
+ * @contrib: source list the group was counted with, sorted
+ * @ncontrib: number of sources in contrib
+ * @contribsize: allocated size of contrib
+ * @hosts: tracked hosts, with explicit tracking
+ * @nhosts: number of tracked hosts
+ * @untracked: the hosts are not all known, leaves need queries
  * @list: group list
  */
 struct group {
@@ -338,48 +401,107 @@ struct group {
     int              query_timer;
     
 
-    struct list_head sources;
+    uint32_t         *srcaddrs;
+    struct source    **srcs;
     int              nsrcs;
+    int              srcsize;
     int              nscheduled_src; /* FIXME */
 
+    int              contributing;
+    int              contrib_fmode;
+    uint32_t         *contrib;
+    int              ncontrib;
+    int              contribsize;
+
+    struct list_head hosts;
+    int              nhosts;
+    int              untracked;
+
     struct list_node list;
 };
 
 /**
- * struct source_in_member - an source record in member record
- * @addr: source address
- * @list: source list
+ * struct host - a receiver tracked on a downstream interface
+ * @addr: host address
+ * @fmode: filter mode of the host, INCLUDE or EXCLUDE
+ * @srcaddrs: sources the host includes or excludes, sorted
+ * @nsrcs: number of sources
+ * @srcsize: allocated size of srcaddrs
+ * @timer: host timer, the record is dropped when it expires
+ * @gp: the group the host reported
+ * @list: host list of the group
  */
-struct source_in_member {
-    struct in_addr   addr;
+struct host {
+    uint32_t         addr;
+    int              fmode;
+    uint32_t         *srcaddrs;
+    int              nsrcs;
+    int              srcsize;
+    int              timer;
 
+    struct group     *gp;
     struct list_node list;
 };
 
+/**
+ * struct member_source - a source counted over the interfaces
+ * @addr: source address
+ * @ninc: number of INCLUDE mode interfaces listing the source
+ * @nexc: number of EXCLUDE mode interfaces listing the source
+ */
+struct member_source {
+    uint32_t         addr;
+    int              ninc;
+    int              nexc;
+};
+
 /**
  * struct member - an membership record
  * @mcast: group address
  * @fmode: filter mode, INCLUDE or EXCLUDE
- * @sources: sources record list head
+ * @srcaddrs: source addresses, sorted
  * @nsrcs: sources record number in the group
+ * @srcsize: allocated size of srcaddrs
+ * @aggr: per source interface counts, sorted by address
+ * @naggr: number of records in aggr
+ * @aggrsize: allocated size of aggr
+ * @nifs: number of interfaces joined to the group
+ * @nexcl: number of interfaces in EXCLUDE mode
+ * @vif: interface of the last report
+ * @changed: queued in the dirty list of the database
  * @list: group list
+ * @dirty: dirty list node
  */
 struct member {
     struct in_addr   mcast;
     int              fmode;
-    struct list_head sources;
+    uint32_t         *srcaddrs;
     int              nsrcs;
+    int              srcsize;
+
+    struct member_source *aggr;
+    int              naggr;
+    int              aggrsize;
+    int              nifs;
+    int              nexcl;
+    int              vif;
+    int              changed;
 
     struct list_node list;
+    struct list_node dirty;
 };
 
 /**
  * struct member_db - an membership database
  * @members: membership list head
+ * @dirty: memberships waiting for the upstream update
+ * @hash: memberships by group address
  * @nmems: number of memberships
  */
 struct member_db {
     struct list_head members;
+    struct list_head dirty;
+    struct addr_hash hash;
     int              nmems;
 };
 
@@ -431,16 +553,68 @@ struct IfDesc {
     unsigned char       threshold;   /* ttl limit */
     unsigned int        ratelimit; 
     unsigned int        index;		/* VIF index */
+    int                 ifindex;        /* system interface index */
+    bool                fppForwarded;   /* forwarded by the FPP, see classifyIf() */
 
     bool                isQuerier;      /* am I a querier ? */
     int                 queryTimer;         /* query timer (125s) */
     int                 queryResponseTimer; /* query response interval timer(10s) */
     int                 otherQuerierPresentTimer;
+    bool                explicitTracking; /* track the hosts, leave at once */
 
     struct list_head    groups;
+    struct addr_hash    groupHash;  /* groups by address */
     int                 ngps;   /* number of groups */
 };
 
+/* pool.c
+ */
+enum {
+    POOL_TIMER,
+    POOL_GROUP,
+    POOL_SOURCE,
+    POOL_MEMBER,
+    POOL_HOST,
+    POOL_ROUTESRC,
+    POOL_MFC,
+    POOL_MAX
+};
+
+int poolLookupName(const char *name);
+void poolInit(int type, size_t objsize);
+void *poolAlloc(int type);
+void poolFree(int type, void *obj);
+void poolLogStats(void);
+
+/* offload.c
+ */
+enum {
+    OFFLOAD_NONE,
+    OFFLOAD_CMM,
+    OFFLOAD_STUB,
+    OFFLOAD_MAX
+};
+
+enum {
+    OFFLOAD_OP_ADD,
+    OFFLOAD_OP_DEL
+};
+
+struct offloadOp {
+    int                 type;       /* OFFLOAD_OP_ADD or OFFLOAD_OP_DEL */
+    struct in_addr      origin;
+    struct in_addr      group;
+};
+
+int offloadLookupName(const char *name);
+void offloadInit(void);
+void offloadAdd(struct in_addr origin, struct in_addr group);
+void offloadDel(struct in_addr origin, struct in_addr group);
+void offloadFlush(void);
+void offloadLogStats(void);
+void offloadCleanUp(void);
+const struct offloadOp *offloadStubOps(unsigned *count);
+
 // Keeps common configuration settings 
 struct Config {
     unsigned int        robustnessValue;
@@ -449,11 +623,29 @@ struct Config {
     // Used on startup..
     unsigned int        startupQueryInterval;
     unsigned int        startupQueryCount;
-    // Last member probe...
+    // Last member probe, interval in milliseconds...
     unsigned int        lastMemberQueryInterval;
     unsigned int        lastMemberQueryCount;
     // Set if upstream leave messages should be sent instantly..
     unsigned short      fastUpstreamLeave;
+    // Objects to preallocate in each pool...
+    unsigned int        poolSize[POOL_MAX];
+    // Packets read from the IGMP socket per recvmmsg() call...
+    unsigned int        recvBatch;
+    // Set if kernel routes are sent in batches over rtnetlink...
+    unsigned short      mfcNetlink;
+    // Backend updating the forwarding engine, OFFLOAD_*...
+    int                 offloadBackend;
+    // Seconds between polls of the kernel route counters, 0 for none...
+    unsigned int        mfcPollInterval;
+    // Seconds without traffic before a route source is removed, 0 for never...
+    unsigned int        mfcIdleTimeout;
+    // Seconds between reconciliations of the kernel routes, 0 for none...
+    unsigned int        mfcReconcileInterval;
+    // File keeping the state across restarts, NULL for cold starts...
+    char                *stateFile;
+    // Slots in the asynchronous log ring, 0 for synchronous logging...
+    unsigned int        logRingSize;
 };
 
 // Defines the Index of the upstream VIF...
@@ -466,6 +658,9 @@ struct IfDesc *getIfByName( const char *IfName );
 struct IfDesc *getIfByIx( unsigned Ix );
 struct IfDesc *getIfByAddress( uint32_t Ix );
 int isAdressValidForIf(struct IfDesc* intrface, uint32_t ipaddr);
+int classifyIf( struct IfDesc *Dp );
+void refreshIfClasses( void );
+int watchIfChanges( void );
 
 /* mroute-api.c
  */
@@ -484,6 +679,10 @@ void disableMRouter( void );
 void addVIF( struct IfDesc *Dp );
 int addMRoute( struct MRouteDesc * Dp );
 int delMRoute( struct MRouteDesc * Dp );
+void flushMRoutes( void );
+void forgetMRoute( uint32_t Origin, uint32_t McAdr );
+void reconcileMRoutes( void );
+int getMRouteCounters( uint32_t Origin, uint32_t McAdr, unsigned long *Pkts, unsigned long *Bytes );
 int getVifIx( struct IfDesc *IfDp );
 
 /* config.c
@@ -507,11 +706,17 @@ buildIgmpv3Query(uint32_t src, uint32_t dst, /* IP src + dst */
 void sendIgmpv3query(uint32_t src, uint32_t dst, uint32_t len);
 #endif
 void initIgmp(void);
-void acceptIgmp(int);
+void igmpUpdateFilter(void);
+void igmpRecvBatch(void);
+void igmpLogStats(void);
+void acceptIgmp(char *buf, int recvlen);
 void sendIgmp (uint32_t, uint32_t, int, int, uint32_t,int);
 
 /* lib.c
  */
+// Room for the longest inetFmt() or inetFmts() text, "255.255.255.255/32".
+#define INET_FMT_SIZE   19
+
 char   *fmtInAdr( char *St, struct in_addr InAdr );
 char   *inetFmt(uint32_t addr, char *s);
 char   *inetFmts(uint32_t addr, uint32_t mask, char *s);
@@ -549,6 +754,12 @@ int leaveSpecificMcGroup( int UdpSock, struct IfDesc *IfDp, uint32_t mcastaddr )
  */
 void initRouteTable(void);
 void clearAllRoutes(void);
+struct RouteTable;
+struct RouteTable *findRoute(uint32_t group);
+struct RouteTable *findActiveRoute(uint32_t originAddr, uint32_t group);
+void reloadKernelRoutes(void);
+void logRouteCounters(void);
+void forEachRouteSource(void (*fn)(uint32_t group, uint32_t origin, void *arg), void *arg);
 int insertRoute(uint32_t group, int ifx);
 int activateRoute(uint32_t group, uint32_t originAddr);
 void ageActiveRoutes(void);
@@ -567,17 +778,51 @@ void acceptLeaveMessage(uint32_t src, uint32_t group);
 void sendGeneralMembershipQuery(void *argument);
 #if defined(IGMPv3_PROXY)
 void acceptIGMPMembershipQuery(uint32_t src, uint8_t type, char *buffer, uint32_t len);
-void acceptIGMPv3GroupReport(uint32_t src, uint8_t type, char *buffer);
+void acceptIGMPv3GroupReport(uint32_t src, uint8_t type, char *buffer, int len);
 void sendGroupSpecificMembershipQuery(void *argument);
 void sendGroupSourceSpecificMembershipQuery(void *argument, int with_sflag, uint32_t nsrcs, uint32_t *srcs); 
 struct group *interfaceGroupLookup(struct IfDesc *sourceVif, uint32_t groupAddr);
 struct group *interfaceGroupAdd(struct IfDesc *sourceVif, uint32_t groupAddr);
 struct source *groupSourceLookup(struct group *gp, uint32_t sourceAddr);
+void processModeIsInclude(struct IfDesc *sourceVif, struct group *gp, int numsrc, uint32_t *sources);
+void processModeIsExclude(struct IfDesc *sourceVif, struct group *gp, int numsrc, uint32_t *sources);
+void groupTimerTimeout(void *arg);
+void sourceTimerTimeout(void *arg);
+void oldHostTimerTimeout(void *arg);
 #endif
+void memberDatabaseInit(void);
+void memberDatabaseFlush(void);
+
+/* state.c
+ */
+int stateSave(void);
+void stateInit(void);
+void stateCleanUp(void);
 
 
+/* host.c
+ */
+void hostInit(void);
+void hostReport(struct group *gp, uint32_t hostAddr, int type, int numsrc, uint32_t *sources);
+int hostWantsGroup(struct group *gp);
+int hostWantsSource(struct group *gp, uint32_t srcAddr);
+void hostFlush(struct group *gp);
+
+/* reactor.c
+ */
+typedef void (*reactor_f)(int fd, void *data);
+
+int reactorInit(void);
+int reactorAddFd(int fd, reactor_f func, void *data);
+void reactorDelFd(int fd);
+void reactorRun(void);
+void reactorStop(void);
+void reactorCleanUp(void);
+
 /* callout.c 
 */
+#define TIMER_TICK_MS   10      // resolution of the timers, delays are in ms
+
 typedef void (*timer_f)(void *);
 
 void callout_init(void);
@@ -109,8 +109,8 @@ void k_set_if(uint32_t ifa) {
     adr.s_addr = ifa;
     if (setsockopt(MRouterFD, IPPROTO_IP, IP_MULTICAST_IF,
                    (char *)&adr, sizeof(adr)) < 0)
-        my_log(LOG_ERR, errno, "setsockopt IP_MULTICAST_IF %s",
-            inetFmt(ifa, s1));
+        my_log(LOG_ERR, errno, "setsockopt IP_MULTICAST_IF %I",
+            ifa);
 }
 
 /*
@@ -122,8 +122,8 @@ void k_join(uint32_t grp, uint32_t ifa) {
 
     if (setsockopt(MRouterFD, IPPROTO_IP, IP_ADD_MEMBERSHIP,
                    (char *)&mreq, sizeof(mreq)) < 0)
-        my_log(LOG_WARNING, errno, "can't join group %s on interface %s",
-            inetFmt(grp, s1), inetFmt(ifa, s2));
+        my_log(LOG_WARNING, errno, "can't join group %I on interface %I",
+            grp, ifa);
 }
 
 
@@ -135,7 +135,7 @@ void k_leave(uint32_t grp, uint32_t ifa) {
 
     if (setsockopt(MRouterFD, IPPROTO_IP, IP_DROP_MEMBERSHIP,
                    (char *)&mreq, sizeof(mreq)) < 0)
-        my_log(LOG_WARNING, errno, "can't leave group %s on interface %s",
-            inetFmt(grp, s1), inetFmt(ifa, s2));
+        my_log(LOG_WARNING, errno, "can't leave group %I on interface %I",
+            grp, ifa);
 }
 */
@@ -35,12 +35,42 @@
 #include "igmpproxy.h"
 
 /*
- * Exported variables.
+ * Decimal text of each address byte, for inetFmt().
  */
-char s1[19];        /* buffers to hold the string representations  */
-char s2[19];        /* of IP addresses, to be passed to inet_fmt() */
-char s3[19];        /* or inet_fmts().                             */
-char s4[19];
+static const char octetText[256][4] = {
+    "0", "1", "2", "3", "4", "5", "6", "7",
+    "8", "9", "10", "11", "12", "13", "14", "15",
+    "16", "17", "18", "19", "20", "21", "22", "23",
+    "24", "25", "26", "27", "28", "29", "30", "31",
+    "32", "33", "34", "35", "36", "37", "38", "39",
+    "40", "41", "42", "43", "44", "45", "46", "47",
+    "48", "49", "50", "51", "52", "53", "54", "55",
+    "56", "57", "58", "59", "60", "61", "62", "63",
+    "64", "65", "66", "67", "68", "69", "70", "71",
+    "72", "73", "74", "75", "76", "77", "78", "79",
+    "80", "81", "82", "83", "84", "85", "86", "87",
+    "88", "89", "90", "91", "92", "93", "94", "95",
+    "96", "97", "98", "99", "100", "101", "102", "103",
+    "104", "105", "106", "107", "108", "109", "110", "111",
+    "112", "113", "114", "115", "116", "117", "118", "119",
+    "120", "121", "122", "123", "124", "125", "126", "127",
+    "128", "129", "130", "131", "132", "133", "134", "135",
+    "136", "137", "138", "139", "140", "141", "142", "143",
+    "144", "145", "146", "147", "148", "149", "150", "151",
+    "152", "153", "154", "155", "156", "157", "158", "159",
+    "160", "161", "162", "163", "164", "165", "166", "167",
+    "168", "169", "170", "171", "172", "173", "174", "175",
+    "176", "177", "178", "179", "180", "181", "182", "183",
+    "184", "185", "186", "187", "188", "189", "190", "191",
+    "192", "193", "194", "195", "196", "197", "198", "199",
+    "200", "201", "202", "203", "204", "205", "206", "207",
+    "208", "209", "210", "211", "212", "213", "214", "215",
+    "216", "217", "218", "219", "220", "221", "222", "223",
+    "224", "225", "226", "227", "228", "229", "230", "231",
+    "232", "233", "234", "235", "236", "237", "238", "239",
+    "240", "241", "242", "243", "244", "245", "246", "247",
+    "248", "249", "250", "251", "252", "253", "254", "255",
+};
             
 /*
 ** Formats 'InAdr' into a dotted decimal string. 
@@ -49,24 +79,30 @@ char s4[19];
 **          
 */
 char *fmtInAdr( char *St, struct in_addr InAdr ) {
-    sprintf( St, "%u.%u.%u.%u", 
-             ((uint8_t *)&InAdr.s_addr)[ 0 ],
-             ((uint8_t *)&InAdr.s_addr)[ 1 ],
-             ((uint8_t *)&InAdr.s_addr)[ 2 ],
-             ((uint8_t *)&InAdr.s_addr)[ 3 ] );
-
-    return St;
+    return inetFmt( InAdr.s_addr, St );
 }
 
 /*
  * Convert an IP address in u_long (network) format into a printable string.
+ * 's' must hold INET_ADDRSTRLEN bytes.
  */
 char *inetFmt(uint32_t addr, char *s) {
-    register u_char *a;
-
-    a = (u_char *)&addr;
-    memset(s, 0, 19);
-    sprintf(s, "%u.%u.%u.%u", a[0], a[1], a[2], a[3]);
+    const u_char *a = (const u_char *)&addr;
+    char *p = s;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        const char *d = octetText[a[i]];
+
+        *p++ = d[0];
+        if (d[1]) {
+            *p++ = d[1];
+            if (d[2])
+                *p++ = d[2];
+        }
+        *p++ = '.';
+    }
+    p[-1] = '\0';
     return(s);
 }
 
@@ -115,32 +151,50 @@ char *inetFmts(uint32_t addr, uint32_t mask, char *s) {
  *
  */
 uint16_t inetChksum(uint16_t *addr, int len) {
-    register int nleft = (int)len;
-    register u_short *w = addr;
+    register const u_char *p = (const u_char *)addr;
+    register int nleft = len;
+    uint64_t sum = 0;
+    uint32_t w[4];
     u_short answer = 0;
-    register int sum = 0;
 
     /*
-     *  Our algorithm is simple, using a 32 bit accumulator (sum),
-     *  we add sequential 16 bit words to it, and at the end, fold
-     *  back all the carry bits from the top 16 bits into the lower
-     *  16 bits.
+     *  Adds 32 bit words to a 64 bit accumulator, 16 bytes per round.
+     *  The one's complement sum of the 32 bit words folds down to the
+     *  sum of the 16 bit words, in the same byte order, so only the
+     *  final fold differs from the 16 bit loop.
      */
-    while (nleft > 1) {
-        sum += *w++;
+    while (nleft >= 16) {
+        memcpy(w, p, sizeof(w));
+        sum += (uint64_t)w[0] + w[1] + w[2] + w[3];
+        p += 16;
+        nleft -= 16;
+    }
+    while (nleft >= 4) {
+        memcpy(w, p, 4);
+        sum += w[0];
+        p += 4;
+        nleft -= 4;
+    }
+    if (nleft >= 2) {
+        memcpy(&answer, p, 2);
+        sum += answer;
+        p += 2;
         nleft -= 2;
     }
 
     /* mop up an odd byte, if necessary */
     if (nleft == 1) {
-        *(u_char *) (&answer) = *(u_char *)w ;
+        answer = 0;
+        *(u_char *) (&answer) = *p;
         sum += answer;
     }
 
     /*
-     * add back carry outs from top 16 bits to low 16 bits
+     * add back carry outs from the top 48 bits to low 16 bits
      */
-    sum = (sum >> 16) + (sum & 0xffff); /* add hi 16 to low 16 */
+    sum = (sum >> 32) + (sum & 0xffffffff);
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum = (sum >> 16) + (sum & 0xffff);
     sum += (sum >> 16);         /* add carry */
     answer = ~sum;              /* truncate to 16 bits */
     return(answer);
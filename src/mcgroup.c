@@ -65,8 +65,8 @@ static int joinleave( int Cmd, int UdpSock, struct IfDesc *IfDp, uint32_t mcasta
     CtlReq.imr_interface.s_addr = IfDp->InAdr.s_addr;
     
     {
-        my_log( LOG_NOTICE, 0, "%sMcGroup: %s on %s", CmdSt, 
-            inetFmt( mcastaddr, s1 ), IfDp ? IfDp->Name : "<any>" );
+        my_log( LOG_NOTICE, 0, "%sMcGroup: %I on %s", CmdSt, 
+            mcastaddr, IfDp ? IfDp->Name : "<any>" );
     }
     
     if( setsockopt( UdpSock, IPPROTO_IP, 
@@ -137,56 +137,53 @@ void setSourceFilter(int UdpSock, struct member *mb) {
     assert(mb != NULL);
 
     struct IfDesc *upStreamIf = NULL;
-    struct source_in_member *src_in_mb = NULL;
-    int nnodes = 0;
             
     upStreamIf = getIfByIx( upStreamVif );
 
-#define	MAX_ADDRS 500
-    char buffer[IP_MSFILTER_SIZE(MAX_ADDRS)];
-    memset(buffer, IP_MSFILTER_SIZE(MAX_ADDRS), 0);
+    struct ip_msfilter fallback;
     struct ip_msfilter *imsfp = NULL;
     int i = 0;
 
     // Sanitycheck the group adress...
     if( ! IN_MULTICAST( ntohl(mb->mcast.s_addr) )) {
-        my_log(LOG_WARNING, 0, "The group address %s is not a valid Multicast group. set source filter failed.",
-            inetFmt(mb->mcast.s_addr, s1));
+        my_log(LOG_WARNING, 0, "The group address %I is not a valid Multicast group. set source filter failed.",
+            mb->mcast.s_addr);
         return;
     } else {
-        my_log(LOG_WARNING, 0, "The group address is %s\tmode %s, number of source is %d",
-            inetFmt(mb->mcast.s_addr, s1), mb->fmode ? "INCLUDE" : "EXCLUDE", mb->nsrcs);
+        my_log(LOG_WARNING, 0, "The group address is %I\tmode %s, number of source is %d",
+            mb->mcast.s_addr, mb->fmode ? "INCLUDE" : "EXCLUDE", mb->nsrcs);
     }
-    
-    imsfp = (struct ip_msfilter *) &buffer;
-#if 1
-    imsfp->imsf_multiaddr = mb->mcast;
-    imsfp->imsf_interface = upStreamIf->InAdr;
-#else
-    imsfp->imsf_multiaddr = mb->mcast.s_addr;
-    imsfp->imsf_interface = upStreamIf->InAdr.s_addr;
-#endif
-    imsfp->imsf_fmode  = mb->fmode;
-    imsfp->imsf_numsrc = mb->nsrcs;
-
-    nnodes = mb->nsrcs;
-    list_for_each(&mb->sources, src_in_mb, list) {
-        if (nnodes--) {
-            if(src_in_mb) {
-#if 1
-                imsfp->imsf_slist[i] = src_in_mb->addr;
-#else
-                imsfp->imsf_slist[i] = src_in_mb->addr.s_addr;
-#endif
-                i++;
-            }
+
+    imsfp = calloc(1, IP_MSFILTER_SIZE(mb->nsrcs > 0 ? mb->nsrcs : 1));
+    if (imsfp != NULL) {
+        imsfp->imsf_multiaddr = mb->mcast;
+        imsfp->imsf_interface = upStreamIf->InAdr;
+        imsfp->imsf_fmode  = mb->fmode;
+        imsfp->imsf_numsrc = mb->nsrcs;
+
+        for (i = 0; i < mb->nsrcs; i++) {
+            imsfp->imsf_slist[i].s_addr = mb->srcaddrs[i];
+        }
+
+        if (setsockopt(UdpSock, IPPROTO_IP, IP_MSFILTER, imsfp, IP_MSFILTER_SIZE(mb->nsrcs)) == 0) {
+            free(imsfp);
+            return;
         }
+        my_log(LOG_ERR, errno, "setsockopt IP_MSFILTER fail. nsrcs %d", mb->nsrcs); 
+        free(imsfp);
     }
-    assert(i == mb->nsrcs);
-    assert(mb->nsrcs <= MAX_ADDRS);
 
-    if (setsockopt(UdpSock, IPPROTO_IP, IP_MSFILTER, imsfp, IP_MSFILTER_SIZE(mb->nsrcs)) < 0 ) {
-        my_log(LOG_ERR, errno, "setsockopt IP_MSFILTER fail. nnodes %d", nnodes); 
+    // A stale filter could miss sources just added, receive them all instead
+    my_log(LOG_WARNING, 0, "Unable to set the %d sources of group %I, receiving all sources.",
+        mb->nsrcs, mb->mcast.s_addr);
+    memset(&fallback, 0, sizeof(fallback));
+    fallback.imsf_multiaddr = mb->mcast;
+    fallback.imsf_interface = upStreamIf->InAdr;
+    fallback.imsf_fmode  = IGMP_V3_FMODE_EXCLUDE;
+    fallback.imsf_numsrc = 0;
+
+    if (setsockopt(UdpSock, IPPROTO_IP, IP_MSFILTER, &fallback, IP_MSFILTER_SIZE(0)) < 0 ) {
+        my_log(LOG_ERR, errno, "setsockopt IP_MSFILTER fail for group %I", mb->mcast.s_addr); 
     }
 
     return;
@@ -33,7 +33,11 @@
 /**
 *   mroute-api.c
 *
-*   This module contains the interface routines to the Linux mrouted API
+*   This module contains the interface routines to the Linux mrouted API.
+*   Kernel routes are set with setsockopt(), or when configured, queued
+*   and sent in batches over rtnetlink. A copy of every route is kept,
+*   so unchanged routes are not sent again and the kernel can be
+*   reconciled with the copy.
 */
 
 
@@ -41,6 +45,9 @@
 #include "defs.h"
 #include "igmpproxy.h"
 
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
 // MAX_MC_VIFS from mclab.h must have same value as MAXVIFS from mroute.h
 #if MAX_MC_VIFS != MAXVIFS
 # error "constants don't match, correct mclab.h"
@@ -56,8 +63,261 @@ char        *send_buf;           /* output packet buffer        */
 // my internal virtual interfaces descriptor vector  
 static struct VifDesc {
     struct IfDesc *IfDp;
+    unsigned       ifindex;     // system index of the interface, for rtnetlink
 } VifDescVc[ MAXVIFS ];
 
+// rtnetlink socket for kernel routes, -1 when setsockopt() is used
+static int          mfcNlFd = -1;
+static uint32_t     mfcNlSeq;
+
+// Largest IPMR route message: addresses, input interface and one hop per VIF
+#define MFC_NL_BATCH    64
+#define MFC_NL_MSGSIZE  ( NLMSG_SPACE( sizeof( struct rtmsg ) )             \
+                        + 3 * RTA_SPACE( sizeof( uint32_t ) )               \
+                        + RTA_SPACE( MAXVIFS * sizeof( struct rtnexthop ) ) )
+
+// Routes queued for the next batch, and the messages carrying them
+static struct MfcNlPending {
+    int                 type;
+    struct MRouteDesc   desc;
+} mfcNlPending[ MFC_NL_BATCH ];
+static unsigned     mfcNlCount;
+static char         mfcNlBuf[ MFC_NL_BATCH * MFC_NL_MSGSIZE ]
+                        __attribute__(( aligned( NLMSG_ALIGNTO ) ));
+static unsigned     mfcNlLen;
+
+// Copy of the routes the kernel should hold, by (origin, group)
+struct MfcShadow {
+    struct MRouteDesc   desc;
+    short               synced;     // set while the kernel is believed to match
+    unsigned            gen;        // reconciliation that last found it
+};
+static struct addr_hash mfcShadow;
+static unsigned     mfcShadowGen;
+static unsigned long mfcSkipped;
+
+// Kernel routes and VIFs as the kernel shows them
+#define MFC_CACHE_FILE  "/proc/net/ip_mr_cache"
+#define MFC_VIF_FILE    "/proc/net/ip_vif"
+
+// Delay before a reconciliation after a failed update, in ms
+#define MFC_RECONCILE_RETRY 1000
+static int          reconcileTimer = INVAILD_TIMER;
+
+static int sockAddMRoute( struct MRouteDesc *Dp );
+static int sockDelMRoute( struct MRouteDesc *Dp );
+static int vifInstall( struct VifDesc *VifDp );
+static void mfcShadowFailed( struct MRouteDesc *Dp );
+static void scheduleReconcile( int delay );
+
+/*
+** Opens the rtnetlink socket used for batched kernel route updates.
+** On failure the routes are set with setsockopt().
+*/
+static void mfcNlOpen( void )
+{
+    struct sockaddr_nl sa;
+    int on = 1;
+
+    mfcNlFd = socket( AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE );
+    if ( mfcNlFd < 0 ) {
+        my_log( LOG_WARNING, errno, "rtnetlink socket, using setsockopt for MFC" );
+        return;
+    }
+
+    memset( &sa, 0, sizeof( sa ) );
+    sa.nl_family = AF_NETLINK;
+    if ( bind( mfcNlFd, (struct sockaddr *)&sa, sizeof( sa ) ) < 0 ) {
+        my_log( LOG_WARNING, errno, "rtnetlink bind, using setsockopt for MFC" );
+        close( mfcNlFd );
+        mfcNlFd = -1;
+        return;
+    }
+
+    // Acks without a copy of the request, if the kernel supports it
+    setsockopt( mfcNlFd, SOL_NETLINK, NETLINK_CAP_ACK, &on, sizeof( on ) );
+
+    my_log( LOG_NOTICE, 0, "Programming MFC entries through rtnetlink" );
+}
+
+/*
+** Closes the rtnetlink socket, later routes go through setsockopt().
+*/
+static void mfcNlClose( void )
+{
+    if ( mfcNlFd >= 0 ) {
+        close( mfcNlFd );
+        mfcNlFd = -1;
+    }
+}
+
+/*
+** Appends an attribute to the message '*nh'.
+*/
+static void mfcNlAddAttr( struct nlmsghdr *nh, int type, const void *data, int len )
+{
+    struct rtattr *rta = (struct rtattr *)( (char *)nh + NLMSG_ALIGN( nh->nlmsg_len ) );
+
+    rta->rta_type = type;
+    rta->rta_len  = RTA_LENGTH( len );
+    memcpy( RTA_DATA( rta ), data, len );
+    nh->nlmsg_len = NLMSG_ALIGN( nh->nlmsg_len ) + RTA_ALIGN( rta->rta_len );
+}
+
+/*
+** Queues the route '*Dp' as a RTM_NEWROUTE or RTM_DELROUTE message
+** for the IPMR family. The batch is sent by flushMRoutes().
+*/
+static int mfcNlQueue( int type, struct MRouteDesc *Dp )
+{
+    struct nlmsghdr *nh;
+    struct rtmsg    *rtm;
+    uint32_t         ifindex;
+    int              Ix, last;
+
+    if ( mfcNlCount == MFC_NL_BATCH )
+        flushMRoutes();
+
+    // Still on rtnetlink if the flush did not fall back
+    if ( mfcNlFd < 0 )
+        return type == RTM_NEWROUTE ? sockAddMRoute( Dp ) : sockDelMRoute( Dp );
+
+    nh = (struct nlmsghdr *)( mfcNlBuf + mfcNlLen );
+    memset( nh, 0, NLMSG_SPACE( sizeof( *rtm ) ) );
+    nh->nlmsg_len   = NLMSG_LENGTH( sizeof( *rtm ) );
+    nh->nlmsg_type  = type;
+    nh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    if ( type == RTM_NEWROUTE )
+        nh->nlmsg_flags |= NLM_F_CREATE | NLM_F_REPLACE;
+    nh->nlmsg_seq   = ++mfcNlSeq;
+
+    // Entries marked as the daemon's own are flushed with the mrouted socket
+    rtm = NLMSG_DATA( nh );
+    rtm->rtm_family   = RTNL_FAMILY_IPMR;
+    rtm->rtm_dst_len  = 32;
+    rtm->rtm_src_len  = 32;
+    rtm->rtm_table    = RT_TABLE_DEFAULT;
+    rtm->rtm_protocol = RTPROT_MROUTED;
+    rtm->rtm_scope    = RT_SCOPE_UNIVERSE;
+    rtm->rtm_type     = RTN_MULTICAST;
+
+    mfcNlAddAttr( nh, RTA_SRC, &Dp->OriginAdr.s_addr, sizeof( uint32_t ) );
+    mfcNlAddAttr( nh, RTA_DST, &Dp->McAdr.s_addr, sizeof( uint32_t ) );
+
+    if ( type == RTM_NEWROUTE ) {
+        struct rtnexthop hops[ MAXVIFS ];
+
+        ifindex = Dp->InVif >= 0 && Dp->InVif < MAXVIFS ? VifDescVc[ Dp->InVif ].ifindex : 0;
+        mfcNlAddAttr( nh, RTA_IIF, &ifindex, sizeof( ifindex ) );
+
+        // The kernel takes the TTLs by position, up to the last one set
+        for ( last = -1, Ix = 0; Ix < MAXVIFS; Ix++ ) {
+            memset( &hops[ Ix ], 0, sizeof( hops[ Ix ] ) );
+            hops[ Ix ].rtnh_len  = sizeof( hops[ Ix ] );
+            hops[ Ix ].rtnh_hops = Dp->TtlVc[ Ix ];
+            if ( Dp->TtlVc[ Ix ] )
+                last = Ix;
+        }
+        if ( last >= 0 )
+            mfcNlAddAttr( nh, RTA_MULTIPATH, hops, ( last + 1 ) * sizeof( hops[ 0 ] ) );
+    }
+
+    my_log( LOG_DEBUG, 0, "Queued %s MFC: %I -> %I, InpVIf: %d",
+         type == RTM_NEWROUTE ? "adding" : "removing",
+         Dp->OriginAdr.s_addr, Dp->McAdr.s_addr,
+         (int)Dp->InVif );
+
+    mfcNlPending[ mfcNlCount ].type = type;
+    mfcNlPending[ mfcNlCount ].desc = *Dp;
+    mfcNlCount++;
+    mfcNlLen += NLMSG_ALIGN( nh->nlmsg_len );
+
+    return 0;
+}
+
+/*
+** Sends the queued kernel routes in one message and reads all the acks.
+** Routes the kernel does not take over rtnetlink are set by setsockopt().
+*/
+void flushMRoutes( void )
+{
+    struct sockaddr_nl sa;
+    char     ackBuf[ 8192 ] __attribute__(( aligned( NLMSG_ALIGNTO ) ));
+    unsigned firstSeq, acked = 0, Ix;
+    int      fallback = 0;
+    ssize_t  len;
+
+    if ( mfcNlCount == 0 )
+        return;
+
+    memset( &sa, 0, sizeof( sa ) );
+    sa.nl_family = AF_NETLINK;
+    firstSeq = mfcNlSeq - mfcNlCount + 1;
+
+    if ( sendto( mfcNlFd, mfcNlBuf, mfcNlLen, 0, (struct sockaddr *)&sa, sizeof( sa ) ) < 0 ) {
+        my_log( LOG_WARNING, errno, "rtnetlink send, using setsockopt for MFC" );
+        fallback = 1;
+        for ( Ix = 0; Ix < mfcNlCount; Ix++ )
+            mfcNlPending[ Ix ].type = -mfcNlPending[ Ix ].type;
+        acked = mfcNlCount;
+    }
+
+    // The kernel handled the batch while sending, so the acks are queued
+    while ( acked < mfcNlCount ) {
+        struct nlmsghdr *nh;
+
+        len = recv( mfcNlFd, ackBuf, sizeof( ackBuf ), MSG_DONTWAIT );
+        if ( len < 0 ) {
+            if ( errno == EINTR )
+                continue;
+            my_log( LOG_WARNING, errno, "rtnetlink ack, %u of %u MFC updates unconfirmed",
+                 mfcNlCount - acked, mfcNlCount );
+            scheduleReconcile( MFC_RECONCILE_RETRY );
+            break;
+        }
+
+        for ( nh = (struct nlmsghdr *)ackBuf; NLMSG_OK( nh, len ); nh = NLMSG_NEXT( nh, len ) ) {
+            struct nlmsgerr *err = NLMSG_DATA( nh );
+            struct MfcNlPending *pd;
+
+            if ( nh->nlmsg_type != NLMSG_ERROR || nh->nlmsg_seq - firstSeq >= mfcNlCount )
+                continue;
+            pd = &mfcNlPending[ nh->nlmsg_seq - firstSeq ];
+            acked++;
+
+            if ( err->error == 0 ) {
+                if ( pd->type == RTM_DELROUTE )
+                    offloadDel( pd->desc.OriginAdr, pd->desc.McAdr );
+            } else if ( err->error == -EOPNOTSUPP ) {
+                // Kernels before 4.7 only take routes by setsockopt()
+                fallback = 1;
+                pd->type = -pd->type;
+            } else {
+                my_log( LOG_WARNING, -err->error, "%s for %I -> %I",
+                     pd->type == RTM_NEWROUTE ? "RTM_NEWROUTE" : "RTM_DELROUTE",
+                     pd->desc.OriginAdr.s_addr,
+                     pd->desc.McAdr.s_addr );
+                mfcShadowFailed( &pd->desc );
+            }
+        }
+    }
+
+    if ( fallback ) {
+        my_log( LOG_NOTICE, 0, "MFC updates over rtnetlink failed, using setsockopt" );
+        mfcNlClose();
+
+        for ( Ix = 0; Ix < mfcNlCount; Ix++ ) {
+            if ( mfcNlPending[ Ix ].type == -RTM_NEWROUTE )
+                sockAddMRoute( &mfcNlPending[ Ix ].desc );
+            else if ( mfcNlPending[ Ix ].type == -RTM_DELROUTE )
+                sockDelMRoute( &mfcNlPending[ Ix ].desc );
+        }
+    }
+
+    mfcNlCount = 0;
+    mfcNlLen = 0;
+}
+
 
 
 /*
@@ -68,6 +328,7 @@ static struct VifDesc {
 */
 int enableMRouter(void)
 {
+    struct Config *conf = getCommonConfig();
     int Va = 1;
 
     if ( (MRouterFD  = socket(AF_INET, SOCK_RAW, IPPROTO_IGMP)) < 0 )
@@ -77,15 +338,35 @@ int enableMRouter(void)
                      (void *)&Va, sizeof( Va ) ) )
         return errno;
 
+    if ( conf->mfcNetlink )
+        mfcNlOpen();
+
+    poolInit( POOL_MFC, sizeof( struct MfcShadow ) );
+    addrHashInit( &mfcShadow );
+
     return 0;
 }
 
+static void mfcShadowFree( void *val, void *arg )
+{
+    poolFree( POOL_MFC, val );
+}
+
 /*
 ** Diables the mrouted API and relases by this the lock.
 **          
 */
 void disableMRouter()
 {
+    // Routes still queued must reach the kernel before it is released
+    flushMRoutes();
+    mfcNlClose();
+
+    // The kernel drops its routes with the socket, and the timers are gone
+    addrHashForEach( &mfcShadow, mfcShadowFree, NULL );
+    addrHashFree( &mfcShadow );
+    reconcileTimer = INVAILD_TIMER;
+
     if ( setsockopt( MRouterFD, IPPROTO_IP, MRT_DONE, NULL, 0 ) 
          || close( MRouterFD )
        ) {
@@ -102,7 +383,6 @@ void disableMRouter()
 */
 void addVIF( struct IfDesc *IfDp )
 {
-    struct vifctl VifCtl;
     struct VifDesc *VifDp;
 
     /* search free VifDesc
@@ -118,6 +398,33 @@ void addVIF( struct IfDesc *IfDp )
         my_log( LOG_ERR, ENOMEM, "addVIF, out of VIF space" );
 
     VifDp->IfDp = IfDp;
+    VifDp->ifindex = if_nametoindex( IfDp->Name );
+
+    // Set the index...
+    VifDp->IfDp->index = VifDp - VifDescVc;
+
+    struct SubnetList *currSubnet;
+    char FmtBu[ INET_FMT_SIZE ];
+    for(currSubnet = IfDp->allowednets; currSubnet; currSubnet = currSubnet->next) {
+	my_log(LOG_DEBUG, 0, "        Network for [%s] : %s",
+	    IfDp->Name,
+	    inetFmts(currSubnet->subnet_addr, currSubnet->subnet_mask, FmtBu));
+    }
+
+    if ( vifInstall( VifDp ) )
+        my_log( LOG_ERR, errno, "MRT_ADD_VIF" );
+
+}
+
+/*
+** Adds the virtual interface '*VifDp' to the kernel
+**
+** returns: - 0 if the function succeeds
+**          - the errno value for non-fatal failure condition
+*/
+static int vifInstall( struct VifDesc *VifDp )
+{
+    struct vifctl VifCtl;
 
     VifCtl.vifc_vifi  = VifDp - VifDescVc; 
     VifCtl.vifc_flags = 0;        /* no tunnel, no source routing, register ? */
@@ -127,33 +434,59 @@ void addVIF( struct IfDesc *IfDp )
     VifCtl.vifc_lcl_addr.s_addr = VifDp->IfDp->InAdr.s_addr;
     VifCtl.vifc_rmt_addr.s_addr = INADDR_ANY;
 
-    // Set the index...
-    VifDp->IfDp->index = VifCtl.vifc_vifi;
-
     my_log( LOG_NOTICE, 0, "adding VIF, Ix %d Fl 0x%x IP 0x%08x %s, Threshold: %d, Ratelimit: %d", 
          VifCtl.vifc_vifi, VifCtl.vifc_flags,  VifCtl.vifc_lcl_addr.s_addr, VifDp->IfDp->Name,
          VifCtl.vifc_threshold, VifCtl.vifc_rate_limit);
 
-    struct SubnetList *currSubnet;
-    for(currSubnet = IfDp->allowednets; currSubnet; currSubnet = currSubnet->next) {
-	my_log(LOG_DEBUG, 0, "        Network for [%s] : %s",
-	    IfDp->Name,
-	    inetFmts(currSubnet->subnet_addr, currSubnet->subnet_mask, s1));
-    }
-
     if ( setsockopt( MRouterFD, IPPROTO_IP, MRT_ADD_VIF, 
                      (char *)&VifCtl, sizeof( VifCtl ) ) )
-        my_log( LOG_ERR, errno, "MRT_ADD_VIF" );
+        return errno;
 
+    return 0;
 }
 
 /*
 ** Adds the multicast routed '*Dp' to the kernel routes
 **
-** returns: - 0 if the function succeeds
+** returns: - 0 if the function succeeds, or the route was queued
 **          - the errno value for non-fatal failure condition
 */
 int addMRoute( struct MRouteDesc *Dp )
+{
+    struct MfcShadow *Sp = sgHashLookup( &mfcShadow, Dp->OriginAdr.s_addr, Dp->McAdr.s_addr );
+
+    // The kernel has the route already
+    if ( Sp && Sp->synced && Sp->desc.InVif == Dp->InVif
+         && memcmp( Sp->desc.TtlVc, Dp->TtlVc, sizeof( Dp->TtlVc ) ) == 0 ) {
+        mfcSkipped++;
+        return 0;
+    }
+
+    if ( ! Sp ) {
+        Sp = poolAlloc( POOL_MFC );
+        if ( Sp == NULL
+             || ! sgHashInsert( &mfcShadow, Dp->OriginAdr.s_addr, Dp->McAdr.s_addr, Sp ) ) {
+            // Still set the route; untracked, a reconcile may remove it
+            my_log( LOG_WARNING, 0, "Unable to track the kernel route %I -> %I.",
+                    Dp->OriginAdr.s_addr, Dp->McAdr.s_addr );
+            if ( Sp != NULL )
+                poolFree( POOL_MFC, Sp );
+            Sp = NULL;
+        } else
+            Sp->gen = mfcShadowGen;
+    }
+    if ( Sp ) {
+        Sp->desc   = *Dp;
+        Sp->synced = 1;
+    }
+
+    if ( mfcNlFd >= 0 )
+        return mfcNlQueue( RTM_NEWROUTE, Dp );
+
+    return sockAddMRoute( Dp );
+}
+
+static int sockAddMRoute( struct MRouteDesc *Dp )
 {
     struct mfcctl CtlReq;
     int rc;
@@ -195,20 +528,11 @@ int addMRoute( struct MRouteDesc *Dp )
 		    (void *)&CtlReq, sizeof( CtlReq ) );
     if (rc) {
         my_log( LOG_WARNING, errno, "MRT_ADD_MFC" );
+        mfcShadowFailed( Dp );
     } else {
 #if 0
         /* XXX: Add multicast routing entry to FPP */
-        my_log(LOG_INFO, 0, "Add multicast routing entry to FPP");
-        char cmd[128];
-        memset(cmd, 0, 128);
-        // add fpp rule
-        sprintf(cmd, "cmm -c set mc4 interface eth0 add group 0.0.0.0 %s %s", 
-            inetFmt(CtlReq.mfcc_origin.s_addr, s1), inetFmt(CtlReq.mfcc_mcastgrp.s_addr, s2));
-        system(cmd);
-
-        my_log(LOG_INFO, 0, "Add multicast routing entry to FPP cmd %s", cmd);
-        
-        //handle_fpp_join(CtlReq.mfcc_origin.s_addr, Dp->McAdr.s_addr);
+        offloadAdd( CtlReq.mfcc_origin, CtlReq.mfcc_mcastgrp );
         //IGMP_snooping_handle_join(CtlReq.mfcc_origin.s_addr, CtlReq.mfcc_mcastgrp.s_addr);
 #endif
 
@@ -220,10 +544,23 @@ int addMRoute( struct MRouteDesc *Dp )
 /*
 ** Removes the multicast routed '*Dp' from the kernel routes
 **
-** returns: - 0 if the function succeeds
+** returns: - 0 if the function succeeds, or the route was queued
 **          - the errno value for non-fatal failure condition
 */
 int delMRoute( struct MRouteDesc *Dp )
+{
+    struct MfcShadow *Sp = sgHashRemove( &mfcShadow, Dp->OriginAdr.s_addr, Dp->McAdr.s_addr );
+
+    if ( Sp )
+        poolFree( POOL_MFC, Sp );
+
+    if ( mfcNlFd >= 0 )
+        return mfcNlQueue( RTM_DELROUTE, Dp );
+
+    return sockDelMRoute( Dp );
+}
+
+static int sockDelMRoute( struct MRouteDesc *Dp )
 {
     struct mfcctl CtlReq;
     int rc;
@@ -250,23 +587,268 @@ int delMRoute( struct MRouteDesc *Dp )
 		    (void *)&CtlReq, sizeof( CtlReq ) );
     if (rc) {
         my_log( LOG_WARNING, errno, "MRT_DEL_MFC" );
+        mfcShadowFailed( Dp );
     } else {
         /* XXX: Delete multicast routing entry to FPP */
-        my_log(LOG_INFO, 0, "Delete multicast routing entry from FPP");
-        char cmd[128];
-        memset(cmd, 0, 128);
-        // del fpp rule
-        sprintf(cmd, "cmm -c set mc4 interface eth0 del group 0.0.0.0 %s %s", 
-            inetFmt(CtlReq.mfcc_origin.s_addr, s1), inetFmt(CtlReq.mfcc_mcastgrp.s_addr, s2));
-        system(cmd);
-
-        my_log(LOG_INFO, 0, "Del multicast routing entry to FPP cmd %s", cmd);
-        //handle_fpp_leave(CtlReq.mfcc_origin.s_addr, Dp->McAdr.s_addr);
+        offloadDel( CtlReq.mfcc_origin, CtlReq.mfcc_mcastgrp );
     }
 
     return rc;
 }
 
+/*
+** Notes that the kernel has no route 'Origin' to 'McAdr', so the next
+** addMRoute() for it is sent even if the route did not change.
+*/
+void forgetMRoute( uint32_t Origin, uint32_t McAdr )
+{
+    struct MfcShadow *Sp = sgHashLookup( &mfcShadow, Origin, McAdr );
+
+    if ( Sp )
+        Sp->synced = 0;
+}
+
+/*
+** Marks the route '*Dp' as unknown after a failed update, and has the
+** kernel reconciled shortly.
+*/
+static void mfcShadowFailed( struct MRouteDesc *Dp )
+{
+    struct MfcShadow *Sp = sgHashLookup( &mfcShadow, Dp->OriginAdr.s_addr, Dp->McAdr.s_addr );
+
+    if ( Sp )
+        Sp->synced = 0;
+    scheduleReconcile( MFC_RECONCILE_RETRY );
+}
+
+/*
+** Compares the kernel route '*Kp' with the route that was set. The kernel
+** shows no TTL for interfaces it does not forward to.
+*/
+static int mfcShadowMatches( struct MfcShadow *Sp, struct MRouteDesc *Kp )
+{
+    int Ix;
+
+    if ( Sp->desc.InVif != Kp->InVif )
+        return 0;
+
+    for ( Ix = 0; Ix < MAXVIFS; Ix++ ) {
+        unsigned Ttl = Sp->desc.TtlVc[ Ix ] == 255 ? 0 : Sp->desc.TtlVc[ Ix ];
+
+        if ( Ttl != Kp->TtlVc[ Ix ] )
+            return 0;
+    }
+    return 1;
+}
+
+/*
+** Removes the virtual interface 'Vif' from the kernel.
+*/
+static void vifRemove( int Vif )
+{
+    struct vifctl VifCtl;
+
+    memset( &VifCtl, 0, sizeof( VifCtl ) );
+    VifCtl.vifc_vifi = Vif;
+
+    my_log( LOG_NOTICE, 0, "removing VIF, Ix %d", Vif );
+    if ( setsockopt( MRouterFD, IPPROTO_IP, MRT_DEL_VIF,
+                     (char *)&VifCtl, sizeof( VifCtl ) ) )
+        my_log( LOG_WARNING, errno, "MRT_DEL_VIF" );
+}
+
+/*
+** Sets again a route the last kernel read did not show, counting it in
+** '*Added'.
+*/
+static void mfcShadowRestore( void *val, void *arg )
+{
+    struct MfcShadow *Sp = val;
+
+    if ( Sp->gen == mfcShadowGen )
+        return;
+
+    Sp->gen = mfcShadowGen;
+    Sp->synced = 0;
+    addMRoute( &Sp->desc );
+    ( *(unsigned *)arg )++;
+}
+
+/*
+** Brings the kernel VIFs in line with the configured ones.
+**
+** returns: the number of VIFs added or removed
+*/
+static unsigned reconcileVifs( void )
+{
+    char     KernVif[ MAXVIFS ][ IF_NAMESIZE ];
+    char     line[ 256 ];
+    unsigned Fixed = 0;
+    FILE     *fp;
+    int      Ix;
+
+    memset( KernVif, 0, sizeof( KernVif ) );
+
+    fp = fopen( MFC_VIF_FILE, "r" );
+    if ( fp != NULL ) {
+        while ( fgets( line, sizeof( line ), fp ) != NULL ) {
+            char Name[ IF_NAMESIZE ];
+
+            if ( sscanf( line, "%d %15s", &Ix, Name ) == 2 && Ix >= 0 && Ix < MAXVIFS )
+                strcpy( KernVif[ Ix ], Name );
+        }
+        fclose( fp );
+    } else {
+        // Without the file only the presence of each VIF can be asked for
+        for ( Ix = 0; Ix < MAXVIFS; Ix++ ) {
+            struct sioc_vif_req VifReq;
+
+            memset( &VifReq, 0, sizeof( VifReq ) );
+            VifReq.vifi = Ix;
+            if ( ioctl( MRouterFD, SIOCGETVIFCNT, &VifReq ) == 0 )
+                strcpy( KernVif[ Ix ], VifDescVc[ Ix ].IfDp ? VifDescVc[ Ix ].IfDp->Name : "?" );
+        }
+    }
+
+    for ( Ix = 0; Ix < MAXVIFS; Ix++ ) {
+        struct IfDesc *IfDp = VifDescVc[ Ix ].IfDp;
+
+        if ( IfDp && strcmp( KernVif[ Ix ], IfDp->Name ) == 0 )
+            continue;
+        if ( ! IfDp && KernVif[ Ix ][ 0 ] == '\0' )
+            continue;
+
+        if ( KernVif[ Ix ][ 0 ] != '\0' )
+            vifRemove( Ix );
+        if ( IfDp && vifInstall( &VifDescVc[ Ix ] ) )
+            my_log( LOG_WARNING, errno, "MRT_ADD_VIF for %s", IfDp->Name );
+        Fixed++;
+    }
+
+    return Fixed;
+}
+
+/*
+** Reads the kernel routes and changes only the ones that differ from
+** the routes set: routes the kernel lacks or holds differently are set
+** again, and routes that were never set are removed. VIFs go first, as
+** the kernel drops the TTLs of missing VIFs.
+*/
+void reconcileMRoutes( void )
+{
+    struct Config    *conf = getCommonConfig();
+    struct MfcShadow *Sp;
+    struct MRouteDesc Kern;
+    unsigned Vifs, Added = 0, Changed = 0, Removed = 0;
+    char     line[ 1024 ];
+    FILE     *fp;
+
+    flushMRoutes();
+    Vifs = reconcileVifs();
+
+    fp = fopen( MFC_CACHE_FILE, "r" );
+    if ( fp == NULL ) {
+        my_log( LOG_DEBUG, errno, "open %s", MFC_CACHE_FILE );
+        goto done;
+    }
+
+    mfcShadowGen++;
+    while ( fgets( line, sizeof( line ), fp ) != NULL ) {
+        unsigned long Group, Origin;
+        int  Iif, Vif, Ttl, Len;
+        char *Oifs;
+
+        // Group Origin Iif Pkts Bytes Wrong, then the output VIFs as Vif:TTL
+        if ( sscanf( line, "%lx %lx %d %*u %*u %*u%n", &Group, &Origin, &Iif, &Len ) != 3 )
+            continue;
+
+        // Unresolved entries wait for an upcall and hold no route yet
+        if ( Iif < 0 )
+            continue;
+
+        memset( &Kern, 0, sizeof( Kern ) );
+        Kern.OriginAdr.s_addr = Origin;
+        Kern.McAdr.s_addr     = Group;
+        Kern.InVif            = Iif;
+        for ( Oifs = line + Len; sscanf( Oifs, " %d:%d%n", &Vif, &Ttl, &Len ) == 2; Oifs += Len )
+            if ( Vif >= 0 && Vif < MAXVIFS )
+                Kern.TtlVc[ Vif ] = Ttl;
+
+        Sp = sgHashLookup( &mfcShadow, Kern.OriginAdr.s_addr, Kern.McAdr.s_addr );
+        if ( Sp == NULL ) {
+            delMRoute( &Kern );
+            Removed++;
+            continue;
+        }
+
+        Sp->gen = mfcShadowGen;
+        if ( ! Sp->synced || ! mfcShadowMatches( Sp, &Kern ) ) {
+            Sp->synced = 0;
+            addMRoute( &Sp->desc );
+            Changed++;
+        }
+    }
+    fclose( fp );
+
+    // Routes the kernel does not show at all
+    addrHashForEach( &mfcShadow, mfcShadowRestore, &Added );
+    flushMRoutes();
+
+    if ( Vifs || Added || Changed || Removed )
+        my_log( LOG_NOTICE, 0, "Reconciled kernel: %u VIFs, %u routes added, %u changed, %u removed",
+             Vifs, Added, Changed, Removed );
+    else
+        my_log( LOG_DEBUG, 0, "Kernel matches %u routes, %lu unchanged updates skipped",
+             mfcShadow.count, mfcSkipped );
+
+done:
+    if ( conf->mfcReconcileInterval > 0 )
+        scheduleReconcile( conf->mfcReconcileInterval * 1000 );
+}
+
+static void reconcileTimeout( void *data )
+{
+    reconcileTimer = INVAILD_TIMER;
+    reconcileMRoutes();
+}
+
+/*
+** Has the kernel reconciled within 'delay' ms, keeping an earlier run.
+*/
+static void scheduleReconcile( int delay )
+{
+    if ( reconcileTimer != INVAILD_TIMER ) {
+        if ( timer_leftTimer( reconcileTimer ) <= delay )
+            return;
+        timer_clearTimer( reconcileTimer );
+    }
+    reconcileTimer = timer_setTimer( delay, reconcileTimeout, NULL );
+}
+
+/*
+** Reads the packet and byte counters of the kernel route 'Origin' to 'McAdr'
+**
+** returns: - 0 if the function succeeds
+**          - the errno value for non-fatal failure condition
+*/
+int getMRouteCounters( uint32_t Origin, uint32_t McAdr, unsigned long *Pkts, unsigned long *Bytes )
+{
+    struct sioc_sg_req SgReq;
+
+    memset( &SgReq, 0, sizeof( SgReq ) );
+    SgReq.src.s_addr = Origin;
+    SgReq.grp.s_addr = McAdr;
+
+    if ( ioctl( MRouterFD, SIOCGETSGCNT, &SgReq ) < 0 ) {
+        my_log( LOG_DEBUG, errno, "SIOCGETSGCNT" );
+        return errno;
+    }
+
+    *Pkts  = SgReq.pktcnt;
+    *Bytes = SgReq.bytecnt;
+    return 0;
+}
+
 /*
 ** Returns for the virtual interface index for '*IfDp'
 **
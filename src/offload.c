@@ -0,0 +1,505 @@
+/*
+**  igmpproxy - IGMP proxy based multicast router 
+**  Copyright (C) 2005 Johnny Egeland <johnny@rlo.org>
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**
+**----------------------------------------------------------------------------
+**
+**  This software is derived work from the following software. The original
+**  source code has been modified from it's original state by the author
+**  of igmpproxy.
+**
+**  smcroute 0.92 - Copyright (C) 2001 Carsten Schill <carsten@cschill.de>
+**  - Licensed under the GNU General Public License, version 2
+**  
+**  mrouted 3.9-beta3 - COPYRIGHT 1989 by The Board of Trustees of 
+**  Leland Stanford Junior University.
+**  - Original license can be found in the "doc/mrouted-LINCESE" file.
+**
+*/
+/**
+*   offload.c - Route updates for the hardware forwarding engine.
+*
+*   When the kernel drops a multicast route, the forwarding engine (FPP)
+*   must drop it too. The updates are queued here, a later update of the
+*   same (S,G) replaces the earlier one, and once per loop round the
+*   queue is handed to the configured backend:
+*
+*   cmm  - a long-lived shell child runs the cmm commands fed to it
+*          over a socket. Its answers are read in the event loop, so
+*          a slow command never stalls IGMP processing.
+*   stub - records the updates in memory, for tests.
+*   none - drops the updates.
+*/
+
+#include "defs.h"
+#include "igmpproxy.h"
+
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/wait.h>
+
+/* Commands written to the cmm shell before waiting for answers */
+#define CMM_INFLIGHT        64
+/* Seconds to wait before restarting a failed cmm shell */
+#define CMM_RESTART_DELAY   5
+/* Milliseconds to wait for an answer while stopping */
+#define CMM_STOP_TIMEOUT    2000
+/* Marker of the status line following each command */
+#define CMM_STATUS          "@offload"
+
+struct offloadBackend {
+    const char  *name;                          // Name used in config and logs
+    int         (*start)(void);                 // Returns 0 on failure
+    void        (*submit)(const struct offloadOp *op);
+    void        (*flush)(void);                 // Ends a round of submits
+    void        (*stop)(void);                  // Finishes all submitted updates
+};
+
+static struct {
+    unsigned long   queued;     // updates requested
+    unsigned long   coalesced;  // updates replaced before being sent
+    unsigned long   sent;       // updates handed to the backend
+    unsigned long   failed;     // updates the backend reported failed
+} offload_stats;
+
+static struct offloadBackend *backend;
+
+// Updates of this round, and their index by (S,G)
+static struct offloadOp *pending;
+static unsigned npending, pendingsize;
+static struct addr_hash pendingHash;
+
+
+/*
+ * The cmm backend. Updates wait in a queue, the oldest CMM_INFLIGHT of
+ * them are written to the shell, and each status line read back
+ * completes the oldest written update.
+ */
+static pid_t cmmPid = -1;
+static int cmmFd = -1;
+static time_t cmmRestartAt;
+
+static struct offloadOp *cmmQueue;
+static unsigned cmmHead, cmmSent, cmmTail, cmmSize;
+
+static char cmmLine[256];
+static unsigned cmmLineLen;
+
+static void cmmInput(int fd, void *data);
+
+static int cmmStart(void)
+{
+    sigset_t mask;
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        my_log(LOG_WARNING, errno, "Offload socketpair");
+        return 0;
+    }
+
+    cmmPid = fork();
+    if (cmmPid < 0) {
+        my_log(LOG_WARNING, errno, "Offload fork");
+        close(sv[0]);
+        close(sv[1]);
+        return 0;
+    }
+
+    if (cmmPid == 0) {
+        // The daemon blocks its signals for the signalfd, the shell must not
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+
+        dup2(sv[1], STDIN_FILENO);
+        dup2(sv[1], STDOUT_FILENO);
+        execl("/bin/sh", "sh", (char *)NULL);
+        _exit(127);
+    }
+
+    close(sv[1]);
+    cmmFd = sv[0];
+    fcntl(cmmFd, F_SETFL, O_NONBLOCK);
+    if (!reactorAddFd(cmmFd, cmmInput, NULL)) {
+        close(cmmFd);
+        cmmFd = -1;
+        return 0;
+    }
+
+    cmmLineLen = 0;
+    my_log(LOG_INFO, 0, "Offload shell started, pid %d.", (int)cmmPid);
+    return 1;
+}
+
+/*
+ * Closes the shell after a failure. The updates it did not answer
+ * are written again to the next one.
+ */
+static void cmmRestart(const char *why)
+{
+    my_log(LOG_WARNING, 0, "Offload shell %s, %u updates unanswered. Restarting in %d s.",
+        why, cmmSent - cmmHead, CMM_RESTART_DELAY);
+
+    reactorDelFd(cmmFd);
+    close(cmmFd);
+    cmmFd = -1;
+    // It may be stuck rather than gone, do not leave it behind
+    kill(cmmPid, SIGKILL);
+    waitpid(cmmPid, NULL, 0);
+    cmmPid = -1;
+
+    cmmSent = cmmHead;
+    cmmRestartAt = time(NULL) + CMM_RESTART_DELAY;
+}
+
+static void cmmSubmit(const struct offloadOp *op)
+{
+    if (cmmTail == cmmSize) {
+        if (cmmHead > 0) {
+            memmove(cmmQueue, cmmQueue + cmmHead, (cmmTail - cmmHead) * sizeof(*cmmQueue));
+            cmmTail -= cmmHead;
+            cmmSent -= cmmHead;
+            cmmHead = 0;
+        } else {
+            unsigned size = cmmSize ? cmmSize * 2 : CMM_INFLIGHT;
+            struct offloadOp *q = realloc(cmmQueue, size * sizeof(*q));
+
+            if (q == NULL) {
+                my_log(LOG_WARNING, errno, "Offload queue full, update of %I dropped",
+                    op->group.s_addr);
+                offload_stats.failed++;
+                return;
+            }
+            cmmQueue = q;
+            cmmSize = size;
+        }
+    }
+    cmmQueue[cmmTail++] = *op;
+}
+
+/*
+ * Writes queued updates to the shell, as many as the in flight limit
+ * lets through, in one send.
+ */
+static void cmmFlush(void)
+{
+    char buf[CMM_INFLIGHT * 128];
+    char origin[INET_FMT_SIZE], group[INET_FMT_SIZE];
+    unsigned len = 0, n;
+    ssize_t rc;
+
+    if (cmmSent == cmmTail)
+        return;
+
+    if (cmmFd < 0) {
+        if (time(NULL) < cmmRestartAt || !cmmStart())
+            return;
+    }
+
+    for (n = cmmSent; n < cmmTail && n - cmmHead < CMM_INFLIGHT; n++) {
+        struct offloadOp *op = &cmmQueue[n];
+
+        len += snprintf(buf + len, sizeof(buf) - len,
+            "cmm -c set mc4 interface eth0 %s group 0.0.0.0 %s %s; echo " CMM_STATUS " $?\n",
+            op->type == OFFLOAD_OP_ADD ? "add" : "del",
+            inetFmt(op->origin.s_addr, origin), inetFmt(op->group.s_addr, group));
+    }
+    if (len == 0)
+        return;
+
+    rc = send(cmmFd, buf, len, MSG_NOSIGNAL);
+    if (rc != (ssize_t)len) {
+        cmmRestart(rc < 0 ? strerror(errno) : "write incomplete");
+        return;
+    }
+    cmmSent = n;
+}
+
+/*
+ * Reads the answers of the shell. Each status line completes the
+ * oldest written update, other output of cmm is logged.
+ */
+static void cmmInput(int fd, void *data)
+{
+    ssize_t len;
+    char *nl;
+
+    for (;;) {
+        len = recv(fd, cmmLine + cmmLineLen, sizeof(cmmLine) - 1 - cmmLineLen, 0);
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                cmmRestart(strerror(errno));
+            break;
+        }
+        if (len == 0) {
+            cmmRestart("exited");
+            return;
+        }
+        cmmLineLen += len;
+        cmmLine[cmmLineLen] = '\0';
+
+        while ((nl = strchr(cmmLine, '\n')) != NULL) {
+            *nl = '\0';
+            if (strncmp(cmmLine, CMM_STATUS " ", sizeof(CMM_STATUS)) == 0 && cmmHead < cmmSent) {
+                struct offloadOp *op = &cmmQueue[cmmHead++];
+                int status = atoi(cmmLine + sizeof(CMM_STATUS));
+
+                if (status != 0) {
+                    offload_stats.failed++;
+                    my_log(LOG_WARNING, 0, "Offload %s of %I -> %I failed, status %d.",
+                        op->type == OFFLOAD_OP_ADD ? "add" : "del",
+                        op->origin.s_addr, op->group.s_addr, status);
+                }
+            } else if (cmmLine[0] != '\0') {
+                my_log(LOG_DEBUG, 0, "cmm: %s", cmmLine);
+            }
+            cmmLineLen -= nl + 1 - cmmLine;
+            memmove(cmmLine, nl + 1, cmmLineLen + 1);
+        }
+
+        // A line longer than the buffer is only logged in pieces
+        if (cmmLineLen == sizeof(cmmLine) - 1) {
+            my_log(LOG_DEBUG, 0, "cmm: %s", cmmLine);
+            cmmLineLen = 0;
+        }
+    }
+
+    if (cmmHead == cmmTail)
+        cmmHead = cmmSent = cmmTail = 0;
+
+    // Answers free room for more updates
+    cmmFlush();
+}
+
+/*
+ * Writes all remaining updates and waits for the shell to finish them.
+ */
+static void cmmStop(void)
+{
+    // The last updates don't wait for a pending restart
+    cmmRestartAt = 0;
+    cmmFlush();
+
+    while (cmmHead < cmmTail && cmmFd >= 0) {
+        struct pollfd pfd = { .fd = cmmFd, .events = POLLIN };
+
+        if (poll(&pfd, 1, CMM_STOP_TIMEOUT) <= 0)
+            break;
+        cmmInput(cmmFd, NULL);
+    }
+    if (cmmHead < cmmTail)
+        my_log(LOG_WARNING, 0, "Offload stopped with %u updates not done.", cmmTail - cmmHead);
+
+    if (cmmFd >= 0) {
+        reactorDelFd(cmmFd);
+        close(cmmFd);
+        cmmFd = -1;
+        // A shell that did not answer in time may hang on a command
+        if (cmmHead < cmmTail)
+            kill(cmmPid, SIGKILL);
+        waitpid(cmmPid, NULL, 0);
+        cmmPid = -1;
+    }
+    free(cmmQueue);
+    cmmQueue = NULL;
+    cmmHead = cmmSent = cmmTail = cmmSize = 0;
+}
+
+
+/*
+ * The stub backend keeps every update, for tests to look at.
+ */
+static struct offloadOp *stubOps;
+static unsigned stubCount, stubSize;
+
+static void stubSubmit(const struct offloadOp *op)
+{
+    if (stubCount == stubSize) {
+        unsigned size = stubSize ? stubSize * 2 : 64;
+        struct offloadOp *ops = realloc(stubOps, size * sizeof(*ops));
+
+        if (ops == NULL) {
+            offload_stats.failed++;
+            return;
+        }
+        stubOps = ops;
+        stubSize = size;
+    }
+    stubOps[stubCount++] = *op;
+    my_log(LOG_DEBUG, 0, "Offload stub: %s %I -> %I",
+        op->type == OFFLOAD_OP_ADD ? "add" : "del",
+        op->origin.s_addr, op->group.s_addr);
+}
+
+static void stubStop(void)
+{
+    free(stubOps);
+    stubOps = NULL;
+    stubCount = stubSize = 0;
+}
+
+/**
+*   Returns the updates recorded by the stub backend.
+*/
+const struct offloadOp *offloadStubOps(unsigned *count)
+{
+    *count = stubCount;
+    return stubOps;
+}
+
+
+static struct offloadBackend backends[OFFLOAD_MAX] = {
+    [OFFLOAD_NONE]  = { .name = "none" },
+    [OFFLOAD_CMM]   = { .name = "cmm", .submit = cmmSubmit, .flush = cmmFlush, .stop = cmmStop },
+    [OFFLOAD_STUB]  = { .name = "stub", .submit = stubSubmit, .stop = stubStop },
+};
+
+/**
+*   Returns the backend matching a name from the config file,
+*   or -1 if the name is unknown.
+*/
+int offloadLookupName(const char *name)
+{
+    int type;
+
+    for (type = 0; type < OFFLOAD_MAX; type++) {
+        if (strcmp(backends[type].name, name) == 0)
+            return type;
+    }
+    return -1;
+}
+
+/**
+*   Sets up the configured backend. The cmm shell is started when
+*   the first update is written.
+*/
+void offloadInit(void)
+{
+    struct Config *conf = getCommonConfig();
+
+    backend = &backends[conf->offloadBackend];
+    addrHashInit(&pendingHash);
+    if (backend->start != NULL && !backend->start()) {
+        my_log(LOG_WARNING, 0, "Offload backend %s failed, updates are dropped.", backend->name);
+        backend = &backends[OFFLOAD_NONE];
+    }
+    my_log(LOG_DEBUG, 0, "Offload backend %s.", backend->name);
+}
+
+/*
+ * Queues an update, replacing a queued one of the same (S,G).
+ */
+static void offloadQueue(int type, struct in_addr origin, struct in_addr group)
+{
+    uintptr_t ix;
+
+    if (backend == NULL || backend->submit == NULL)
+        return;
+
+    offload_stats.queued++;
+    ix = (uintptr_t)sgHashLookup(&pendingHash, origin.s_addr, group.s_addr);
+    if (ix != 0) {
+        pending[ix - 1].type = type;
+        offload_stats.coalesced++;
+        return;
+    }
+
+    if (npending == pendingsize) {
+        unsigned size = pendingsize ? pendingsize * 2 : 64;
+        struct offloadOp *p = realloc(pending, size * sizeof(*p));
+
+        if (p == NULL) {
+            my_log(LOG_WARNING, errno, "Offload update of %I dropped", group.s_addr);
+            offload_stats.failed++;
+            return;
+        }
+        pending = p;
+        pendingsize = size;
+    }
+    pending[npending].type   = type;
+    pending[npending].origin = origin;
+    pending[npending].group  = group;
+    npending++;
+    sgHashInsert(&pendingHash, origin.s_addr, group.s_addr, (void *)(uintptr_t)npending);
+}
+
+/**
+*   Queues the forwarding engine update for a route added to the kernel.
+*/
+void offloadAdd(struct in_addr origin, struct in_addr group)
+{
+    offloadQueue(OFFLOAD_OP_ADD, origin, group);
+}
+
+/**
+*   Queues the forwarding engine update for a route removed from the kernel.
+*/
+void offloadDel(struct in_addr origin, struct in_addr group)
+{
+    offloadQueue(OFFLOAD_OP_DEL, origin, group);
+}
+
+/**
+*   Hands the updates of this round to the backend.
+*/
+void offloadFlush(void)
+{
+    unsigned i;
+
+    if (npending == 0)
+        return;
+
+    for (i = 0; i < npending; i++) {
+        backend->submit(&pending[i]);
+        sgHashRemove(&pendingHash, pending[i].origin.s_addr, pending[i].group.s_addr);
+    }
+    offload_stats.sent += npending;
+    npending = 0;
+
+    if (backend->flush != NULL)
+        backend->flush();
+}
+
+/**
+*   Logs the counters of the offload updates.
+*/
+void offloadLogStats(void)
+{
+    my_log(LOG_NOTICE, 0, "Offload %s: %lu updates, %lu coalesced, %lu sent, %lu failed",
+        backend ? backend->name : "none", offload_stats.queued, offload_stats.coalesced,
+        offload_stats.sent, offload_stats.failed);
+}
+
+/**
+*   Finishes the queued updates, stops the backend and logs the counters.
+*/
+void offloadCleanUp(void)
+{
+    if (backend == NULL)
+        return;
+
+    offloadFlush();
+    if (backend->stop != NULL)
+        backend->stop();
+    offloadLogStats();
+
+    free(pending);
+    pending = NULL;
+    npending = pendingsize = 0;
+    addrHashFree(&pendingHash);
+    backend = NULL;
+}
@@ -0,0 +1,222 @@
+/*
+**  igmpproxy - IGMP proxy based multicast router 
+**  Copyright (C) 2005 Johnny Egeland <johnny@rlo.org>
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**
+**----------------------------------------------------------------------------
+**
+**  This software is derived work from the following software. The original
+**  source code has been modified from it's original state by the author
+**  of igmpproxy.
+**
+**  smcroute 0.92 - Copyright (C) 2001 Carsten Schill <carsten@cschill.de>
+**  - Licensed under the GNU General Public License, version 2
+**  
+**  mrouted 3.9-beta3 - COPYRIGHT 1989 by The Board of Trustees of 
+**  Leland Stanford Junior University.
+**  - Original license can be found in the "doc/mrouted-LINCESE" file.
+**
+*/
+/**
+*   pool.c - Fixed size object pools.
+*
+*   Timers, groups, sources, members and hosts are allocated and released
+*   at a high rate under join/leave churn. Each object type has its own pool
+*   which gets memory from malloc in chunks and keeps released objects on
+*   a free list, so the heap is not fragmented by many small allocations
+*   and recently used objects are reused first.
+*/
+
+#include "defs.h"
+#include "igmpproxy.h"
+
+#define POOL_CHUNK_MIN      32      /* objects in the first chunk */
+#define POOL_CHUNK_MAX      1024    /* objects in the largest chunk */
+
+struct poolObject {
+    struct poolObject   *next;      // Next free object
+};
+
+struct poolChunk {
+    struct poolChunk    *next;      // Next chunk of the pool
+    unsigned            nobjs;      // Number of objects in the chunk
+};
+
+struct pool {
+    const char          *name;      // Name used in config and logs
+    size_t              objsize;    // Size of one object, 0 until set up
+    struct poolChunk    *chunks;    // Memory obtained from malloc
+    struct poolObject   *freelist;  // Released objects
+    unsigned            nchunk;     // Objects in the next chunk
+    unsigned            ntotal;     // Objects in all chunks
+    unsigned            nfree;      // Objects on the free list
+    unsigned            inuse;      // Objects handed out
+    unsigned            highwater;  // Largest inuse seen
+    unsigned            nfail;      // Allocations that failed
+};
+
+static struct pool pools[POOL_MAX] = {
+    [POOL_TIMER]        = { .name = "timers" },
+    [POOL_GROUP]        = { .name = "groups" },
+    [POOL_SOURCE]       = { .name = "sources" },
+    [POOL_MEMBER]       = { .name = "members" },
+    [POOL_HOST]         = { .name = "hosts" },
+    [POOL_ROUTESRC]     = { .name = "routesources" },
+    [POOL_MFC]          = { .name = "mfcentries" },
+};
+
+/**
+*   Returns the pool type matching a name from the config file,
+*   or -1 if the name is unknown.
+*/
+int poolLookupName(const char *name) {
+    int type;
+
+    for (type = 0; type < POOL_MAX; type++) {
+        if (strcmp(pools[type].name, name) == 0)
+            return type;
+    }
+    return -1;
+}
+
+/**
+*   Adds a chunk of 'count' objects to the free list of the pool.
+*   Returns 0 if no memory was available.
+*/
+static int poolGrow(struct pool *p, unsigned count) {
+    struct poolChunk *chunk;
+    char *obj;
+    unsigned i;
+
+    chunk = malloc(sizeof(*chunk) + (size_t)count * p->objsize);
+    if (chunk == NULL) {
+        my_log(LOG_WARNING, errno, "Unable to grow pool %s by %u objects",
+            p->name, count);
+        return 0;
+    }
+    chunk->nobjs = count;
+    chunk->next = p->chunks;
+    p->chunks = chunk;
+
+    /* Push in reverse so the free list hands out in address order */
+    obj = (char *)(chunk + 1) + (size_t)(count - 1) * p->objsize;
+    for (i = 0; i < count; i++, obj -= p->objsize) {
+        struct poolObject *po = (struct poolObject *)obj;
+        po->next = p->freelist;
+        p->freelist = po;
+    }
+    p->ntotal += count;
+    p->nfree += count;
+    return 1;
+}
+
+/**
+*   Sets up a pool for objects of 'objsize' bytes. If the config
+*   file gave a size for the pool, that many objects are allocated
+*   up front.
+*/
+void poolInit(int type, size_t objsize) {
+    struct Config *conf = getCommonConfig();
+    struct pool *p;
+
+    assert(type >= 0 && type < POOL_MAX);
+    p = &pools[type];
+    if (p->objsize != 0)
+        return;
+
+    /* Objects must hold the free list link and keep their alignment */
+    if (objsize < sizeof(struct poolObject))
+        objsize = sizeof(struct poolObject);
+    objsize = (objsize + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    p->objsize = objsize;
+    p->nchunk = POOL_CHUNK_MIN;
+
+    if (conf->poolSize[type] > 0) {
+        if (poolGrow(p, conf->poolSize[type]))
+            my_log(LOG_DEBUG, 0, "Pool %s: preallocated %u objects of %u bytes",
+                p->name, conf->poolSize[type], (unsigned)objsize);
+        if (conf->poolSize[type] > p->nchunk)
+            p->nchunk = conf->poolSize[type] < POOL_CHUNK_MAX ?
+                        conf->poolSize[type] : POOL_CHUNK_MAX;
+    }
+}
+
+/**
+*   Gets an object from the pool. The memory is not cleared.
+*   Returns NULL if no memory was available.
+*/
+void *poolAlloc(int type) {
+    struct pool *p;
+    struct poolObject *po;
+
+    assert(type >= 0 && type < POOL_MAX);
+    p = &pools[type];
+    assert(p->objsize != 0);
+
+    if (p->freelist == NULL) {
+        if (!poolGrow(p, p->nchunk)) {
+            p->nfail++;
+            return NULL;
+        }
+        if (p->nchunk < POOL_CHUNK_MAX)
+            p->nchunk *= 2;
+    }
+
+    po = p->freelist;
+    p->freelist = po->next;
+    p->nfree--;
+    if (++p->inuse > p->highwater)
+        p->highwater = p->inuse;
+
+    return po;
+}
+
+/**
+*   Returns an object to its pool.
+*/
+void poolFree(int type, void *obj) {
+    struct pool *p;
+    struct poolObject *po = obj;
+
+    assert(type >= 0 && type < POOL_MAX);
+    if (obj == NULL)
+        return;
+
+    p = &pools[type];
+    assert(p->inuse > 0);
+
+    po->next = p->freelist;
+    p->freelist = po;
+    p->nfree++;
+    p->inuse--;
+}
+
+/**
+*   Logs the usage statistics of all pools.
+*/
+void poolLogStats(void) {
+    int type;
+
+    for (type = 0; type < POOL_MAX; type++) {
+        struct pool *p = &pools[type];
+
+        if (p->objsize == 0)
+            continue;
+        my_log(LOG_NOTICE, 0, "Pool %-13s: size %u, in use %u, free %u, high water %u, failed %u",
+            p->name, p->ntotal, p->inuse, p->nfree, p->highwater, p->nfail);
+    }
+}
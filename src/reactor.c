@@ -0,0 +1,254 @@
+/*
+**  igmpproxy - IGMP proxy based multicast router 
+**  Copyright (C) 2005 Johnny Egeland <johnny@rlo.org>
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**
+**----------------------------------------------------------------------------
+**
+**  This software is derived work from the following software. The original
+**  source code has been modified from it's original state by the author
+**  of igmpproxy.
+**
+**  smcroute 0.92 - Copyright (C) 2001 Carsten Schill <carsten@cschill.de>
+**  - Licensed under the GNU General Public License, version 2
+**  
+**  mrouted 3.9-beta3 - COPYRIGHT 1989 by The Board of Trustees of 
+**  Leland Stanford Junior University.
+**  - Original license can be found in the "doc/mrouted-LINCESE" file.
+**
+*/
+/**
+*   reactor.c - The event loop of the daemon.
+*
+*   Sockets are registered with reactorAddFd() and watched with epoll.
+*   The timer queue is driven by a CLOCK_MONOTONIC timerfd armed for
+*   the next expiry, so changes of the wall clock don't disturb the
+*   timers. More sockets (control, netlink) can be added at any time
+*   without touching the loop itself.
+*/
+
+#include "defs.h"
+#include "igmpproxy.h"
+
+#include <limits.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#define MAX_REACTOR_FDS     16
+#define MAX_REACTOR_EVENTS  16
+
+/* Length of a tick of the timer queue */
+#define TICK_NSEC           (TIMER_TICK_MS * 1000000LL)
+
+struct reactorFd {
+    int             fd;         // -1 if the slot is free
+    reactor_f       func;       // function to call when readable
+    void            *data;      // data for the function
+};
+
+static struct reactorFd fds[MAX_REACTOR_FDS];
+static int epollFd = -1;
+static int timerFd = -1;
+static int running;
+
+/* Monotonic time of the current tick of the timer queue */
+static long long tickBase;
+
+static long long monotonicNow(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Arm the timerfd for the next timer, or disarm it if there is none.
+ * The time is absolute, computed from the tick base, so the timers
+ * don't drift with the time spent handling events.
+ */
+static void reactorArmTimer(void) {
+    struct itimerspec its;
+    long long when;
+    int next = timer_nextTimer();
+
+    memset(&its, 0, sizeof(its));
+    if (next >= 0) {
+        when = tickBase + next * 1000000LL;
+        if (when <= 0)
+            when = 1;           /* zero would disarm the timer */
+        its.it_value.tv_sec  = when / 1000000000LL;
+        its.it_value.tv_nsec = when % 1000000000LL;
+    }
+
+    if (timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        my_log(LOG_WARNING, errno, "timerfd_settime");
+}
+
+/*
+ * Run the timers due since the last call.
+ */
+static void reactorAgeTimers(void) {
+    long long elapsed = (monotonicNow() - tickBase) / TICK_NSEC;
+    uint64_t expirations;
+
+    /* Only clears the readable state, the count is not needed */
+    if (read(timerFd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        my_log(LOG_WARNING, errno, "timerfd read");
+
+    if (elapsed > 0 || timer_nextTimer() == 0) {
+        if (elapsed > INT_MAX / TIMER_TICK_MS)
+            elapsed = INT_MAX / TIMER_TICK_MS;
+        tickBase += elapsed * TICK_NSEC;
+        age_callout_queue((int)elapsed * TIMER_TICK_MS);
+    }
+}
+
+/**
+*   Sets up epoll and the timerfd.
+*/
+int reactorInit(void) {
+    struct epoll_event ev;
+    int i;
+
+    for (i = 0; i < MAX_REACTOR_FDS; i++)
+        fds[i].fd = -1;
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0) {
+        my_log(LOG_ERR, errno, "epoll_create1");
+        return 0;
+    }
+
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerFd < 0) {
+        my_log(LOG_ERR, errno, "timerfd_create");
+        return 0;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = EPOLLIN;
+    ev.data.ptr = NULL;         /* NULL marks the timerfd */
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &ev) < 0) {
+        my_log(LOG_ERR, errno, "epoll_ctl timerfd");
+        return 0;
+    }
+
+    tickBase = monotonicNow();
+    return 1;
+}
+
+/**
+*   Registers a socket, func is called with fd and data every time
+*   the socket is readable. Returns 0 on failure.
+*/
+int reactorAddFd(int fd, reactor_f func, void *data) {
+    struct epoll_event ev;
+    int i;
+
+    for (i = 0; i < MAX_REACTOR_FDS; i++)
+        if (fds[i].fd == -1)
+            break;
+    if (i == MAX_REACTOR_FDS) {
+        my_log(LOG_WARNING, 0, "Too many sockets in the event loop, fd %d not added.", fd);
+        return 0;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = EPOLLIN;
+    ev.data.ptr = &fds[i];
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        my_log(LOG_WARNING, errno, "epoll_ctl add fd %d", fd);
+        return 0;
+    }
+
+    fds[i].fd   = fd;
+    fds[i].func = func;
+    fds[i].data = data;
+    return 1;
+}
+
+/**
+*   Unregisters a socket. May be called from a callback.
+*/
+void reactorDelFd(int fd) {
+    int i;
+
+    for (i = 0; i < MAX_REACTOR_FDS; i++) {
+        if (fds[i].fd == fd) {
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, NULL);
+            fds[i].fd   = -1;
+            fds[i].func = NULL;
+            return;
+        }
+    }
+}
+
+/**
+*   Runs the loop until reactorStop() is called.
+*/
+void reactorRun(void) {
+    struct epoll_event events[MAX_REACTOR_EVENTS];
+    struct reactorFd *rfd;
+    int i, n;
+
+    running = 1;
+    while (running) {
+
+        // Push the membership changes of the last round upstream,
+        // and the kernel and forwarding engine routes they changed...
+        memberDatabaseFlush();
+        flushMRoutes();
+        offloadFlush();
+
+        reactorArmTimer();
+
+        n = epoll_wait(epollFd, events, MAX_REACTOR_EVENTS, -1);
+        if (n < 0) {
+            if (errno != EINTR)
+                my_log(LOG_WARNING, errno, "epoll_wait failure");
+            continue;
+        }
+
+        for (i = 0; i < n && running; i++) {
+            rfd = events[i].data.ptr;
+            if (rfd != NULL && rfd->func != NULL)
+                rfd->func(rfd->fd, rfd->data);
+        }
+
+        // At this point, we can handle timeouts...
+        if (running)
+            reactorAgeTimers();
+    }
+}
+
+/**
+*   Makes reactorRun() return after the current round.
+*/
+void reactorStop(void) {
+    running = 0;
+}
+
+/**
+*   Closes the epoll and timer descriptors.
+*/
+void reactorCleanUp(void) {
+    if (timerFd >= 0)
+        close(timerFd);
+    if (epollFd >= 0)
+        close(epollFd);
+    timerFd = epollFd = -1;
+}
@@ -44,6 +44,7 @@
 void sendGroupSpecificMemberQuery(void *argument);  
 
 void sourceDestory(struct source *src);
+static void sourceFree(struct source *src);
 
 void sourceTimerTimeout(void *arg);
 
@@ -60,6 +61,8 @@ void groupTimerUpdate(struct IfDesc *sourceVif, uint32_t mcast, uint32_t val);
 void sourceTimerUpdate(struct IfDesc *sourceVif, uint32_t mcast, uint32_t nsrcs, uint32_t *sources, uint32_t val);
 
 void memberDatabaseUpdate(uint32_t mcastAddr);
+void memberGroupUpdate(struct group *gp);
+static void memberGroupRetract(struct group *gp);
 
 void processModeIsInclude(struct IfDesc *sourceVif, struct group *gp, int numsrc, uint32_t *sources);
 void processModeIsExclude(struct IfDesc *sourceVif, struct group *gp, int numsrc, uint32_t *sources);
@@ -68,7 +71,11 @@ void processChangeToExcludeMode(struct IfDesc *sourceVif, struct group *gp, int
 void processAllowNewSource(struct IfDesc *sourceVif, struct group *gp, int numsrc, uint32_t *sources);
 void processBlockOldSource(struct IfDesc *sourceVif, struct group *gp, int numsrc, uint32_t *sources);
 
-#define LMQT 2 /* FIXME: Need to get, unit second */
+/* Last member query time in ms, RFC 3376 $8.14 */
+#define LMQT (getCommonConfig()->lastMemberQueryInterval * getCommonConfig()->lastMemberQueryCount)
+
+/* Max response code of a last member query, in units of 1/10 second */
+#define LMQI_CODE(conf) ((conf)->lastMemberQueryInterval / 100)
 
     
 typedef struct {
@@ -87,16 +94,16 @@ void acceptGroupReport(uint32_t src, uint32_t group, uint8_t type) {
 
     // Sanitycheck the group adress...
     if(!IN_MULTICAST( ntohl(group) )) {
-        my_log(LOG_WARNING, 0, "The group address %s is not a valid Multicast group.",
-            inetFmt(group, s1));
+        my_log(LOG_WARNING, 0, "The group address %I is not a valid Multicast group.",
+            group);
         return;
     }
 
     // Find the interface on which the report was recieved.
     sourceVif = getIfByAddress( src );
     if(sourceVif == NULL) {
-        my_log(LOG_WARNING, 0, "No interfaces found for source %s",
-            inetFmt(src,s1));
+        my_log(LOG_WARNING, 0, "No interfaces found for source %I",
+            src);
         return;
     }
 
@@ -108,8 +115,8 @@ void acceptGroupReport(uint32_t src, uint32_t group, uint8_t type) {
     // We have a IF so check that it's an downstream IF.
     if(sourceVif->state == IF_STATE_DOWNSTREAM) {
 
-        my_log(LOG_DEBUG, 0, "Should insert group %s (from: %s) to route table. Vif Ix : %d",
-            inetFmt(group,s1), inetFmt(src,s2), sourceVif->index);
+        my_log(LOG_DEBUG, 0, "Should insert group %I (from: %I) to route table. Vif Ix : %d",
+            group, src, sourceVif->index);
 
         // The membership report was OK... Insert it into the route table..
         //insertRoute(group, sourceVif->index);
@@ -122,7 +129,7 @@ void acceptGroupReport(uint32_t src, uint32_t group, uint8_t type) {
 #if defined(IGMPv3_PROXY)
 
         // Eric, ignore ssdp/upnp
-        inetFmt(group,s1);
+        /* inetFmt(group,s1); */
         /* if( strcmp(s1, "239.255.255.250") ) */
         /*     IGMP_snooping_handle_join(src, group); */
 
@@ -160,6 +167,12 @@ void acceptGroupReport(uint32_t src, uint32_t group, uint8_t type) {
         }
        
         insertRoute(group, sourceVif->index);
+
+        if(sourceVif->explicitTracking) {
+            /* Suppressed v1/v2 reports leave hosts out, stop trusting the list */
+            gp->untracked = 1;
+            hostReport(gp, src, IGMP_MODE_IS_EXCLUDE, 0, NULL);
+        }
         
         my_log(LOG_INFO, 0, "In %s", __FUNCTION__);
         processModeIsExclude(sourceVif, gp, 0, NULL);
@@ -182,7 +195,7 @@ void acceptGroupReport(uint32_t src, uint32_t group, uint8_t type) {
 		return;
 	    }
 #endif
-	my_log(LOG_INFO, 0, "The group address %s may not be requested from this interface. Ignoring.", inetFmt(group, s1));
+	my_log(LOG_INFO, 0, "The group address %I may not be requested from this interface. Ignoring.", group);
     } else {
         // Log the state of the interface the report was recieved on.
         my_log(LOG_INFO, 0, "Mebership report was recieved on %s. Ignoring.",
@@ -198,21 +211,21 @@ void acceptLeaveMessage(uint32_t src, uint32_t group) {
     struct IfDesc   *sourceVif;
     
     my_log(LOG_DEBUG, 0,
-	    "Got leave message from %s to %s. Starting last member detection.",
-	    inetFmt(src, s1), inetFmt(group, s2));
+	    "Got leave message from %I to %I. Starting last member detection.",
+	    src, group);
 
     // Sanitycheck the group adress...
     if(!IN_MULTICAST( ntohl(group) )) {
-        my_log(LOG_WARNING, 0, "The group address %s is not a valid Multicast group.",
-            inetFmt(group, s1));
+        my_log(LOG_WARNING, 0, "The group address %I is not a valid Multicast group.",
+            group);
         return;
     }
 
     // Find the interface on which the report was recieved.
     sourceVif = getIfByAddress( src );
     if(sourceVif == NULL) {
-        my_log(LOG_WARNING, 0, "No interfaces found for source %s",
-            inetFmt(src,s1));
+        my_log(LOG_WARNING, 0, "No interfaces found for source %I",
+            src);
         return;
     }
 
@@ -246,6 +259,15 @@ void acceptLeaveMessage(uint32_t src, uint32_t group) {
 
         timer_clearTimer(gp->v2_host_timer);
         gp->v2_host_timer = timer_setTimer(IGMP_GMI, oldHostTimerTimeout, gp);
+
+        if(sourceVif->explicitTracking) {
+            /* The leave is TO_IN{}. The hosts are not all known in v2 mode,
+             * so the group is queried before it goes. */
+            gp->untracked = 1;
+            hostReport(gp, src, IGMP_CHANGE_TO_INCLUDE_MODE, 0, NULL);
+            processChangeToIncludeMode(sourceVif, gp, 0, NULL);
+            return;
+        }
         
         processModeIsInclude(sourceVif, gp, 0, NULL);
 #else
@@ -264,7 +286,7 @@ void acceptLeaveMessage(uint32_t src, uint32_t group) {
 #endif
     } else {
         // just ignore the leave request...
-        my_log(LOG_DEBUG, 0, "The found if for %s was not downstream. Ignoring leave request.", inetFmt(src, s1));
+        my_log(LOG_DEBUG, 0, "The found if for %I was not downstream. Ignoring leave request.", src);
     }
 }
 
@@ -275,37 +297,9 @@ void acceptLeaveMessage(uint32_t src, uint32_t group) {
 struct group *
 interfaceGroupLookup(struct IfDesc *sourceVif, uint32_t groupAddr)
 {
-    struct group *gp = NULL;
-    int flag = 0;
-
-    my_log(LOG_INFO, 0, "Look group address %s.", __FUNCTION__); 
-    interfaceGroupLog(sourceVif);
-
     assert(sourceVif != NULL);
 
-    /* Search the group in the interface */
-    if(sourceVif->ngps == 0)
-	return NULL;
-
-    int nnodes = sourceVif->ngps;
-    list_for_each(&sourceVif->groups, gp, list) {
-        if (nnodes-- > 0) {
-            if(gp && gp->mcast.s_addr == groupAddr) {
-                my_log(LOG_INFO, 0, "XXX: find group address %s: %s in interface %s num of group %d.", 
-                    inetFmt(groupAddr, s1), inetFmt(gp->mcast.s_addr, s2), sourceVif->Name, sourceVif->ngps - nnodes);
-                flag = 1;
-                break;
-            }
-        } else {
-           flag = 0;
-           break;
-        }
-    }
-
-    if (flag)
-        return gp;
-    else
-        return NULL;
+    return addrHashLookup(&sourceVif->groupHash, groupAddr);
 }
 
 /*
@@ -318,12 +312,12 @@ groupCreate(uint32_t groupAddr)
 
     // Sanitycheck the group adress...
     if( ! IN_MULTICAST( ntohl(groupAddr) )) {
-        my_log(LOG_WARNING, 0, "The group address %s(%s) is not a valid Multicast group. group create failed.",
-            inetFmt(groupAddr, s1), inetFmt(ntohl(groupAddr), s2));
+        my_log(LOG_WARNING, 0, "The group address %I(%I) is not a valid Multicast group. group create failed.",
+            groupAddr, ntohl(groupAddr));
         return NULL;
     }
     
-    if ((gp = malloc(sizeof(*gp))) != NULL) {
+    if ((gp = poolAlloc(POOL_GROUP)) != NULL) {
         gp->mcast.s_addr               = groupAddr;
         gp->timer                      = INVAILD_TIMER;        /* Maybe need to chanage */
         gp->fmode                      = IGMP_V3_FMODE_INCLUDE; /* Default is INCLUDE{NUL} mode */
@@ -334,10 +328,19 @@ groupCreate(uint32_t groupAddr)
         gp->is_scheduled               = 0;
         gp->query_retransmission_count = 0;
         gp->query_timer                = INVAILD_TIMER;
+        gp->srcaddrs                   = NULL;
+        gp->srcs                       = NULL;
         gp->nsrcs                      = 0;
+        gp->srcsize                    = 0;
         gp->nscheduled_src             = 0;
-
-        list_head_init(&gp->sources);
+        gp->contributing               = 0;
+        gp->contrib_fmode              = IGMP_V3_FMODE_INCLUDE;
+        gp->contrib                    = NULL;
+        gp->ncontrib                   = 0;
+        gp->contribsize                = 0;
+        list_head_init(&gp->hosts);
+        gp->nhosts                     = 0;
+        gp->untracked                  = 0;
     } else {
         my_log(LOG_ERR, 0, "Creat new group error.");
     }
@@ -353,33 +356,34 @@ void groupDestory(struct group *gp)
 {
     assert(gp != NULL);
 
-    struct source *src = NULL;
-    struct source *nxt = NULL;
+    int i;
 
     /* Remove the group from interface */
-    my_log(LOG_DEBUG, 0, "XXX: Destory group %s : num of group %d", inetFmt(gp->mcast.s_addr, s1), gp->interface->ngps);
+    my_log(LOG_DEBUG, 0, "XXX: Destory group %I : num of group %d", gp->mcast.s_addr, gp->interface->ngps);
     list_del(&gp->list);
+    addrHashRemove(&gp->interface->groupHash, gp->mcast.s_addr);
     if(gp->interface->ngps > 0)
         gp->interface->ngps--;
 
-    interfaceGroupLog(gp->interface);
-
     /* Clean the timers */
     timer_clearTimer(gp->v1_host_timer);
     timer_clearTimer(gp->v2_host_timer);
     timer_clearTimer(gp->timer);
+    timer_clearTimer(gp->query_timer);
 
-    /* XXX: Do we need to free the sources? */
-    int nnodes = gp->nsrcs;
-    list_for_each_safe(&gp->sources, src, nxt, list) {
-        if (nnodes-- > 0) {
-            sourceDestory(src);
-        } else {
-            break;
-        }
-    }
+    /* Take the group out of the member database */
+    memberGroupRetract(gp);
+
+    /* Forget the tracked hosts */
+    hostFlush(gp);
 
-    free(gp);
+    /* Free the sources */
+    for(i = 0; i < gp->nsrcs; i++)
+        sourceFree(gp->srcs[i]);
+    free(gp->srcaddrs);
+    free(gp->srcs);
+
+    poolFree(POOL_GROUP, gp);
     gp = NULL;
 }
 
@@ -395,62 +399,146 @@ interfaceGroupAdd(struct IfDesc *sourceVif, uint32_t groupAddr)
 
     // Sanitycheck the group adress...
     if( ! IN_MULTICAST( ntohl(groupAddr) )) {
-        my_log(LOG_INFO, 0, "The group address %s is not a valid Multicast group. interface group add failed.",
-            inetFmt(groupAddr, s1));
+        my_log(LOG_INFO, 0, "The group address %I is not a valid Multicast group. interface group add failed.",
+            groupAddr);
         return 0;
     }
 
     /* Return the group if it's already present */
     if((gp = interfaceGroupLookup(sourceVif, groupAddr)) != NULL) {
 
-        my_log(LOG_INFO, 0, "----------- Find group address %s in interface %s interface number group %d.",
-            inetFmt(groupAddr, s1), sourceVif->Name, sourceVif->ngps); 
-        interfaceGroupLog(sourceVif);
+        my_log(LOG_DEBUG, 0, "Found group address %I in interface %s number group %d.",
+            groupAddr, sourceVif->Name, sourceVif->ngps); 
 
         return gp;
     }
 
     if((gp = groupCreate(groupAddr)) != NULL) {
+        if(!addrHashInsert(&sourceVif->groupHash, groupAddr, gp)) {
+            my_log(LOG_WARNING, 0, "Unable to add group %I to interface %s.",
+                groupAddr, sourceVif->Name);
+            poolFree(POOL_GROUP, gp);
+            return NULL;
+        }
         list_add(&sourceVif->groups, &gp->list); /* Add group to interface */
         sourceVif->ngps++;
 
         gp->interface = sourceVif;
 
-        my_log(LOG_INFO, 0, "************** Add group address %s to interface %s number group %d. Line %d",
-            inetFmt(groupAddr, s1), sourceVif->Name, sourceVif->ngps, __LINE__);
-        interfaceGroupLog(sourceVif);
+        my_log(LOG_INFO, 0, "Add group address %I to interface %s number group %d.",
+            groupAddr, sourceVif->Name, sourceVif->ngps);
     }
 
     return gp;
 }
 
+/*
+ * Scratch space for the set operations on the sources of a record.
+ * A record can't carry more sources than fit in the receive buffer.
+ */
+#define MAX_RECORD_SOURCES  (RECV_BUF_SIZE / sizeof(uint32_t))
+
+static struct source *matchedSources[MAX_RECORD_SOURCES];
+static uint8_t addedSources[MAX_RECORD_SOURCES];
+
+/*
+ * Compare two source addresses for qsort. Source sets are kept sorted
+ * by the numeric value of the address as stored (network byte order).
+ */
+static int sourceAddrCompare(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Sort a source list from a report or query in place and remove
+ * duplicates. Returns the number of sources left.
+ */
+static int sourceSetSort(int numsrc, uint32_t *sources)
+{
+    int i, n;
+
+    if(numsrc < 2)
+        return numsrc;
+
+    for(i = 1; i < numsrc; i++) {
+        if(sources[i - 1] >= sources[i])
+            break;
+    }
+    if(i == numsrc)
+        return numsrc; /* already sorted, the common case */
+
+    qsort(sources, numsrc, sizeof(uint32_t), sourceAddrCompare);
+
+    for(i = 1, n = 1; i < numsrc; i++) {
+        if(sources[i] != sources[n - 1])
+            sources[n++] = sources[i];
+    }
+    return n;
+}
+
+/*
+ * Binary search a source address in the group. Returns the index
+ * of the source, or -(insert position + 1) if it's not present.
+ */
+static int groupSourceIndex(struct group *gp, uint32_t sourceAddr)
+{
+    int lo = 0, hi = gp->nsrcs - 1;
+
+    while(lo <= hi) {
+        int mid = (lo + hi) / 2;
+
+        if(gp->srcaddrs[mid] < sourceAddr)
+            lo = mid + 1;
+        else if(gp->srcaddrs[mid] > sourceAddr)
+            hi = mid - 1;
+        else
+            return mid;
+    }
+    return -(lo + 1);
+}
+
 /*
  * Lookup a source in the group
  */
 struct source *
 groupSourceLookup(struct group *gp, uint32_t sourceAddr)
 {
-    struct source *src = NULL;
-    int nnodes = gp->nsrcs;
-    int flag = 0;
-   
-    /* Search the source in the group */
-    list_for_each(&gp->sources, src, list) {
-        if (nnodes-- > 0) {
-            if(src && src->addr.s_addr == sourceAddr) {
-                flag = 1;
-                break;
-            }
-        } else {
-            flag = 0;
-            break;
-        }
-    }
+    int i = groupSourceIndex(gp, sourceAddr);
 
-    if (flag)
-        return src;
-    else
-        return NULL;
+    return i >= 0 ? gp->srcs[i] : NULL;
+}
+
+/*
+ * Make room for nsrcs sources in the group, if fail, return 0
+ */
+static int groupSourceReserve(struct group *gp, int nsrcs)
+{
+    uint32_t *addrs;
+    struct source **srcs;
+    int size;
+
+    if(nsrcs <= gp->srcsize)
+        return 1;
+
+    for(size = gp->srcsize ? gp->srcsize : 4; size < nsrcs; size *= 2)
+        ;
+
+    addrs = realloc(gp->srcaddrs, size * sizeof(*addrs));
+    if(addrs == NULL)
+        return 0;
+    gp->srcaddrs = addrs;
+
+    srcs = realloc(gp->srcs, size * sizeof(*srcs));
+    if(srcs == NULL)
+        return 0;
+    gp->srcs = srcs;
+
+    gp->srcsize = size;
+    return 1;
 }
 
 /*
@@ -461,7 +549,7 @@ sourceCreate(uint32_t sourceAddr)
 {
     struct source* src = NULL;
     
-    if ((src = malloc(sizeof(*src))) != NULL) {
+    if ((src = poolAlloc(POOL_SOURCE)) != NULL) {
         src->addr.s_addr                = sourceAddr;
         src->timer                      = INVAILD_TIMER; /* Maybe need to chanage */
         src->fstate                     = 1;             /* Default is forward mode */
@@ -469,14 +557,28 @@ sourceCreate(uint32_t sourceAddr)
         src->query_retransmission_count = 0;
         src->gp                         = NULL;
 
-        my_log(LOG_INFO, 0, "Creat source %s.", inetFmt(sourceAddr, s1));
+        my_log(LOG_DEBUG, 0, "Creat source %I.", sourceAddr);
     } else {
-        my_log(LOG_ERR, 0, "Creat new source error.");
+        my_log(LOG_WARNING, 0, "Creat new source error.");
     }
     
     return src;	
 }
 
+/*
+ * Free a source which is no longer in the source set of its group
+ */
+static void sourceFree(struct source *src)
+{
+    if(src->is_scheduled && src->gp->nscheduled_src > 0)
+        src->gp->nscheduled_src--;
+
+    /* Clean ther source timer */
+    timer_clearTimer(src->timer);
+
+    poolFree(POOL_SOURCE, src);
+}
+
 /*
  * Destory a source
  */
@@ -486,15 +588,17 @@ void sourceDestory(struct source *src)
     if(!src)
         return;
 
-    /* Remove from the group */
-    list_del(&src->list);
-    src->gp->nsrcs--;
+    struct group *gp = src->gp;
+    int i = groupSourceIndex(gp, src->addr.s_addr);
 
-    /* Clean ther source timer */
-    timer_clearTimer(src->timer);
+    /* Remove from the group */
+    if(i >= 0) {
+        memmove(&gp->srcaddrs[i], &gp->srcaddrs[i + 1], (gp->nsrcs - i - 1) * sizeof(uint32_t));
+        memmove(&gp->srcs[i], &gp->srcs[i + 1], (gp->nsrcs - i - 1) * sizeof(struct source *));
+        gp->nsrcs--;
+    }
 
-    free(src);
-    src= NULL;
+    sourceFree(src);
 }
 
 /*
@@ -506,13 +610,21 @@ groupSourceAdd(struct group *gp, uint32_t sourceAddr)
     assert(gp != NULL);
 
     struct source *src = NULL;
+    int i = groupSourceIndex(gp, sourceAddr);
 
     /* Return the source if it's already present */
-    if((src = groupSourceLookup(gp, sourceAddr)) != NULL)
-        return src;
+    if(i >= 0)
+        return gp->srcs[i];
+    i = -i - 1;
+
+    if(!groupSourceReserve(gp, gp->nsrcs + 1))
+        return NULL;
 
     if((src = sourceCreate(sourceAddr)) != NULL) {
-        list_add(&gp->sources, &src->list); /* Add source to group */
+        memmove(&gp->srcaddrs[i + 1], &gp->srcaddrs[i], (gp->nsrcs - i) * sizeof(uint32_t));
+        memmove(&gp->srcs[i + 1], &gp->srcs[i], (gp->nsrcs - i) * sizeof(struct source *));
+        gp->srcaddrs[i] = sourceAddr;
+        gp->srcs[i] = src;
         gp->nsrcs++;
 
         src->gp = gp;  
@@ -521,9 +633,150 @@ groupSourceAdd(struct group *gp, uint32_t sourceAddr)
     return src; 
 }
 
+/*
+ * Find the sources of the sorted list B in the group (A*B).
+ * matched[k] is set to the source of B[k], or NULL if it's not present.
+ * Returns the number of sources found.
+ */
+static int groupSourceMatch(struct group *gp, int numsrc, uint32_t *sources, struct source **matched)
+{
+    int i = 0, k, n = 0;
+
+    for(k = 0; k < numsrc; k++) {
+        while(i < gp->nsrcs && gp->srcaddrs[i] < sources[k])
+            i++;
+        if(i < gp->nsrcs && gp->srcaddrs[i] == sources[k]) {
+            matched[k] = gp->srcs[i++];
+            n++;
+        } else {
+            matched[k] = NULL;
+        }
+    }
+    return n;
+}
+
+/*
+ * Keep only the sources of the group which are in the sorted list B,
+ * that is A = A*B. The others are destroyed.
+ */
+static void groupSourceRetain(struct group *gp, int numsrc, uint32_t *sources)
+{
+    int i, k = 0, n = 0;
+
+    for(i = 0; i < gp->nsrcs; i++) {
+        while(k < numsrc && sources[k] < gp->srcaddrs[i])
+            k++;
+        if(k < numsrc && sources[k] == gp->srcaddrs[i]) {
+            gp->srcaddrs[n] = gp->srcaddrs[i];
+            gp->srcs[n++] = gp->srcs[i];
+        } else {
+            sourceFree(gp->srcs[i]);
+        }
+    }
+    gp->nsrcs = n;
+}
+
+/*
+ * Add the sources of the sorted list B to the group, that is A = A+B.
+ * matched[k] is set to the source of B[k], and added[k], if not NULL,
+ * tells if it was created. Nothing is changed on failure, returns 0.
+ */
+static int groupSourceUnion(struct group *gp, int numsrc, uint32_t *sources,
+                            struct source **matched, uint8_t *added)
+{
+    int i, k, n, nnew;
+
+    /* Find (B-A), the existing sources are matched on the way */
+    nnew = numsrc - groupSourceMatch(gp, numsrc, sources, matched);
+    if(nnew == 0) {
+        if(added)
+            memset(added, 0, numsrc);
+        return 1;
+    }
+
+    if(!groupSourceReserve(gp, gp->nsrcs + nnew))
+        return 0;
+
+    for(k = 0; k < numsrc; k++) {
+        if(added)
+            added[k] = matched[k] == NULL;
+        if(matched[k] == NULL) {
+            if((matched[k] = sourceCreate(sources[k])) == NULL) {
+                while(k-- > 0) {
+                    if(matched[k]->gp == NULL)
+                        poolFree(POOL_SOURCE, matched[k]);
+                }
+                return 0;
+            }
+            matched[k]->gp = NULL; /* not linked yet */
+        }
+    }
+
+    /* Merge from the back so the existing entries move only once */
+    i = gp->nsrcs - 1;
+    n = gp->nsrcs + nnew;
+    for(k = numsrc - 1; k >= 0; k--) {
+        if(matched[k]->gp != NULL)
+            continue; /* already present */
+        while(i >= 0 && gp->srcaddrs[i] > sources[k]) {
+            n--;
+            gp->srcaddrs[n] = gp->srcaddrs[i];
+            gp->srcs[n] = gp->srcs[i];
+            i--;
+        }
+        n--;
+        gp->srcaddrs[n] = sources[k];
+        gp->srcs[n] = matched[k];
+        matched[k]->gp = gp;
+    }
+    gp->nsrcs += nnew;
+    return 1;
+}
+
+/*
+ * Explicit tracking is trusted only when all the hosts are known. IGMPv1
+ * and v2 hosts hold back their report when they hear another one, so
+ * a group in compatibility mode never has them all.
+ */
+#define groupTracked(gp) ((gp)->interface->explicitTracking && !(gp)->untracked && \
+                          (gp)->version == IGMP_V3)
+
+/*
+ * With explicit tracking the hosts of the group are known, so a leave
+ * needs no query: a source no host wants anymore expires at once, one
+ * still wanted is left alone. Returns 0 if the source must be queried.
+ */
+static int sourceTrackedLeave(struct group *gp, struct source *src)
+{
+    if(!groupTracked(gp))
+        return 0;
+
+    if(!hostWantsSource(gp, src->addr.s_addr)) {
+        timer_clearTimer(src->timer);
+        src->timer = timer_setTimer(0, sourceTimerTimeout, src);
+    }
+    return 1;
+}
+
+/*
+ * The same for the group in EXCLUDE mode. Returns 0 if the group must
+ * be queried.
+ */
+static int groupTrackedLeave(struct group *gp)
+{
+    if(!groupTracked(gp))
+        return 0;
+
+    if(!hostWantsGroup(gp)) {
+        timer_clearTimer(gp->timer);
+        gp->timer = timer_setTimer(0, groupTimerTimeout, gp);
+    }
+    return 1;
+}
+
 /*
  * Handle a is_in{A} report for a group 
- * the report have only one source
+ * the sources of the report are sorted, see sourceSetSort()
  */
 void
 processModeIsInclude(struct IfDesc *sourceVif, struct group *gp, int numsrc, uint32_t *sources) {
@@ -541,18 +794,18 @@ processModeIsInclude(struct IfDesc *sourceVif, struct group *gp, int numsrc, uin
          * INCLUDE (A)    IS_IN (B)     INCLUDE (A+B)            (B)=GMI 
          * EXCLUDE (X,Y)  IS_IN (A)     EXCLUDE (X+A,Y-A)        (A)=GMI          
          */
+        if(!groupSourceUnion(gp, numsrc, sources, matchedSources, NULL)) {
+            my_log(LOG_WARNING, 0, "add filter source fail.");
+            break;
+        }
+
         for(int i = 0; i < numsrc; i++) {
-           src = groupSourceAdd(gp, sources[i]);
-           
-           if(src) {
-               /* Update the source state */
-               timer_clearTimer(src->timer);
-               src->timer    = INVAILD_TIMER;
-               src->timer    = timer_setTimer(IGMP_GMI, sourceTimerTimeout, src);
-               src->fstate   = 1;
-            } else {
-                my_log(LOG_ERR, 0, "add filter source fail.");
-            }
+            src = matchedSources[i];
+
+            /* Update the source state */
+            timer_clearTimer(src->timer);
+            src->timer    = timer_setTimer(IGMP_GMI, sourceTimerTimeout, src);
+            src->fstate   = 1;
         }
         break;
 
@@ -563,25 +816,20 @@ processModeIsInclude(struct IfDesc *sourceVif, struct group *gp, int numsrc, uin
 
     /* XXX: Update the membership/router info */
     my_log(LOG_INFO, 0, "Update database in %s", __FUNCTION__);
-    memberDatabaseUpdate(gp->mcast.s_addr);    
+    memberGroupUpdate(gp);    
 }
 
 /*
  * Handle a is_ex{A} report for a group 
- * the report have only one source
+ * the sources of the report are sorted, see sourceSetSort()
  */
 void
 processModeIsExclude(struct IfDesc *sourceVif, struct group *gp, int numsrc, uint32_t *sources) {
     struct source *src = NULL;
-    struct source *nxt = NULL;
-    int nnodes = 0;
-    int flag = 0;
     
     assert(gp != NULL);
     assert(sourceVif != NULL);
 
-    interfaceGroupLog(sourceVif);
-
     switch (gp->fmode) {
     case IGMP_V3_FMODE_INCLUDE:
         /*
@@ -594,47 +842,18 @@ processModeIsExclude(struct IfDesc *sourceVif, struct group *gp, int numsrc, uin
         gp->fmode = IGMP_V3_FMODE_EXCLUDE; /* Change the group mode */
 
         /* Delete (A-B) */
-        nnodes = gp->nsrcs;
-        list_for_each_safe(&gp->sources, src, nxt, list) {
-            if(nnodes-- > 0) {
-                int i;
-                flag = 0;
-                for(i = 0; i < numsrc; i++) {
-                    if(src && src->addr.s_addr == sources[i]) {/* (A * B) */
-                        flag = 1;
-                        break;
-                    }
-                }
-
-                /* We don't find it, delete it */
-                if(!flag)
-                    sourceDestory(src);
-	    } else {
-                break;
-            }
-        }
-
-        for(int i = 0; i < numsrc; i++) {
-            src = groupSourceLookup(gp, sources[i]);
-            if(src) {
-                /* (B) in the (A) */
-                src->fstate = 1; /* FIXME: We don't need to update fstate */
-            } else {
-                /* (B) not in the (A), add it to unactive list */
-                if((src = sourceCreate(sources[i])) != NULL) {
-                    list_add(&gp->sources, &src->list); /* Add source to group */
-                    gp->nsrcs++;
-
-                    src->fstate = 0; /* Unactive this source */
+        groupSourceRetain(gp, numsrc, sources);
 
-                    src->gp = gp;  
-                }
-            }
+        /* (B) not in the (A), add it to unactive list */
+        if(groupSourceUnion(gp, numsrc, sources, matchedSources, addedSources)) {
+            for(int i = 0; i < numsrc; i++)
+                matchedSources[i]->fstate = addedSources[i] ? 0 : 1;
+        } else {
+            my_log(LOG_WARNING, 0, "add filter source fail.");
         }
 
         /* Update the group timer */
         timer_clearTimer(gp->timer);
-        gp->timer = INVAILD_TIMER;
         gp->timer = timer_setTimer(IGMP_GMI, groupTimerTimeout, gp);
                 
         break;
@@ -650,50 +869,26 @@ processModeIsExclude(struct IfDesc *sourceVif, struct group *gp, int numsrc, uin
          */
 
         /* Delete (X-A) and (Y-A) */
-        nnodes = gp->nsrcs;
-        list_for_each_safe(&gp->sources, src, nxt, list) {
-            if(nnodes-- > 0) {
-                int i;
-                flag = 0;
-                for(i = 0; i< numsrc; i++) {
-                    if(src && src->addr.s_addr == sources[i]) {
-                        flag = 1;
-                        break;
-                    } 
-                }
-
-                /* We don't find it, delete it */
-                if(!flag)
-                    sourceDestory(src);
-             } else {
-                 break;
-             }
-        }
+        groupSourceRetain(gp, numsrc, sources);
 
-        /* Get (A-Y) */
-        for(int i = 0; i < numsrc; i++) {
-           src = groupSourceLookup(gp, sources[i]);
-           
-           if(!src) {
-                if((src = sourceCreate(sources[i]))) {
-                    list_add(&gp->sources, &src->list); /* Add source to group */
-                    gp->nsrcs++;
+        /* Get (A-X-Y) */
+        if(groupSourceUnion(gp, numsrc, sources, matchedSources, addedSources)) {
+            for(int i = 0; i < numsrc; i++) {
+                if(!addedSources[i])
+                    continue;
 
-                    src->gp = gp;  
-                }
+                src = matchedSources[i];
                 src->fstate = 1; /* Active this source */
 
-                /* Update the source timer */
                 /* (A-X-Y) = GMI */
-                timer_clearTimer(src->timer);
-                src->timer = INVAILD_TIMER;
                 src->timer = timer_setTimer(IGMP_GMI, sourceTimerTimeout, src);
             }
+        } else {
+            my_log(LOG_WARNING, 0, "add filter source fail.");
         }
 
         /* Update the group timer */
         timer_clearTimer(gp->timer);
-        gp->timer = INVAILD_TIMER;
         gp->timer = timer_setTimer(IGMP_GMI, groupTimerTimeout, gp);
         break;
 
@@ -704,19 +899,18 @@ processModeIsExclude(struct IfDesc *sourceVif, struct group *gp, int numsrc, uin
 
     /* XXX: Update the membership/router info */
     my_log(LOG_INFO, 0, "Update database in %s", __FUNCTION__);
-    interfaceGroupLog(sourceVif);
-    memberDatabaseUpdate(gp->mcast.s_addr); 
+    memberGroupUpdate(gp); 
 }
 
 /*
  * Handle to_in{ } report for a group 
+ * the sources of the report are sorted, see sourceSetSort()
  */
 void
 processChangeToIncludeMode(struct IfDesc *sourceVif, struct group *gp, int numsrc, uint32_t *sources) {
     struct source *src = NULL;
     int nsource = 0;
-    int nnodes = 0;
-    int flag = 0;
+    int i, k;
     uint32_t *srcs = NULL;
     
     assert(gp != NULL);
@@ -724,60 +918,53 @@ processChangeToIncludeMode(struct IfDesc *sourceVif, struct group *gp, int numsr
 
     /* In IGMPv1 group compatibility mode, ignored TO_IN{} */
     if(gp->version == IGMP_V1)
-        return;    
+        return;
 
     switch (gp->fmode) {
     case IGMP_V3_FMODE_INCLUDE:
+    case IGMP_V3_FMODE_EXCLUDE:
         /*
          * Router State   Report Rec'd New Router State        Actions
          *  ------------   ------------ ----------------        -------
          * INCLUDE (A)    TO_IN (B)    INCLUDE (A+B)           (B)=GMI
          *                                                      Send Q(G,A-B)       
+         * EXCLUDE (X,Y)  TO_IN (A)    EXCLUDE (X+A,Y-A)       (A)=GMI
+         *                                                      Send Q(G,X-A)
+         *                                                      Send Q(G)
          */
-        for(int i = 0; i < numsrc; i++) {
-           src = groupSourceAdd(gp, sources[i]);
-           
-           if(src) {
-               /* Update the source state */
-               timer_clearTimer(src->timer);
-               src->timer    = INVAILD_TIMER;
-               src->timer    = timer_setTimer(IGMP_GMI, sourceTimerTimeout, src);
-               src->fstate   = 1;
-            } else {
-                my_log(LOG_ERR, 0, "add filter source fail.");
+        if(groupSourceUnion(gp, numsrc, sources, matchedSources, NULL)) {
+            for(i = 0; i < numsrc; i++) {
+                src = matchedSources[i];
+
+                /* Update the source state */
+                timer_clearTimer(src->timer);
+                src->timer    = timer_setTimer(IGMP_GMI, sourceTimerTimeout, src);
+                src->fstate   = 1;
             }
+        } else {
+            my_log(LOG_WARNING, 0, "add filter source fail.");
         }
 
-        /* Send Q(G, A-B) */
+        /* Send Q(G, A-B) or Q(G, X-A), the active sources not reported */
         srcs = malloc(gp->nsrcs * sizeof(uint32_t));
-        if(!srcs) {
-            my_log(LOG_ERR, 0, "Can't malloc %d size uint32_t", gp->nsrcs);
+        if(gp->nsrcs && !srcs) {
+            my_log(LOG_WARNING, 0, "Can't malloc %d size uint32_t", gp->nsrcs);
+            break;
         }
         
-        nnodes = gp->nsrcs;
-        list_for_each(&gp->sources, src, list) {
-            if(nnodes-- > 0) {
-                int i;
-                flag = 0;
-                for(i = 0; i< numsrc; i++) {
-                    if(src && src->addr.s_addr == sources[i]) {
-                        flag = 1;
-                        break;
-                    }
-                }
-                
-                /* We don't find it */
-                if(!flag) {
-                    srcs[nsource] = src->addr.s_addr;
-                    nsource++;
-            
-                    if(!src->is_scheduled) {
-                        src->is_scheduled = 1; /* We will send Q(G, S) */
-                        gp->nscheduled_src++;
-                    }
-                }
-            } else {
-                break;
+        for(i = 0, k = 0; i < gp->nsrcs; i++) {
+            src = gp->srcs[i];
+            while(k < numsrc && sources[k] < gp->srcaddrs[i])
+                k++;
+            if((k < numsrc && sources[k] == gp->srcaddrs[i]) || src->fstate != 1)
+                continue;
+            if(sourceTrackedLeave(gp, src))
+                continue;
+
+            srcs[nsource++] = src->addr.s_addr;
+            if(!src->is_scheduled) {
+                src->is_scheduled = 1; /* We will send Q(G, S) */
+                gp->nscheduled_src++;
             }
         }
         
@@ -786,77 +973,12 @@ processChangeToIncludeMode(struct IfDesc *sourceVif, struct group *gp, int numsr
         }
         free(srcs);        
 
-        break;
+        if(gp->fmode == IGMP_V3_FMODE_EXCLUDE && !groupTrackedLeave(gp)) {
+            if(!gp->is_scheduled)
+                gp->is_scheduled = 1;
 
-    case IGMP_V3_FMODE_EXCLUDE:
-        /*
-         * Router State   Report Rec'd New Router State        Actions
-         *  ------------   ------------ ----------------        -------
-         * EXCLUDE (X,Y)  TO_IN (A)    EXCLUDE (X+A,Y-A)       (A)=GMI
-         *                                                      Send Q(G,X-A)
-         *                                                      Send Q(G)
-         */
-        for(int i = 0; i < numsrc; i++) {
-           src = groupSourceAdd(gp, sources[i]);
-
-           if (src) {
-               /* Update the source state */
-               src->fstate   = 1;
-               timer_clearTimer(src->timer);
-               src->timer = INVAILD_TIMER;
-               src->timer    = timer_setTimer(IGMP_GMI, sourceTimerTimeout, src);
-           } else {
-               my_log(LOG_ERR, 0, "add filter source fail");
-           }
-        }
-
-        /* 
-         *    Send Q(G, X-A)
-         *    Send Q(G) 
-         */
-        srcs = malloc(gp->nsrcs * sizeof(uint32_t));
-        if(!srcs) {
-            my_log(LOG_ERR, 0, "Can't malloc %d size uint32_t", gp->nsrcs);
+            sendGroupSpecificMemberQuery(gp);
         }
-
-        nnodes = gp->nsrcs;
-        list_for_each(&gp->sources, src, list) {
-            if(nnodes-- > 0) {
-                if(src && src->fstate == 1) {
-                    int i;
-                    flag = 0;
-                    for(i = 0; i< numsrc; i++) {
-                        if(src->addr.s_addr == sources[i]) {
-                            flag = 1;
-                            break;
-                        }
-                    }
-                    
-                    if(!flag) {
-                        srcs[nsource] = src->addr.s_addr;
-                        nsource++;
-
-                        if(!src->is_scheduled) {
-                            src->is_scheduled = 1; /* We will send Q(G, S) */
-                            gp->nscheduled_src++;
-                        }
-                    }
-                }
-            } else {
-                break;
-            }
-        }
-        
-        if(nsource != 0) {
-            sendGroupSourceSpecificMembershipQuery(gp, 0, nsource, srcs);
-        }
-        free(srcs);
-
-        if(!gp->is_scheduled)
-            gp->is_scheduled = 1;
-
-        sendGroupSpecificMemberQuery(gp);
-        
         break;
 
     default:
@@ -866,19 +988,18 @@ processChangeToIncludeMode(struct IfDesc *sourceVif, struct group *gp, int numsr
 
     /* XXX: Update the membership/router info */
     my_log(LOG_INFO, 0, "Update database in %s", __FUNCTION__);
-    memberDatabaseUpdate(gp->mcast.s_addr);
+    memberGroupUpdate(gp);
 }
 
 /*
  * Handle to_ex{ } report for a group 
+ * the sources of the report are sorted, see sourceSetSort()
  */
 void
 processChangeToExcludeMode(struct IfDesc *sourceVif, struct group *gp, int numsrc, uint32_t *sources) {
     struct source *src = NULL;
-    struct source *nxt = NULL;
     int  nsource = 0;
-    int  nnodes = 0;
-    int  flag = 0;
+    int  i;
     uint32_t *srcs = NULL;    
 
     assert(gp != NULL);
@@ -905,62 +1026,38 @@ processChangeToExcludeMode(struct IfDesc *sourceVif, struct group *gp, int numsr
          */
         gp->fmode = IGMP_V3_FMODE_EXCLUDE; /* Change the group mode */
         
-        srcs = malloc(numsrc * sizeof(uint32_t));
-        if(!srcs) {
-            my_log(LOG_ERR, 0, "Can't malloc %d size uint32_t", numsrc);
-        }
-       
         /* Delete (A-B) */
-        nnodes = gp->nsrcs;
-        list_for_each_safe(&gp->sources, src, nxt, list) {
-            if(nnodes-- > 0) {
-                int i;
-                flag = 0;
-                for(i = 0; i< numsrc; i++) {
-                    if(src && src->addr.s_addr == sources[i]) {
-                        srcs[nsource] = sources[i];
-                        nsource++;
-
-                        if(!src->is_scheduled) {
-                            src->is_scheduled = 1;
-                            gp->nscheduled_src++;
-                        }
-                        flag = 1;
-                        break;
-                    }
-                }
+        groupSourceRetain(gp, numsrc, sources);
 
-                /* We don't find it, delete it */
-                if(!flag)
-                    sourceDestory(src);
-            } else {
-                break;
+        /* Schedule Q(G, A*B), what is left of the group */
+        srcs = malloc(gp->nsrcs * sizeof(uint32_t));
+        if(gp->nsrcs && !srcs) {
+            my_log(LOG_WARNING, 0, "Can't malloc %d size uint32_t", gp->nsrcs);
+        }
+        for(i = 0; srcs && i < gp->nsrcs; i++) {
+            src = gp->srcs[i];
+            if(sourceTrackedLeave(gp, src))
+                continue;
+            srcs[nsource++] = src->addr.s_addr;
+            if(!src->is_scheduled) {
+                src->is_scheduled = 1;
+                gp->nscheduled_src++;
             }
         }
 
-        for(int i = 0; i < numsrc; i++) {
-            src = groupSourceLookup(gp, sources[i]);
-            if(src) {
-                /* (B) in the (A) */
-                src->fstate = 1; /* FIXME: We don't need to update fstate */
-            } else {
-                /* (B) not in the (A), add it to unactive list */
-                if((src = sourceCreate(sources[i]))) {
-                    list_add(&gp->sources, &src->list); /* Add source to group */
-                    gp->nsrcs++;
-
-                    src->fstate = 0; /* Unactive this source */
-                    src->gp = gp;  
-                }
-            }
+        /* (B) not in the (A), add it to unactive list */
+        if(groupSourceUnion(gp, numsrc, sources, matchedSources, addedSources)) {
+            for(i = 0; i < numsrc; i++)
+                matchedSources[i]->fstate = addedSources[i] ? 0 : 1;
+        } else {
+            my_log(LOG_WARNING, 0, "add filter source fail.");
         }
 
         /* Update the group timer */
         timer_clearTimer(gp->timer);
-        gp->timer = INVAILD_TIMER;
         gp->timer = timer_setTimer(IGMP_GMI, groupTimerTimeout, gp);
         
-        /* TODO: Send Q(G, A*B)*/
+        /* Send Q(G, A*B)*/
         if(nsource != 0) {
             sendGroupSourceSpecificMembershipQuery(gp, 0, nsource, srcs);
         }
@@ -980,69 +1077,40 @@ processChangeToExcludeMode(struct IfDesc *sourceVif, struct group *gp, int numsr
          */
 
         /* Delete (X-A) and (Y-A)*/
-        nnodes = gp->nsrcs;
-        list_for_each_safe(&gp->sources, src, nxt, list) {
-            if(nnodes-- > 0) {
-                int i;
-                flag = 0;
-                for(i = 0; i< numsrc; i++) {
-                    if(src && src->addr.s_addr == sources[i]) {
-                        flag = 1;
-                        break;
-                    }
-                }
+        groupSourceRetain(gp, numsrc, sources);
 
-                /* We don't find it, delete it */
-                if(!flag)
-                    sourceDestory(src);
-            } else {
-                break;
-            }
-        }
+        /* (A-X-Y) = Group Timer */
+        if(groupSourceUnion(gp, numsrc, sources, matchedSources, addedSources)) {
+            for(i = 0; i < numsrc; i++) {
+                if(!addedSources[i])
+                    continue;
 
-        for(int i = 0; i < numsrc; i++) {
-           src = groupSourceLookup(gp, sources[i]);
-           
-           if(!src) {
-                if((src = sourceCreate(sources[i]))) {
-                    list_add(&gp->sources, &src->list); /* Add source to group */
-                    gp->nsrcs++;
-
-                    src->gp = gp;  
-             
-                    src->fstate = 1; /* Active this source */
-
-                    /* Update the source timer */
-                    timer_clearTimer(src->timer);
-                    src->timer = INVAILD_TIMER;
-                    src->timer = timer_setTimer(timer_leftTimer(gp->timer), sourceTimerTimeout, src);
-                }
+                src = matchedSources[i];
+                src->fstate = 1; /* Active this source */
+                src->timer = timer_setTimer(timer_leftTimer(gp->timer), sourceTimerTimeout, src);
             }
+        } else {
+            my_log(LOG_WARNING, 0, "add filter source fail.");
         }
 
         /* Update the group timer */
         timer_clearTimer(gp->timer);
-        gp->timer = INVAILD_TIMER;
         gp->timer = timer_setTimer(IGMP_GMI, groupTimerTimeout, gp);
 
         /* Send Q(G, A-Y) */
         srcs = malloc(gp->nsrcs * sizeof(uint32_t));
-        if(!srcs) {
-            my_log(LOG_ERR, 0, "Can't malloc %d size uint32_t", gp->nsrcs);
+        if(gp->nsrcs && !srcs) {
+            my_log(LOG_WARNING, 0, "Can't malloc %d size uint32_t", gp->nsrcs);
+            break;
         }
-        nnodes = gp->nsrcs;
-        list_for_each(&gp->sources, src, list) {
-            if(nnodes-- > 0) {
-                if(src && src->fstate == 1) {
-                    srcs[nsource] = src->addr.s_addr;
-                    nsource++;
-                    if(!src->is_scheduled) {
-                        src->is_scheduled = 1;
-                        gp->nscheduled_src++;
-                    }
+        for(i = 0; i < gp->nsrcs; i++) {
+            src = gp->srcs[i];
+            if(src->fstate == 1 && !sourceTrackedLeave(gp, src)) {
+                srcs[nsource++] = src->addr.s_addr;
+                if(!src->is_scheduled) {
+                    src->is_scheduled = 1;
+                    gp->nscheduled_src++;
                 }
-            } else {
-                break;
             }
         }
         
@@ -1060,11 +1128,12 @@ processChangeToExcludeMode(struct IfDesc *sourceVif, struct group *gp, int numsr
 
     /* XXX: Update the membership/router info */
     my_log(LOG_INFO, 0, "Update database in %s", __FUNCTION__);
-    memberDatabaseUpdate(gp->mcast.s_addr);
+    memberGroupUpdate(gp);
 }
 
 /*
  * Handle a allow report for a group 
+ * the sources of the report are sorted, see sourceSetSort()
  */
 void
 processAllowNewSource(struct IfDesc *sourceVif, struct group *gp, int numsrc, uint32_t *sources) {
@@ -1082,18 +1151,18 @@ processAllowNewSource(struct IfDesc *sourceVif, struct group *gp, int numsrc, ui
          * INCLUDE (A)    ALLOW (B)    INCLUDE (A+B)           (B)=GMI
          * EXCLUDE (X,Y)  ALLOW (A)    EXCLUDE (X+A,Y-A)       (A)=GMI     
          */
+        if(!groupSourceUnion(gp, numsrc, sources, matchedSources, NULL)) {
+            my_log(LOG_WARNING, 0, "add filter source fail.");
+            break;
+        }
+
         for(int i = 0; i < numsrc; i++) {
-           src = groupSourceAdd(gp, sources[i]);
-           
-           if (src) {
-               /* Update the source state */
-               timer_clearTimer(src->timer);
-               src->timer    = INVAILD_TIMER;
-               src->timer    = timer_setTimer(IGMP_GMI, sourceTimerTimeout, src);
-               src->fstate   = 1;
-           } else {
-               my_log(LOG_ERR, 0, "add filter source fail.");
-           }
+            src = matchedSources[i];
+
+            /* Update the source state */
+            timer_clearTimer(src->timer);
+            src->timer    = timer_setTimer(IGMP_GMI, sourceTimerTimeout, src);
+            src->fstate   = 1;
         }
         break;
 
@@ -1104,35 +1173,33 @@ processAllowNewSource(struct IfDesc *sourceVif, struct group *gp, int numsrc, ui
 
     /* XXX: Update the membership/router info */
     my_log(LOG_INFO, 0, "Update database in %s", __FUNCTION__);
-    memberDatabaseUpdate(gp->mcast.s_addr);
+    memberGroupUpdate(gp);
 }
 
 /*
  * Handle a block report for a group 
+ * the sources of the report are sorted, see sourceSetSort()
  */
 void
 processBlockOldSource(struct IfDesc *sourceVif, struct group *gp, int numsrc, uint32_t *sources) {
     struct source *src = NULL;
 
     int nsource = 0;
-    int nnodes = 0;
-    //uint32_t *source = NULL;
     uint32_t *srcs = NULL;
     
     /* In IGMPv1/IGMPv2 group compatibility mode, ignored BLOCK */
     if(gp->version != IGMP_V3)
         return;    
 
-/*
-    source = malloc(nsource * sizeof(uint32_t));
-    if(!source) {
-        my_log(LOG_ERR, 0, "Malloc sources fail.\n");
-        return;
-    }    
-*/
     assert(gp != NULL);
     assert(sourceVif != NULL);
 
+    srcs = malloc(numsrc * sizeof(uint32_t));
+    if(numsrc && !srcs) {
+        my_log(LOG_WARNING, 0, "Can't malloc %d size uint32_t", numsrc);
+        return;
+    }
+
     switch (gp->fmode) {
     case IGMP_V3_FMODE_INCLUDE:
         /*
@@ -1140,36 +1207,7 @@ processBlockOldSource(struct IfDesc *sourceVif, struct group *gp, int numsrc, ui
          *  ------------   ------------ ----------------        -------
          * INCLUDE (A)    BLOCK (B)    INCLUDE (A)             Send Q(G,A*B) 
          */
-        
-        /* Send Q(G, A*B) */
-        srcs = malloc(numsrc * sizeof(uint32_t));
-        if(!srcs) {
-            my_log(LOG_ERR, 0, "Can't malloc %d size uint32_t", numsrc);
-        }
-        nnodes = gp->nsrcs;
-        list_for_each(&gp->sources, src, list) {
-            if (nnodes-- > 0) {
-                for(int i= 0; i<numsrc; i++) {
-                    if(src && src->addr.s_addr == sources[i]) {
-                        srcs[nsource] = sources[i];
-                        nsource++;
-                    
-                        if(!src->is_scheduled) {
-                            src->is_scheduled = 1;
-                            gp->nscheduled_src++;
-                        }     
-                    }
-                }
-            } else {
-                break;
-            }
-        }
-
-        if(nsource != 0) {
-            sendGroupSourceSpecificMembershipQuery(gp, 0, nsource, srcs);
-        }
-        free(srcs);
-
+        groupSourceMatch(gp, numsrc, sources, matchedSources);
         break;
 
     case IGMP_V3_FMODE_EXCLUDE:
@@ -1179,54 +1217,53 @@ processBlockOldSource(struct IfDesc *sourceVif, struct group *gp, int numsrc, ui
          *  EXCLUDE (X,Y)  BLOCK (A)    EXCLUDE (X+(A-Y),Y)     (A-X-Y)=Group Timer
          *                                                      Send Q(G,A-Y)
          */
-        srcs = malloc(numsrc * sizeof(uint32_t));
-        if(!srcs) {
-            my_log(LOG_ERR, 0, "Can't malloc %d size uint32_t", numsrc);
-        }
-        for(int i = 0; i < numsrc; i++) {
-            src = groupSourceLookup(gp, sources[i]);
-            if(!src) {
-                if((src = sourceCreate(sources[i]))) {
-                    list_add(&gp->sources, &src->list); /* Add source to group */
-                    gp->nsrcs++;
-
-                    src->gp = gp;  
-                }
-                src->fstate = 1; /* Active this source */
-
-                /* Update the source timer */
-                timer_clearTimer(src->timer);
-                src->timer = INVAILD_TIMER;
-                src->timer = timer_setTimer(timer_leftTimer(gp->timer), sourceTimerTimeout, src);                    
-            }
-
-            if(src->fstate == 1) {
-                if(!src->is_scheduled) {
-                    src->is_scheduled = 1;
-                    gp->nscheduled_src++;
-                }
-                
-                srcs[nsource] = src->addr.s_addr;
-                nsource++;
-            }
+        if(!groupSourceUnion(gp, numsrc, sources, matchedSources, addedSources)) {
+            my_log(LOG_WARNING, 0, "add filter source fail.");
+            numsrc = 0;
+            break;
         }
 
-        /* Send Q(G, A-Y) */
-        if(nsource != 0) {
-            sendGroupSourceSpecificMembershipQuery(gp, 0, nsource, srcs);
-        }
-        free(srcs);
+        for(int i = 0; i < numsrc; i++) {
+            if(!addedSources[i])
+                continue;
+
+            src = matchedSources[i];
+            src->fstate = 1; /* Active this source */
 
+            /* Update the source timer */
+            src->timer = timer_setTimer(timer_leftTimer(gp->timer), sourceTimerTimeout, src);                    
+        }
         break;
 
     default:
         my_log(LOG_ERR, 0, "I don't think we can arrive there.");
+        numsrc = 0;
         break;
     }
 
+    /* Send Q(G, A*B) or Q(G, A-Y), the reported sources still forwarded */
+    for(int i = 0; i < numsrc; i++) {
+        src = matchedSources[i];
+        if(src == NULL || src->fstate != 1)
+            continue;
+        if(sourceTrackedLeave(gp, src))
+            continue;
+
+        if(!src->is_scheduled) {
+            src->is_scheduled = 1;
+            gp->nscheduled_src++;
+        }
+        srcs[nsource++] = src->addr.s_addr;
+    }
+
+    if(nsource != 0) {
+        sendGroupSourceSpecificMembershipQuery(gp, 0, nsource, srcs);
+    }
+    free(srcs);
+
     /* XXX: Update the membership/router info */
     my_log(LOG_INFO, 0, "Update database in %s", __FUNCTION__);
-    memberDatabaseUpdate(gp->mcast.s_addr);
+    memberGroupUpdate(gp);
 }
 
 /*
@@ -1242,8 +1279,8 @@ void acceptIGMPMembershipQuery(uint32_t src, uint8_t type, char *buffer, uint32_
     /* Find the interface on which the report was recieved. */
     sourceVif = getIfByAddress( src );
     if(sourceVif == NULL) {
-        my_log(LOG_WARNING, 0, "No interfaces found for source %s",
-                inetFmt(src,s1));
+        my_log(LOG_WARNING, 0, "No interfaces found for source %I",
+                src);
         return;
     }
 
@@ -1354,11 +1391,12 @@ void sourceTimerUpdate(struct IfDesc *sourceVif, uint32_t mcast, uint32_t nsrcs,
     struct group *gp = interfaceGroupLookup(sourceVif, mcast);
     if(gp != NULL) {
         uint32_t i;
-        uint32_t source = 0;
+
+        nsrcs = sourceSetSort(nsrcs, sources);
+        groupSourceMatch(gp, nsrcs, sources, matchedSources);
 
         for(i=0; i< nsrcs; i++) {
-            source = sources[i];
-            struct source *src = groupSourceLookup(gp, source);
+            struct source *src = matchedSources[i];
             if(src != NULL) {
                 timer_clearTimer(src->timer);
                 src->timer = timer_setTimer(val, sourceTimerTimeout, src);
@@ -1436,13 +1474,47 @@ uint8_t encodeExpTimeCode8(uint32_t decodedTime)
 *   Handles incoming IGMPv3 membership reports, and
 *   appends them to the routing table.
 */
-void acceptIGMPv3GroupReport(uint32_t src, uint8_t type, char *buffer) {
+/*
+ * Checks that the group records of a report, with their sources and
+ * auxiliary data, fit in the 'len' bytes received. Returns the number of
+ * records, or -1 if the report is cut short.
+ */
+static int reportRecordsFit(struct igmpv3_report *report, int len)
+{
+    struct igmpv3_grec *record;
+    uint16_t numOfGroup, Idx;
+    char *tmp;
+    int left, reclen;
+
+    if (len < (int)sizeof(struct igmpv3_report))
+        return -1;
+    numOfGroup = ntohs(report->ngrec);
+    tmp = (char *)report->grec;
+    left = len - sizeof(struct igmpv3_report);
+
+    for (Idx = 0; Idx < numOfGroup; Idx++) {
+        if (left < (int)sizeof(struct igmpv3_grec))
+            return -1;
+        record = (struct igmpv3_grec *)tmp;
+        reclen = sizeof(struct igmpv3_grec)
+               + ntohs(record->grec_nsrcs) * sizeof(uint32_t)
+               + record->grec_auxwords * sizeof(uint32_t);
+        if (reclen > left)
+            return -1;
+        tmp += reclen;
+        left -= reclen;
+    }
+    return numOfGroup;
+}
+
+void acceptIGMPv3GroupReport(uint32_t src, uint8_t type, char *buffer, int len) {
     struct IfDesc   *sourceVif = NULL;
 
     struct igmpv3_report *report = NULL;
     struct igmpv3_grec *record = NULL;
     uint16_t numOfGroup; /* number of group in the IGMPv3 report */
     uint16_t numOfSource;/* number of source in the record */
+    int nsrcs;           /* number of distinct sources in the record */
     uint16_t auxLen;
     uint16_t Idx;
     uint32_t group;
@@ -1452,8 +1524,8 @@ void acceptIGMPv3GroupReport(uint32_t src, uint8_t type, char *buffer) {
     // Find the interface on which the report was recieved.
     sourceVif = getIfByAddress( src );
     if(sourceVif == NULL) {
-        my_log(LOG_WARNING, 0, "No interfaces found for source %s",
-                inetFmt(src,s1));
+        my_log(LOG_WARNING, 0, "No interfaces found for source %I",
+                src);
         return;
     }
 
@@ -1464,6 +1536,13 @@ void acceptIGMPv3GroupReport(uint32_t src, uint8_t type, char *buffer) {
     
     report = (struct igmpv3_report *) buffer;
 
+    // The sources are sorted in place, so they must all be in the packet.
+    if (reportRecordsFit(report, len) < 0) {
+        my_log(LOG_WARNING, 0, "The IGMPv3 report from %I is shorter than its records. Ignoring.",
+            src);
+        return;
+    }
+
     numOfGroup = ntohs(report->ngrec);
 
     tmp = (char *)report->grec;
@@ -1477,12 +1556,12 @@ void acceptIGMPv3GroupReport(uint32_t src, uint8_t type, char *buffer) {
             // Sanitycheck the group adress...
             group = record->grec_mca;
             if(!IN_MULTICAST( ntohl(group) )) {
-                my_log(LOG_WARNING, 0, "The group address %s is not a valid Multicast group.",
-                    inetFmt(group, s1));
+                my_log(LOG_WARNING, 0, "The group address %I is not a valid Multicast group.",
+                    group);
                 return;
             } else {
-                my_log(LOG_INFO, 0, "The group address is %s.",
-                    inetFmt(group, s1));
+                my_log(LOG_INFO, 0, "The group address is %I.",
+                    group);
             }
 
             // Find the group, and if not present, add it to interface
@@ -1496,7 +1575,7 @@ void acceptIGMPv3GroupReport(uint32_t src, uint8_t type, char *buffer) {
             }
 
             // Eric, ignore ssdp/upnp
-            inetFmt(group,s1);
+            /* inetFmt(group,s1); */
             /* if( strcmp(s1, "239.255.255.250") ) */
             /*     IGMP_snooping_handle_join(src, group); */
 
@@ -1509,35 +1588,48 @@ void acceptIGMPv3GroupReport(uint32_t src, uint8_t type, char *buffer) {
             uint8_t type = record->grec_type; /* record type */
             numOfSource = ntohs(record->grec_nsrcs);
 
+            if (numOfSource > MAX_RECORD_SOURCES) {
+                my_log(LOG_WARNING, 0, "Too many sources (%d) in the record for %I. Ignoring.",
+                    numOfSource, group);
+                return;
+            }
+
+            /* The set operations work on sorted source lists */
+            nsrcs = sourceSetSort(numOfSource, record->grec_src);
+
+            /* Track the state of the host before the group reacts */
+            if(sourceVif->explicitTracking)
+                hostReport(gp, src, type, nsrcs, record->grec_src);
+
             switch(type) {
             case IGMP_MODE_IS_INCLUDE:
                 my_log(LOG_INFO, 0, "In %s processModeIsInclude", __FUNCTION__);
-                processModeIsInclude(sourceVif, gp, numOfSource, record->grec_src);
+                processModeIsInclude(sourceVif, gp, nsrcs, record->grec_src);
                 break;
  
             case IGMP_MODE_IS_EXCLUDE:
                 my_log(LOG_INFO, 0, "In %s processModeIsExclude", __FUNCTION__);
-                processModeIsExclude(sourceVif, gp, numOfSource, record->grec_src);
+                processModeIsExclude(sourceVif, gp, nsrcs, record->grec_src);
                 break;
 
             case IGMP_CHANGE_TO_INCLUDE_MODE:
                 my_log(LOG_INFO, 0, "In %s processChangeToIncludeMode", __FUNCTION__);
-                processChangeToIncludeMode(sourceVif, gp, numOfSource, record->grec_src);
+                processChangeToIncludeMode(sourceVif, gp, nsrcs, record->grec_src);
                 break;
 
             case IGMP_CHANGE_TO_EXCLUDE_MODE:
                 my_log(LOG_INFO, 0, "In %s processChangeToExcludeMode", __FUNCTION__);
-                processChangeToIncludeMode(sourceVif, gp, numOfSource, record->grec_src);
+                processChangeToIncludeMode(sourceVif, gp, nsrcs, record->grec_src);
                 break;
 
             case IGMP_ALLOW_NEW_SOURCES:
                 my_log(LOG_INFO, 0, "In %s processAllowNewSource", __FUNCTION__);
-                processAllowNewSource(sourceVif, gp, numOfSource, record->grec_src);
+                processAllowNewSource(sourceVif, gp, nsrcs, record->grec_src);
                 break;
 
             case IGMP_BLOCK_OLD_SOURCES:
                 my_log(LOG_INFO, 0, "In %s processBlockOldSource", __FUNCTION__);
-                processBlockOldSource(sourceVif, gp, numOfSource, record->grec_src);
+                processBlockOldSource(sourceVif, gp, nsrcs, record->grec_src);
                 break;
             
             default:
@@ -1545,14 +1637,14 @@ void acceptIGMPv3GroupReport(uint32_t src, uint8_t type, char *buffer) {
                 break;
             }
             
-            auxLen = ntohs (record->grec_auxwords);
+            auxLen = record->grec_auxwords;
 
-            /* Skip the auxiliary data */
-            tmp +=(sizeof(struct igmpv3_grec) + numOfSource * sizeof(uint32_t) + auxLen);
+            /* Skip the auxiliary data, in 32 bit words */
+            tmp +=(sizeof(struct igmpv3_grec) + (numOfSource + auxLen) * sizeof(uint32_t));
 
 #if 0
-            my_log(LOG_DEBUG, 0, "Should insert group %s (from: %s) to route table. Vif Ix : %d",
-                inetFmt(group,s1), inetFmt(src,s2), sourceVif->index);
+            my_log(LOG_DEBUG, 0, "Should insert group %I (from: %I) to route table. Vif Ix : %d",
+                group, src, sourceVif->index);
 
 	    // If we don't have a whitelist we insertRoute and done
 	    if(sourceVif->allowedgroups == NULL)
@@ -1569,7 +1661,7 @@ void acceptIGMPv3GroupReport(uint32_t src, uint8_t type, char *buffer) {
         	    insertRoute(group, sourceVif->index);
 		    return;
 	        }
-	    my_log(LOG_INFO, 0, "The group address %s may not be requested from this interface. Ignoring.", inetFmt(group, s1));
+	    my_log(LOG_INFO, 0, "The group address %I may not be requested from this interface. Ignoring.", group);
 #endif
         }
     } else {
@@ -1590,7 +1682,7 @@ void scheduledRetransmissionQuery(void *argument) {
     uint32_t *sources_without_sflag = NULL;
     uint32_t nwith_sflag = 0;
     uint32_t nwithout_sflag = 0;
-    int nnodes = 0;
+    int i;
 
     if(gp->is_scheduled == 1 && gp->query_retransmission_count != 0) {
         /* XXX: Send group spesific query */
@@ -1618,27 +1710,23 @@ void scheduledRetransmissionQuery(void *argument) {
             return;
         }        
 
-        nnodes = gp->nsrcs;
-        list_for_each(&gp->sources, src, list) {
-            if (nnodes-- > 0) {
-                if(src && src->is_scheduled && src->query_retransmission_count !=0) {
-                    if(timer_leftTimer(src->timer) <= LMQT) {
-                        sources_without_sflag[nwithout_sflag] = src->addr.s_addr;
-                        nwithout_sflag++;
-                    } else if (timer_leftTimer(src->timer) > LMQT && !do_send_group_query) {
-                        sources_with_sflag[nwith_sflag] = src->addr.s_addr;
-                        nwith_sflag++;
-                    }
-                    
-                    src->query_retransmission_count--;
-                    if(src->query_retransmission_count == 0) {
-                        src->is_scheduled = 0; /* retransmission finished */
-                    
-                        gp->nscheduled_src--;
-                    }
+        for(i = 0; i < gp->nsrcs; i++) {
+            src = gp->srcs[i];
+            if(src->is_scheduled && src->query_retransmission_count !=0) {
+                if(timer_leftTimer(src->timer) <= LMQT) {
+                    sources_without_sflag[nwithout_sflag] = src->addr.s_addr;
+                    nwithout_sflag++;
+                } else if (timer_leftTimer(src->timer) > LMQT && !do_send_group_query) {
+                    sources_with_sflag[nwith_sflag] = src->addr.s_addr;
+                    nwith_sflag++;
+                }
+                
+                src->query_retransmission_count--;
+                if(src->query_retransmission_count == 0) {
+                    src->is_scheduled = 0; /* retransmission finished */
+                
+                    gp->nscheduled_src--;
                 }
-            } else {
-                break;
             }
         }
 
@@ -1674,7 +1762,7 @@ void sendGroupSourceSpecificMembershipQuery(void *argument, int with_sflag, uint
     struct  Config  *conf = getCommonConfig();
 
     struct IfDesc *Dp = gp->interface;
-    int nnodes = 0;
+    int i;
 
     /*
      * Only the Querier should originate Query messages
@@ -1682,20 +1770,17 @@ void sendGroupSourceSpecificMembershipQuery(void *argument, int with_sflag, uint
     if(!Dp->isQuerier)
         return;
 
-    nnodes = gp->nsrcs;
-    list_for_each(&gp->sources, src, list) {
-        if (nnodes-- > 0) {
-            /* Lower the source timer with LMQT */
-            if(src && src->is_scheduled == 1 && src->query_retransmission_count == 0) {
-                if(timer_leftTimer(src->timer) > LMQT) {
-                    timer_clearTimer(src->timer);
-                    src->timer = timer_setTimer(LMQT, sourceTimerTimeout, src);
-                }
-            
-                src->query_retransmission_count = conf->lastMemberQueryCount - 1;
+    for(i = 0; i < gp->nsrcs; i++) {
+        src = gp->srcs[i];
+
+        /* Lower the source timer with LMQT */
+        if(src->is_scheduled == 1 && src->query_retransmission_count == 0) {
+            if(timer_leftTimer(src->timer) > LMQT) {
+                timer_clearTimer(src->timer);
+                src->timer = timer_setTimer(LMQT, sourceTimerTimeout, src);
             }
-        } else {
-            break;
+        
+            src->query_retransmission_count = conf->lastMemberQueryCount - 1;
         }
     }
     
@@ -1705,8 +1790,7 @@ void sendGroupSourceSpecificMembershipQuery(void *argument, int with_sflag, uint
      */
     buildIgmpv3Query(Dp->InAdr.s_addr, gp->mcast.s_addr,
                          IGMP_MEMBERSHIP_QUERY,
-                         //conf->lastMemberQueryInterval * IGMP_TIMER_SCALE,
-                         conf->lastMemberQueryInterval,
+                         LMQI_CODE(conf),
                          gp->mcast.s_addr,
                          nsrcs,
                          sources,
@@ -1747,11 +1831,11 @@ void sendGroupSpecificMemberQuery(void *argument) {
     // Send a group specific membership query...
     sendIgmp(gvDesc->vifAddr, gvDesc->group, 
              IGMP_MEMBERSHIP_QUERY,
-             conf->lastMemberQueryInterval * IGMP_TIMER_SCALE, 
+             LMQI_CODE(conf), 
              gvDesc->group, 0);
 
-    my_log(LOG_DEBUG, 0, "Sent membership query from %s to %s. Delay: %d",
-        inetFmt(gvDesc->vifAddr,s1), inetFmt(gvDesc->group,s2),
+    my_log(LOG_DEBUG, 0, "Sent membership query from %I to %I. Delay: %d",
+        gvDesc->vifAddr, gvDesc->group,
         conf->lastMemberQueryInterval);
 
     // Set timeout for next round...
@@ -1782,8 +1866,7 @@ void sendGroupSpecificMemberQuery(void *argument) {
     /* FIXME: Ugly, need to redesign the interface */
     buildIgmpv3Query(Dp->InAdr.s_addr, gp->mcast.s_addr,
                          IGMP_MEMBERSHIP_QUERY,
-                         //conf->lastMemberQueryInterval * IGMP_TIMER_SCALE,
-                         conf->lastMemberQueryInterval,
+                         LMQI_CODE(conf),
                          gp->mcast.s_addr,
                          0,
                          NULL,
@@ -1842,13 +1925,13 @@ void sendGeneralMembershipQuery(void *arg) {
             // Install timer for next general query...
             if(conf->startupQueryCount>0) {
                 // Use quick timer...
-                Dp->queryTimer = timer_setTimer(conf->startupQueryInterval, sendGeneralMembershipQuery, Dp);
+                Dp->queryTimer = timer_setTimer(conf->startupQueryInterval * 1000, sendGeneralMembershipQuery, Dp);
                 // Decrease startup counter...
                 conf->startupQueryCount--;
             } 
             else {
                 // Use slow timer...
-                Dp->queryTimer = timer_setTimer(conf->queryInterval, sendGeneralMembershipQuery, Dp);
+                Dp->queryTimer = timer_setTimer(conf->queryInterval * 1000, sendGeneralMembershipQuery, Dp);
             }
            
            my_log(LOG_INFO, 0, "Send general query.");
@@ -1862,9 +1945,9 @@ void sendGeneralMembershipQuery(void *arg) {
 #endif
 #endif
             my_log(LOG_DEBUG, 0,
-			"Sent membership query from %s to %s. Delay: %d",
-			inetFmt(Dp->InAdr.s_addr,s1),
-			inetFmt(allhosts_group,s2),
+			"Sent membership query from %I to %I. Delay: %d",
+			Dp->InAdr.s_addr,
+			allhosts_group,
 			conf->queryResponseInterval);
             }
         }
@@ -1873,18 +1956,18 @@ void sendGeneralMembershipQuery(void *arg) {
     // TODO
 
 #if !defined(IGMPv3_PROXY)
-    timer_setTimer(conf->queryResponseInterval, ageActiveRoutes, NULL);
+    timer_setTimer(conf->queryResponseInterval * 1000, ageActiveRoutes, NULL);
 
     // Install timer for next general query...
     if(conf->startupQueryCount>0) {
         // Use quick timer...
-        timer_setTimer(conf->startupQueryInterval, sendGeneralMembershipQuery, NULL);
+        timer_setTimer(conf->startupQueryInterval * 1000, sendGeneralMembershipQuery, NULL);
         // Decrease startup counter...
         conf->startupQueryCount--;
     } 
     else {
         // Use slow timer...
-        timer_setTimer(conf->queryInterval, sendGeneralMembershipQuery, NULL);
+        timer_setTimer(conf->queryInterval * 1000, sendGeneralMembershipQuery, NULL);
     }
 #endif
 }
@@ -1902,7 +1985,7 @@ void otherQuerierTimerTimeout(void *arg) {
     Dp->otherQuerierPresentTimer = INVAILD_TIMER;
     Dp->isQuerier = true;
 
-    Dp->queryTimer = timer_setTimer(conf->queryInterval, sendGeneralMembershipQuery, Dp);    
+    Dp->queryTimer = timer_setTimer(conf->queryInterval * 1000, sendGeneralMembershipQuery, Dp);    
 }
 
 /**
@@ -1932,10 +2015,8 @@ void groupTimerTimeout(void *arg)
     assert(arg != NULL);
 
     struct group *gp = (struct group *)arg;
-    struct source *src = NULL;
-    struct source *nxt = NULL;
     uint32_t groupAddr = gp->mcast.s_addr;
-    int nnodes = 0;
+    int i, n;
 
     /* When mode is INCLUDE, do nothing */
     if(gp->fmode == IGMP_V3_FMODE_INCLUDE)
@@ -1944,20 +2025,20 @@ void groupTimerTimeout(void *arg)
     if(gp->fmode == IGMP_V3_FMODE_EXCLUDE) {
         
         /* Clear the unactive sources */
-        nnodes = gp->nsrcs;
-        list_for_each_safe(&gp->sources, src, nxt, list) {
-            if (nnodes-- > 0) {
-                if(src && src->fstate == 0) {
-                    sourceDestory(src);
-                }
+        for(i = 0, n = 0; i < gp->nsrcs; i++) {
+            if(gp->srcs[i]->fstate == 0) {
+                sourceFree(gp->srcs[i]);
             } else {
-               break;
+                gp->srcaddrs[n] = gp->srcaddrs[i];
+                gp->srcs[n++] = gp->srcs[i];
             }
         }
+        gp->nsrcs = n;
 
-        if(list_empty(&gp->sources)) {
+        if(gp->nsrcs == 0) {
             my_log(LOG_INFO, 0, "EXCLUDE source is NUL %s", __FUNCTION__);
             groupDestory(gp);
+            gp = NULL;
         } else {
             gp->fmode = IGMP_V3_FMODE_INCLUDE; /* Change the group mode */
         }
@@ -1965,7 +2046,10 @@ void groupTimerTimeout(void *arg)
     
     /* TODD: Update membership/routing table info */
     my_log(LOG_INFO, 0, "Update database in %s", __FUNCTION__);
-    memberDatabaseUpdate(groupAddr);
+    if(gp != NULL)
+        memberGroupUpdate(gp);
+    else
+        memberDatabaseUpdate(groupAddr);
 }
 
 /**
@@ -1982,13 +2066,12 @@ void sourceTimerTimeout(void *arg)
     if(gp->fmode == IGMP_V3_FMODE_INCLUDE) {
         sourceDestory(src);
 
-        if(list_empty(&gp->sources)) {
+        if(gp->nsrcs == 0) {
             my_log(LOG_INFO, 0, "INCLUDE source is NUL %s", __FUNCTION__);
             groupDestory(gp);
+            gp = NULL;
         }
-    }
-
-    if(gp->fmode == IGMP_V3_FMODE_EXCLUDE) {
+    } else if(gp->fmode == IGMP_V3_FMODE_EXCLUDE) {
         /* Move the source to unactive state */
         src->fstate = 0;
         timer_clearTimer(src->timer);
@@ -1997,7 +2080,10 @@ void sourceTimerTimeout(void *arg)
 
     /* TODD: Update membership/routing table info */
     my_log(LOG_INFO, 0, "Update database in %s", __FUNCTION__);
-    memberDatabaseUpdate(groupAddr);
+    if(gp != NULL)
+        memberGroupUpdate(gp);
+    else
+        memberDatabaseUpdate(groupAddr);
 }
 
 /**
@@ -2006,90 +2092,39 @@ void sourceTimerTimeout(void *arg)
 void memberDatabaseInit(void)
 {
     list_head_init(&member_database.members);
+    list_head_init(&member_database.dirty);
+    addrHashInit(&member_database.hash);
     member_database.nmems = 0;
-}
-
-/**
- * Look up the source in the member, if don't find it, return NULL  
- */
-struct source_in_member *memberSourceLookup(struct member *mb, uint32_t srcAddr)
-{
-    assert(mb != NULL);
-    struct source_in_member *src_in_mb = NULL;
-    
-    int nnodes = 0;
-    int flag = 0;
-
-    nnodes = mb->nsrcs;
-    list_for_each(&mb->sources, src_in_mb, list) {
-        if (nnodes-- > 0) {
-            if (src_in_mb && src_in_mb->addr.s_addr == srcAddr) {
-                flag = 1;
-                break;
-            }
-        } else {
-            break;
-        }
-    }
 
-    if (flag)
-        return src_in_mb;
-    else
-        return NULL;    
+    poolInit(POOL_GROUP, sizeof(struct group));
+    poolInit(POOL_SOURCE, sizeof(struct source));
+    poolInit(POOL_MEMBER, sizeof(struct member));
 }
 
-/**
- * Add source to member, if fail, return NULL
+/*
+ * Scratch array the merge writes the new member source list to. It's
+ * swapped with the array of the member afterwards, so no copy is made.
  */
-struct source_in_member *memberSourceAdd(struct member *mb, uint32_t srcAddr)
-{
-    assert(mb != NULL);
-    struct source_in_member *src_in_mb = NULL;
-
-    src_in_mb = memberSourceLookup(mb, srcAddr);
-    if (src_in_mb == NULL) {
-    
-        src_in_mb = malloc(sizeof(struct source_in_member));
-        if(!src_in_mb) {
-            my_log(LOG_ERR, 0, "create source in the member fail");
-            return NULL; /* XXX: Maybe we need free some thing ? */
-        }
-
-        src_in_mb->addr.s_addr = srcAddr;
-
-        list_add(&mb->sources, &src_in_mb->list);
-        mb->nsrcs++;
-    }
+static uint32_t *memberScratch = NULL;
+static int memberScratchSize = 0;
 
-    return src_in_mb;
-}
-
-void memberSourceDel(struct member *mb, uint32_t srcAddr)
+static int memberScratchReserve(int nsrcs)
 {
-    assert(mb != NULL);
-    if(!mb)
-        return;
+    uint32_t *tmp;
+    int size;
 
-    int nnodes = 0;
+    if(nsrcs <= memberScratchSize)
+        return 1;
 
-    struct source_in_member *src_in_mb = NULL;
-    struct source_in_member *nxt = NULL;
-    
-    nnodes = mb->nsrcs;
-    list_for_each_safe(&mb->sources, src_in_mb, nxt, list) {
-        if (nnodes-- > 0) { 
-            if(src_in_mb && src_in_mb->addr.s_addr == srcAddr) {
-                list_del(&src_in_mb->list);
-                mb->nsrcs--;
-
-                free(src_in_mb);
-                
-                break;
-            }
-        } else {
-            break;
-        }
-    }
+    for(size = memberScratchSize ? memberScratchSize : 16; size < nsrcs; size *= 2)
+        ;
+    tmp = realloc(memberScratch, size * sizeof(uint32_t));
+    if(tmp == NULL)
+        return 0;
+
+    memberScratch = tmp;
+    memberScratchSize = size;
+    return 1;
 }
 
 /**
@@ -2099,14 +2134,14 @@ struct member *memberCreate(uint32_t mcastAddr)
 {
     // Sanitycheck the group adress...
     if( ! IN_MULTICAST( ntohl(mcastAddr) )) {
-        my_log(LOG_WARNING, 0, "The group address %s is not a valid Multicast group. member create failed.",
-            inetFmt(mcastAddr, s1));
+        my_log(LOG_WARNING, 0, "The group address %I is not a valid Multicast group. member create failed.",
+            mcastAddr);
         return 0;
     }
 
     //struct source *src = NULL;
     struct member *mb = NULL;
-    mb = malloc(sizeof(struct member));
+    mb = poolAlloc(POOL_MEMBER);
     if(!mb) {
         my_log(LOG_ERR, 0, "create member fail");
         return NULL;
@@ -2115,305 +2150,363 @@ struct member *memberCreate(uint32_t mcastAddr)
     mb->mcast.s_addr = mcastAddr;
     mb->fmode        = IGMP_V3_FMODE_INCLUDE; /* XXX: Default INCLUDE{NUL} */
 
-    list_head_init(&mb->sources);
+    mb->srcaddrs     = NULL;
     mb->nsrcs        = 0;
+    mb->srcsize      = 0;
+    mb->aggr         = NULL;
+    mb->naggr        = 0;
+    mb->aggrsize     = 0;
+    mb->nifs         = 0;
+    mb->nexcl        = 0;
+    mb->vif          = -1;
+    mb->changed      = 0;
 
-/*
-    list_for_each(&gp->sources, src, list) {
-        if(gp->fmode == IGMP_V3_FMODE_INCLUDE) {
-            memberSourceAdd(mb, src->addr_s_addr);
-        } else if(gp->fmode == IGMP_V3_FMODE_EXCLUDE && src->fmode == 0) {
-            memberSourceAdd(mb, src->addr_s_addr);
-        }
-    }
-*/
     return mb;
 }
 
-void memberAdd(struct member *mb)
+int memberAdd(struct member *mb)
 {
     assert(mb != NULL);
     
+    if(!addrHashInsert(&member_database.hash, mb->mcast.s_addr, mb))
+        return 0;
+
     list_add(&member_database.members, &mb->list);
     member_database.nmems++;
+    return 1;
 }
 
 void memberDestory(struct member *mb)
 {
     assert(mb != NULL);
-    struct source_in_member *src_in_mb = NULL;
-    struct source_in_member *nxt = NULL;
-    int nnodes = 0;
 
     list_del(&mb->list);
+    if(mb->changed)
+        list_del(&mb->dirty);
+    addrHashRemove(&member_database.hash, mb->mcast.s_addr);
     member_database.nmems--;
 
-    nnodes = mb->nsrcs;
-    list_for_each_safe(&mb->sources, src_in_mb, nxt, list) {
-        if(nnodes-- > 0) {
-            if(src_in_mb) {
-                memberSourceDel(mb, src_in_mb->addr.s_addr);
-            }
-        } else {
-            break;
-        }
+    free(mb->srcaddrs);
+    free(mb->aggr);
+    poolFree(POOL_MEMBER, mb);
+}
+
+struct member *memberLookup(uint32_t mcastAddr)
+{
+    return addrHashLookup(&member_database.hash, mcastAddr);
+}
+
+/*
+ * Queue the member for the next memberDatabaseFlush().
+ */
+static void memberSchedule(struct member *mb)
+{
+    if(mb->changed)
+        return;
+
+    mb->changed = 1;
+    list_add_tail(&member_database.dirty, &mb->dirty);
+}
+
+/*
+ * Find the aggregate record of a source in the member. If it's not
+ * present and create is set, a record with zero counts is inserted.
+ */
+static struct member_source *memberSourceGet(struct member *mb, uint32_t srcAddr, int create)
+{
+    struct member_source *tmp;
+    int lo = 0, hi = mb->naggr - 1;
+
+    while(lo <= hi) {
+        int mid = (lo + hi) / 2;
+
+        if(mb->aggr[mid].addr < srcAddr)
+            lo = mid + 1;
+        else if(mb->aggr[mid].addr > srcAddr)
+            hi = mid - 1;
+        else
+            return &mb->aggr[mid];
+    }
+
+    if(!create)
+        return NULL;
+
+    if(mb->naggr == mb->aggrsize) {
+        int size = mb->aggrsize ? mb->aggrsize * 2 : 8;
+
+        tmp = realloc(mb->aggr, size * sizeof(*tmp));
+        if(tmp == NULL)
+            return NULL;
+        mb->aggr = tmp;
+        mb->aggrsize = size;
     }
 
-    free(mb);
+    memmove(&mb->aggr[lo + 1], &mb->aggr[lo], (mb->naggr - lo) * sizeof(*mb->aggr));
+    mb->aggr[lo].addr = srcAddr;
+    mb->aggr[lo].ninc = 0;
+    mb->aggr[lo].nexc = 0;
+    mb->naggr++;
+
+    return &mb->aggr[lo];
 }
 
-/**
- * Merge the group information to member.
- */ 
-void memberDatabaseMerge(struct member *mb, struct group *gp)
+/*
+ * Count an interface including (or excluding) a source in or out.
+ */
+static void memberSourceCount(struct member *mb, uint32_t srcAddr, int fmode, int delta)
 {
-    assert(mb != NULL);
-    assert(gp != NULL);
+    struct member_source *ms = memberSourceGet(mb, srcAddr, delta > 0);
 
-    memberDatabaseLog();
+    if(ms == NULL) {
+        my_log(LOG_WARNING, 0, "Can't count source %I in group %I.",
+            srcAddr, mb->mcast.s_addr);
+        return;
+    }
 
-    struct source *src = NULL;
-    struct source_in_member *src_in_mb = NULL;
-    struct source_in_member *nxt = NULL;
-    int nnodes = 0;
-    int nnodes_2nd = 0;
-    int flag = 0;
+    if(fmode == IGMP_V3_FMODE_EXCLUDE)
+        ms->nexc += delta;
+    else
+        ms->ninc += delta;
+}
 
-    /* 
-     * merge the member state from all interface
-     *    RFC 3376 $3.2 
-     *    RFC 4605 $4.1
-     */ 
+/*
+ * Apply the change of a source list from {old} to {new}, both sorted
+ * and for the same filter mode, to the counters of the member. Only
+ * the sources in one of the lists are touched.
+ */
+static void memberSourceDiff(struct member *mb, int fmode, int nold, uint32_t *old, int nnew, uint32_t *new)
+{
+    int i = 0, j = 0;
 
-    /*
-     * Database{mb}  Group{gp}     Action(mb) 
-     * INCLUDE {A}   INCLUDE {B}   INCLUDE{A + B}
-     */
-    if(gp->fmode == IGMP_V3_FMODE_INCLUDE && mb->fmode == IGMP_V3_FMODE_INCLUDE) {
-        nnodes = gp->nsrcs;
-        list_for_each(&gp->sources, src, list) {
-            if (nnodes-- > 0) {
-                nnodes_2nd = mb->nsrcs;
-                flag = 0;
-                list_for_each(&mb->sources, src_in_mb, list) {
-                    if (nnodes_2nd-- > 0) {
-                        if(src_in_mb && src->addr.s_addr == src_in_mb->addr.s_addr) {
-                            flag = 1;
-                            break;
-                        }
-                    } else {
-                        flag = 0;
-                        break;
-                    }
-                }
-                
-                /* Add the new source to member */
-                if (!flag)
-                    memberSourceAdd(mb, src->addr.s_addr);
-            } else {
-                break;
-            }
+    while(i < nold || j < nnew) {
+        if(j >= nnew || (i < nold && old[i] < new[j])) {
+            memberSourceCount(mb, old[i++], fmode, -1);
+        } else if(i >= nold || new[j] < old[i]) {
+            memberSourceCount(mb, new[j++], fmode, 1);
+        } else {
+            i++;
+            j++;
         }
     }
+}
 
-    /*
-     * Database{mb}  Group{gp}     Action(mb) 
-     * INCLUDE {A}   EXCLUDE {B}   EXCLUDE{B - A}
-     */
-    if(gp->fmode == IGMP_V3_FMODE_EXCLUDE && mb->fmode == IGMP_V3_FMODE_INCLUDE) {
-        mb->fmode = IGMP_V3_FMODE_EXCLUDE; /* Change mode, from INCLUDE -> EXCLUDE */
-        nnodes = gp->nsrcs;
-        list_for_each(&gp->sources, src, list) {
-            if ((nnodes-- > 0) && src && src->fstate == 0) {
-                nnodes_2nd = mb->nsrcs;
-                flag = 0;
-                list_for_each_safe(&mb->sources, src_in_mb, nxt, list) {
-                    if (nnodes_2nd-- > 0) {
-                        if(src_in_mb && src->addr.s_addr == src_in_mb->addr.s_addr) {
-                            memberSourceDel(mb, src_in_mb->addr.s_addr);
-                            flag = 1;
-                            break;
-                        }
-                    } else {
-                        break;
-                    }
-                }
-                      
-                /* Add the new source to member */
-                if (!flag)
-                    memberSourceAdd(mb, src->addr.s_addr);
-            } else {
-                break;
-            }
-        }
+/*
+ * Drop the aggregate records no interface refers to anymore.
+ */
+static void memberSourcePrune(struct member *mb)
+{
+    int i, n;
+
+    for(i = 0, n = 0; i < mb->naggr; i++) {
+        if(mb->aggr[i].ninc || mb->aggr[i].nexc)
+            mb->aggr[n++] = mb->aggr[i];
     }
+    mb->naggr = n;
+}
 
-    /*
-     * Database{mb}  Group{gp}     Action(mb) 
-     * EXCLUDE {A}   INCLUDE {B}   EXCLUDE{A - B}
-     */
-    if(gp->fmode == IGMP_V3_FMODE_INCLUDE && mb->fmode == IGMP_V3_FMODE_EXCLUDE) {
-        nnodes = gp->nsrcs;
-        list_for_each(&gp->sources, src, list) {
-            if(nnodes-- > 0) {
-                nnodes_2nd = mb->nsrcs;
-                list_for_each_safe(&mb->sources, src_in_mb, nxt, list) {
-                    if (nnodes_2nd-- > 0) {
-                        if(src_in_mb && src->addr.s_addr == src_in_mb->addr.s_addr) {
-                            memberSourceDel(mb, src_in_mb->addr.s_addr);
-                            break;
-                        }
-                    } else {
-                        break;
-                    }
-                }
-            } else {
-                break;
-            }
-        }
+/*
+ * Build the upstream filter of the member from the counters, RFC 3376 $3.2
+ * and RFC 4605 $4.1: if any interface is in EXCLUDE mode the filter is
+ * EXCLUDE with the sources excluded by all of them and included by none,
+ * otherwise it's INCLUDE with the sources included by any interface.
+ */
+static int memberFilterBuild(struct member *mb)
+{
+    int i, n = 0;
+
+    if(mb->srcsize < mb->naggr) {
+        uint32_t *tmp = realloc(mb->srcaddrs, mb->naggr * sizeof(uint32_t));
+        if(tmp == NULL)
+            return 0;
+        mb->srcaddrs = tmp;
+        mb->srcsize = mb->naggr;
     }
 
-    /*
-     * Database{mb}  Group{gp}     Action(mb) 
-     * EXCLUDE {A}   EXCLUDE {B}   EXCLUDE{A * B}
-     */
-    if(gp->fmode == IGMP_V3_FMODE_EXCLUDE && mb->fmode == IGMP_V3_FMODE_EXCLUDE) {
-        nnodes = mb->nsrcs;
-        list_for_each_safe(&mb->sources, src_in_mb, nxt, list) {
-            if (nnodes-- > 0) {
-                nnodes_2nd = gp->nsrcs;
-                flag = 0;
-                list_for_each(&gp->sources, src, list) {
-                    if (nnodes_2nd-- > 0) {
-                        if(src && src->addr.s_addr == src_in_mb->addr.s_addr) {
-                            flag = 1;
-                            break;
-                        }
-                    } else {
-                        break;
-                    }
-                }
-              
-                if(!flag)
-                    memberSourceDel(mb, src_in_mb->addr.s_addr);
-            } else {
-                break;
-            }
+    if(mb->nexcl > 0) {
+        mb->fmode = IGMP_V3_FMODE_EXCLUDE;
+        for(i = 0; i < mb->naggr; i++) {
+            if(mb->aggr[i].nexc == mb->nexcl && mb->aggr[i].ninc == 0)
+                mb->srcaddrs[n++] = mb->aggr[i].addr;
+        }
+    } else {
+        mb->fmode = IGMP_V3_FMODE_INCLUDE;
+        for(i = 0; i < mb->naggr; i++) {
+            if(mb->aggr[i].ninc > 0)
+                mb->srcaddrs[n++] = mb->aggr[i].addr;
         }
     }
-
-    memberDatabaseLog();
+    mb->nsrcs = n;
+    return 1;
 }
 
-struct member *memberLookup(uint32_t mcastAddr)
+/**
+ * The state of a group changed, account the change in the member
+ * database and schedule the upstream update.
+ *
+ * Each group remembers the source list it added to the member counters
+ * last time: all sources in INCLUDE mode, the excluded ones (Y) in
+ * EXCLUDE mode. Only the difference to that list is applied, so the
+ * cost doesn't depend on the other interfaces joined to the group.
+ */
+void memberGroupUpdate(struct group *gp)
 {
-    struct member *mb = NULL;
-    int flag = 0;
+    assert(gp != NULL);
 
-    // Sanitycheck the group adress...
-    if( ! IN_MULTICAST( ntohl(mcastAddr) )) {
-        my_log(LOG_WARNING, 0, "The group address %s is not a valid Multicast group. member look up failed.",
-            inetFmt(mcastAddr, s1));
-        return NULL;
+    struct member *mb;
+    uint32_t *tmp;
+    int i, n = 0, size;
+
+    if(!memberScratchReserve(gp->nsrcs)) {
+        my_log(LOG_WARNING, 0, "Can't update group %I, out of memory.",
+            gp->mcast.s_addr);
+        return;
     }
 
-    if(!member_database.nmems)
-        return NULL;
+    /* The source list the group contributes now */
+    for(i = 0; i < gp->nsrcs; i++) {
+        if(gp->fmode == IGMP_V3_FMODE_INCLUDE || gp->srcs[i]->fstate == 0)
+            memberScratch[n++] = gp->srcaddrs[i];
+    }
 
-    int nnodes = member_database.nmems;
+    mb = memberLookup(gp->mcast.s_addr);
+    if(mb == NULL) {
+        mb = memberCreate(gp->mcast.s_addr);
+        if(mb == NULL)
+            return;
+        if(!memberAdd(mb)) {
+            poolFree(POOL_MEMBER, mb);
+            return;
+        }
+    }
 
-    list_for_each(&member_database.members, mb, list) {
-        if (nnodes-- > 0) {
-            if(mb && mb->mcast.s_addr == mcastAddr) {
-                flag = 1;
-                break;
-            }
+    if(gp->contributing && gp->contrib_fmode == gp->fmode) {
+        memberSourceDiff(mb, gp->fmode, gp->ncontrib, gp->contrib, n, memberScratch);
+    } else {
+        if(gp->contributing) {
+            /* Filter mode change, take back the whole old list */
+            for(i = 0; i < gp->ncontrib; i++)
+                memberSourceCount(mb, gp->contrib[i], gp->contrib_fmode, -1);
+            if(gp->contrib_fmode == IGMP_V3_FMODE_EXCLUDE)
+                mb->nexcl--;
         } else {
-            flag = 0;
-            break;
+            mb->nifs++;
         }
-    }
 
-    if (flag)
-        return mb;
-    else
-        return NULL;
+        for(i = 0; i < n; i++)
+            memberSourceCount(mb, memberScratch[i], gp->fmode, 1);
+        if(gp->fmode == IGMP_V3_FMODE_EXCLUDE)
+            mb->nexcl++;
+    }
+    memberSourcePrune(mb);
+
+    /* The new list is the contribution of the group from now on */
+    tmp = gp->contrib;
+    size = gp->contribsize;
+    gp->contrib = memberScratch;
+    gp->contribsize = memberScratchSize;
+    gp->ncontrib = n;
+    memberScratch = tmp;
+    memberScratchSize = size;
+
+    gp->contrib_fmode = gp->fmode;
+    gp->contributing = 1;
+
+    mb->vif = gp->interface->index;
+    memberSchedule(mb);
 }
 
 /**
- * Update members database
+ * Take the contribution of a group which is going away out of the
+ * member database.
  */
-void memberDatabaseUpdate(uint32_t mcastAddr)
+static void memberGroupRetract(struct group *gp)
 {
-    // Sanitycheck the group adress...
-    if( ! IN_MULTICAST( ntohl(mcastAddr) )) {
-        my_log(LOG_WARNING, 0, "The group address %s is not a valid Multicast group. member database update failed.",
-            inetFmt(mcastAddr, s1));
+    struct member *mb;
+    int i;
+
+    if(!gp->contributing)
         return;
-    } else {
-        my_log(LOG_WARNING, 0, "Update group %s to database", inetFmt(mcastAddr, s1));
+
+    mb = memberLookup(gp->mcast.s_addr);
+    if(mb != NULL) {
+        for(i = 0; i < gp->ncontrib; i++)
+            memberSourceCount(mb, gp->contrib[i], gp->contrib_fmode, -1);
+        if(gp->contrib_fmode == IGMP_V3_FMODE_EXCLUDE)
+            mb->nexcl--;
+        mb->nifs--;
+        memberSourcePrune(mb);
+        memberSchedule(mb);
     }
 
-    struct member *mb = NULL;
-    uint32_t       group = mcastAddr;
-    struct group *merge_gp = NULL;
-    struct IfDesc *upstrIf = NULL;
-    uint32_t insertRouteFlag = 0;
-    int flag = 0;
-    
-    // Get the upstream VIF...
-    upstrIf = getIfByIx( upStreamVif );
+    free(gp->contrib);
+    gp->contrib = NULL;
+    gp->ncontrib = 0;
+    gp->contribsize = 0;
+    gp->contributing = 0;
+}
 
-    mb = memberLookup(group);
-    if(!mb) {
-        mb = memberCreate(group);
-        if (mb)
-            memberAdd(mb);
+/**
+ * Schedule the upstream update of a group.
+ */
+void memberDatabaseUpdate(uint32_t mcastAddr)
+{
+    struct member *mb = memberLookup(mcastAddr);
 
-        /* XXX:
-         *     1). join the group in the upstream ?
-         *     2). add new pending routing entry 
-         */
-        insertRouteFlag = 1;
-    } 
+    if(mb != NULL)
+        memberSchedule(mb);
+}
 
-    /* Loop through all interface about this group and merge it to database */
-    {
-        unsigned Ix;
-        struct IfDesc *Dp;
-
-        for ( Ix = 0; (Dp = getIfByIx(Ix)); Ix++ ) {
-            if ( Dp->InAdr.s_addr && ! (Dp->Flags & IFF_LOOPBACK) && (Dp->state == IF_STATE_DOWNSTREAM) ) {
-                merge_gp = interfaceGroupLookup(Dp, group);
-                if(merge_gp) {
-                    memberDatabaseMerge(mb, merge_gp);
-                    flag = 1; /* Find this group in one interface */
-                    
-                    /* Insert routing entry, can't to decide the VIF until get Upcall message */
-                    if((insertRouteFlag && findRoute(group) == NULL)) {
-                        insertRoute(group, Dp->index); /* XXX: Create the route entry and send join message in upstream */
-                        //insertRouteFlag = 0;
-                    } 
-                }    
-            }
-        }
+/**
+ * Update the upstream filter and the routing of a group from the
+ * member database.
+ */
+static void memberUpstreamUpdate(struct member *mb)
+{
+    uint32_t mcastAddr = mb->mcast.s_addr;
+
+    /* XXX: When no interface join this group, delete it */
+    if(mb->nifs == 0) {
+        deleteRoute(mcastAddr); /* Send Leave message and prune the routing */
+        memberDestory(mb);
+        return;
     }
 
-    //updateRoute(group);
+    if(!memberFilterBuild(mb)) {
+        my_log(LOG_WARNING, 0, "Can't build the filter of group %I, out of memory.",
+            mcastAddr);
+        return;
+    }
 
-    assert(mb != NULL);
+    /* XXX: When group is INCLUDE{NUL}, nothing to forward */
+    if(mb->fmode == IGMP_V3_FMODE_INCLUDE && !mb->nsrcs) {
+        deleteRoute(mcastAddr); /* Send Leave message and prune the routing */
+        return;
+    }
 
-    /* XXX: When group is INCLUDE{NUL} or no interface join this group, delete it */
-    if((mb->fmode == IGMP_V3_FMODE_INCLUDE && !mb->nsrcs) || flag == 0) {
-        deleteRoute(group); /* Send Leave message and prune the routing */
+    /* Insert routing entry, can't to decide the VIF until get Upcall message */
+    if(findRoute(mcastAddr) == NULL)
+        insertRoute(mcastAddr, mb->vif); /* XXX: Create the route entry and send join message in upstream */
 
-        memberDestory(mb);
-    } else {
-        /* XXX: Set source filtering in the upstream interface */
-        setSourceFilter(getMcGroupSock(), mb);
- 
-        updateRoute(group);
-    }   
+    /* XXX: Set source filtering in the upstream interface */
+    setSourceFilter(getMcGroupSock(), mb);
+
+    updateRoute(mcastAddr);
+}
+
+/**
+ * Push the changed groups to the upstream. Called once per loop of
+ * the daemon, so that a group touched by many records or reports in
+ * the meantime gets one filter and one route update.
+ */
+void memberDatabaseFlush(void)
+{
+    struct member *mb, *next;
+
+    list_for_each_safe(&member_database.dirty, mb, next, dirty) {
+        list_del(&mb->dirty);
+        mb->changed = 0;
+        memberUpstreamUpdate(mb);
+    }
 }
 
 /**
@@ -2442,22 +2535,19 @@ void queryEntryAdd(struct *gp)
 void memberDatabaseLog()
 {
     int nnodes = member_database.nmems;
-    int nnodes_2nd = 0;
     
     struct member *mb = NULL;
-    struct source_in_member *src_in_mb = NULL;
+    int i;
+
+    if (!LOG_ENABLED(LOG_INFO))
+        return;
 
     my_log(LOG_INFO, 0, "\n-Member database--------------------------------------");       
     list_for_each(&member_database.members, mb, list) {
         if (nnodes-- > 0) {
-            my_log(LOG_INFO, 0, "Group %s\tFilter Mode %s\tNum of Src %d",  inetFmt(mb->mcast.s_addr, s1), (mb->fmode ? "INCLUDE" : "EXCLUDE"), mb->nsrcs);
-            nnodes_2nd = mb->nsrcs;
-            list_for_each (&mb->sources, src_in_mb, list) {
-                if (nnodes_2nd-- > 0) {
-                    my_log(LOG_INFO, 0, "\t\t\t\t\t Source %s", inetFmt(src_in_mb->addr.s_addr, s1));
-                } else {
-                    break;
-                }
+            my_log(LOG_INFO, 0, "Group %I\tFilter Mode %s\tNum of Src %d",  mb->mcast.s_addr, (mb->fmode ? "INCLUDE" : "EXCLUDE"), mb->nsrcs);
+            for (i = 0; i < mb->nsrcs; i++) {
+                my_log(LOG_INFO, 0, "\t\t\t\t\t Source %I", mb->srcaddrs[i]);
             }
         } else {
             break;
@@ -2471,6 +2561,9 @@ void interfaceGroupLog(struct IfDesc *sourceVif)
     struct group *gp = NULL;
     int flag = 0;
 
+    if (!LOG_ENABLED(LOG_INFO))
+        return;
+
     my_log(LOG_INFO, 0, "++++++++ Interface info %s.", __FUNCTION__); 
 
     assert(sourceVif != NULL);
@@ -2478,8 +2571,8 @@ void interfaceGroupLog(struct IfDesc *sourceVif)
     int nnodes = sourceVif->ngps;
     list_for_each(&sourceVif->groups, gp, list) {
         if (nnodes-- > 0) {
-            my_log(LOG_INFO, 0, "group address %s, index %d", 
-                inetFmt(gp->mcast.s_addr, s2), sourceVif->ngps - nnodes);
+            my_log(LOG_INFO, 0, "group address %I, index %d", 
+                gp->mcast.s_addr, sourceVif->ngps - nnodes);
         } else {
             break;
         }
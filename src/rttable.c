@@ -37,29 +37,48 @@
 *     recieved request.
 */
 
-#ifndef MC4_CHANGES
-#define MC4_CHANGES 1
-#endif
-
 #include "defs.h"
 #include "igmpproxy.h"
-#if MC4_CHANGES
-#include <linux/if_vlan.h>
-#include <sys/socket.h>
-#include <linux/sockios.h>
-#include <sys/types.h>
-#include <sys/ioctl.h>
-#include <string.h>
-#endif
+
+#include <time.h>
+
+// Kernel route counters, read in one pass when polled.
+#define MFC_CACHE_FILE  "/proc/net/ip_mr_cache"
     
 /**
-*   Routing table structure definition. Double linked list...
+*   Activated source of a route. Every sender of the group seen upstream
+*   gets its own kernel MFC entry, installed even without listeners so
+*   the kernel drops its traffic instead of repeating the upcall.
+*/
+struct RouteSource {
+    struct RouteSource  *next;          // Next source of the same route.
+    struct RouteTable   *route;         // The route the source belongs to.
+    uint32_t              originAddr;     // The source address.
+    uint32_t              vifBits;        // VIFs the source is forwarded to.
+    uint32_t              installedBits;  // VIFs of the entry in the kernel.
+    short               installed;      // Set while the entry is in the kernel.
+    unsigned            upcalls;        // Kernel upcalls seen for the (S,G).
+
+    // Kernel counters of the entry, when they are polled.
+    uint64_t            pkts;
+    uint64_t            bytes;
+    uint32_t            pktRate;        // Packets per second at the last poll.
+    uint32_t            byteRate;       // Bytes per second at the last poll.
+    long long           polledAt;       // Time of the last poll in ms, 0 if never.
+    long long           lastActive;     // Time in ms the counters last grew.
+};
+
+/**
+*   Routing table structure definition. The routes are kept in a double
+*   linked list in insertion order for walking the table, and indexed
+*   by group in a hash table. Their sources are indexed by (origin, group).
 */
 struct RouteTable {
     struct RouteTable   *nextroute;     // Pointer to the next group in line.
     struct RouteTable   *prevroute;     // Pointer to the previous group in line.
     uint32_t              group;          // The group to route
-    uint32_t              originAddr;     // The origin adress (only set on activated routes)
+    struct RouteSource  *sources;       // The activated sources of the group.
+    unsigned            nsources;       // Number of activated sources.
     uint32_t              vifBits;        // Bits representing recieving VIFs.
 
     // Keeps the upstream membership state...
@@ -74,15 +93,25 @@ struct RouteTable {
                  
 // Keeper for the routing table...
 static struct RouteTable   *routing_table;
+static struct RouteTable   *routing_table_tail;
+
+// Routes by group, and route sources by (origin, group)...
+static struct addr_hash     routeHash;
+static struct addr_hash     activeHash;
+
+// Timer of the next poll of the kernel counters...
+static int                  pollTimer = INVAILD_TIMER;
+static unsigned long        reapedSources;
 
 // Prototypes
 void logRouteTable(char *header);
 int  internAgeRoute(struct RouteTable*  croute);
+int  removeRoute(struct RouteTable*  croute);
 int internUpdateKernelRoute(struct RouteTable *route, int activate);
+static int internUpdateKernelSource(struct RouteTable *route, struct RouteSource *rs, int activate);
+static void routeSourcesFree(struct RouteTable *croute);
+static void pollRouteCounters(void *data);
 
-#if MC4_CHANGES
-int IsIfVlan(char * ifName);
-#endif
 // Socket for sending join or leave requests.
 int mcGroupSock = 0;
 
@@ -106,20 +135,24 @@ void initRouteTable(void) {
 
     // Clear routing table...
     routing_table = NULL;
+    routing_table_tail = NULL;
+    addrHashInit(&routeHash);
+    addrHashInit(&activeHash);
+    poolInit(POOL_ROUTESRC, sizeof(struct RouteSource));
 
     // Join the all routers group on downstream vifs...
     for ( Ix = 0; (Dp = getIfByIx(Ix)); Ix++ ) {
         // If this is a downstream vif, we should join the All routers group...
         if( Dp->InAdr.s_addr && ! (Dp->Flags & IFF_LOOPBACK) && Dp->state == IF_STATE_DOWNSTREAM) {
-            my_log(LOG_DEBUG, 0, "Joining all-routers group %s on vif %s",
-                         inetFmt(allrouters_group,s1),inetFmt(Dp->InAdr.s_addr,s2));
+            my_log(LOG_DEBUG, 0, "Joining all-routers group %I on vif %I",
+                         allrouters_group,Dp->InAdr.s_addr);
             
             //k_join(allrouters_group, Dp->InAdr.s_addr);
             joinMcGroup( getMcGroupSock(), Dp, allrouters_group );
 
 #if defined(IGMPv3_PROXY)
-            my_log(LOG_DEBUG, 0, "Joining all-v3routers group %s on vif %s",
-                         inetFmt(allv3routers_group,s1),inetFmt(Dp->InAdr.s_addr,s2));
+            my_log(LOG_DEBUG, 0, "Joining all-v3routers group %I on vif %I",
+                         allv3routers_group,Dp->InAdr.s_addr);
             
             joinMcGroup( getMcGroupSock(), Dp, allv3routers_group );
 #endif
@@ -152,7 +185,7 @@ void sendJoinLeaveUpstream(struct RouteTable* route, int join) {
                 break;
 
         if (sn == NULL) {
-	    my_log(LOG_INFO, 0, "The group address %s may not be forwarded upstream. Ignoring.", inetFmt(group, s1));
+	    my_log(LOG_INFO, 0, "The group address %I may not be forwarded upstream. Ignoring.", group);
             return;
         }
     }
@@ -162,25 +195,25 @@ void sendJoinLeaveUpstream(struct RouteTable* route, int join) {
 
         // Only join a group if there are listeners downstream...
         if(route->vifBits > 0) {
-            my_log(LOG_DEBUG, 0, "Joining group %s upstream on IF address %s",
-                         inetFmt(route->group, s1), 
-                         inetFmt(upstrIf->InAdr.s_addr, s2));
+            my_log(LOG_DEBUG, 0, "Joining group %I upstream on IF address %I",
+                         route->group, 
+                         upstrIf->InAdr.s_addr);
 
             //k_join(route->group, upstrIf->InAdr.s_addr);
             joinMcGroup( getMcGroupSock(), upstrIf, route->group );
 
             route->upstrState = ROUTESTATE_JOINED;
         } else {
-            my_log(LOG_DEBUG, 0, "No downstream listeners for group %s. No join sent.",
-                inetFmt(route->group, s1));
+            my_log(LOG_DEBUG, 0, "No downstream listeners for group %I. No join sent.",
+                route->group);
         }
 
     } else {
         // Only leave if group is not left already...
         if(route->upstrState != ROUTESTATE_NOTJOINED) {
-            my_log(LOG_DEBUG, 0, "Leaving group %s upstream on IF address %s",
-                         inetFmt(route->group, s1), 
-                         inetFmt(upstrIf->InAdr.s_addr, s2));
+            my_log(LOG_DEBUG, 0, "Leaving group %I upstream on IF address %I",
+                         route->group, 
+                         upstrIf->InAdr.s_addr);
             
             //k_leave(route->group, upstrIf->InAdr.s_addr);
             leaveMcGroup( getMcGroupSock(), upstrIf, route->group );
@@ -202,8 +235,8 @@ void clearAllRoutes(void) {
         remainroute = croute->nextroute;
 
         // Log the cleanup in debugmode...
-        my_log(LOG_DEBUG, 0, "Removing route entry for %s",
-                     inetFmt(croute->group, s1));
+        my_log(LOG_DEBUG, 0, "Removing route entry for %I",
+                     croute->group);
 
         // Uninstall current route
         if(!internUpdateKernelRoute(croute, 0)) {
@@ -214,9 +247,16 @@ void clearAllRoutes(void) {
         sendJoinLeaveUpstream(croute, 0);
 
         // Clear memory, and set pointer to next route...
+        routeSourcesFree(croute);
         free(croute);
     }
     routing_table = NULL;
+    routing_table_tail = NULL;
+    addrHashFree(&routeHash);
+    addrHashFree(&activeHash);
+
+    // The timers are gone already...
+    pollTimer = INVAILD_TIMER;
 
     // Send a notice that the routing table is empty...
     my_log(LOG_NOTICE, 0, "All routes removed. Routing table is empty.");
@@ -227,15 +267,244 @@ void clearAllRoutes(void) {
 *   Route Descriptor.
 */
 struct RouteTable *findRoute(uint32_t group) {
-    struct RouteTable*  croute;
+    return addrHashLookup(&routeHash, group);
+}
+
+/**
+*   Finds the route activated for traffic from originAddr to group.
+*/
+struct RouteTable *findActiveRoute(uint32_t originAddr, uint32_t group) {
+    struct RouteSource *rs = sgHashLookup(&activeHash, originAddr, group);
+
+    return rs != NULL ? rs->route : NULL;
+}
+
+/*
+*   Returns the monotonic time in ms, for the route counters.
+*/
+static long long routeClock(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+*   Adds an activated source to a route. The source starts out with
+*   the listeners of the route.
+*/
+static struct RouteSource *routeSourceAdd(struct RouteTable *croute, uint32_t originAddr) {
+    struct Config *conf = getCommonConfig();
+    struct RouteSource *rs = poolAlloc(POOL_ROUTESRC);
+
+    if(rs == NULL || !sgHashInsert(&activeHash, originAddr, croute->group, rs)) {
+        my_log(LOG_WARNING, 0, "Unable to add source %I to route %I.",
+            originAddr, croute->group);
+        if(rs != NULL)
+            poolFree(POOL_ROUTESRC, rs);
+        return NULL;
+    }
+
+    rs->route         = croute;
+    rs->originAddr    = originAddr;
+    rs->vifBits       = croute->vifBits;
+    rs->installedBits = 0;
+    rs->installed     = 0;
+    rs->upcalls       = 0;
+    rs->pkts          = 0;
+    rs->bytes         = 0;
+    rs->pktRate       = 0;
+    rs->byteRate      = 0;
+    rs->polledAt      = 0;
+    rs->lastActive    = routeClock();
+
+    rs->next = croute->sources;
+    croute->sources = rs;
+    croute->nsources++;
+
+    // Poll the counters while there are sources...
+    if(pollTimer == INVAILD_TIMER && conf->mfcPollInterval > 0) {
+        pollTimer = timer_setTimer(conf->mfcPollInterval * 1000, pollRouteCounters, NULL);
+    }
+
+    return rs;
+}
+
+/*
+*   Removes one source from a route and from the kernel.
+*/
+static void routeSourceRemove(struct RouteTable *croute, struct RouteSource *rs) {
+    struct RouteSource **rsp;
+
+    internUpdateKernelSource(croute, rs, 0);
+
+    for(rsp = &croute->sources; *rsp != NULL; rsp = &(*rsp)->next) {
+        if(*rsp == rs) {
+            *rsp = rs->next;
+            break;
+        }
+    }
+    croute->nsources--;
+    sgHashRemove(&activeHash, rs->originAddr, croute->group);
+    poolFree(POOL_ROUTESRC, rs);
+}
+
+/*
+*   Takes new kernel counters of a source.
+*/
+static void routeSourceCount(struct RouteSource *rs, uint64_t pkts, uint64_t bytes, long long now) {
+    // Counters start again from zero when the kernel recreates the entry.
+    uint64_t dpkts  = pkts >= rs->pkts ? pkts - rs->pkts : pkts;
+    uint64_t dbytes = bytes >= rs->bytes ? bytes - rs->bytes : bytes;
+
+    if(rs->polledAt != 0 && now > rs->polledAt) {
+        rs->pktRate  = dpkts * 1000 / (now - rs->polledAt);
+        rs->byteRate = dbytes * 1000 / (now - rs->polledAt);
+    }
+    if(dpkts > 0) {
+        rs->lastActive = now;
+    }
+    rs->pkts     = pkts;
+    rs->bytes    = bytes;
+    rs->polledAt = now;
+}
+
+/*
+*   Reads the kernel counters of all sources in one pass over the
+*   kernel route cache, or with one ioctl per source if that file is
+*   not there. Sources without traffic for the idle timeout are
+*   removed, and routes left without sources or listeners with them.
+*/
+static void pollRouteCounters(void *data) {
+    struct Config       *conf = getCommonConfig();
+    struct RouteTable   *croute, *nroute;
+    struct RouteSource  *rs, *nrs;
+    long long           now = routeClock();
+    char                line[256];
+    FILE                *fp;
+
+    pollTimer = INVAILD_TIMER;
+
+    fp = fopen(MFC_CACHE_FILE, "r");
+    if(fp != NULL) {
+        while(fgets(line, sizeof(line), fp) != NULL) {
+            unsigned long group, origin, pkts, bytes;
+            int iif;
+
+            // The addresses are printed in network order as hex words.
+            if(sscanf(line, "%lx %lx %d %lu %lu", &group, &origin, &iif, &pkts, &bytes) != 5)
+                continue;
+            rs = sgHashLookup(&activeHash, (uint32_t)origin, (uint32_t)group);
+            if(rs != NULL)
+                routeSourceCount(rs, pkts, bytes, now);
+        }
+        fclose(fp);
+    } else {
+        for(croute = routing_table; croute != NULL; croute = croute->nextroute) {
+            for(rs = croute->sources; rs != NULL; rs = rs->next) {
+                unsigned long pkts, bytes;
+
+                if(rs->installed && getMRouteCounters(rs->originAddr, croute->group, &pkts, &bytes) == 0)
+                    routeSourceCount(rs, pkts, bytes, now);
+            }
+        }
+    }
+
+    if(conf->mfcIdleTimeout > 0) {
+        for(croute = routing_table; croute != NULL; croute = nroute) {
+            nroute = croute->nextroute;
+
+            for(rs = croute->sources; rs != NULL; rs = nrs) {
+                nrs = rs->next;
+                if(now - rs->lastActive < conf->mfcIdleTimeout * 1000LL)
+                    continue;
 
-    for(croute = routing_table; croute; croute = croute->nextroute) {
-        if(croute->group == group) {
-            return croute;
+                my_log(LOG_INFO, 0, "Source %I of %I idle for %u s. Removing.",
+                    rs->originAddr, croute->group,
+                    (unsigned)((now - rs->lastActive) / 1000));
+                routeSourceRemove(croute, rs);
+                reapedSources++;
+            }
+
+            if(croute->sources == NULL && croute->vifBits == 0) {
+                removeRoute(croute);
+            }
         }
     }
 
-    return NULL;
+    if(activeHash.count > 0) {
+        pollTimer = timer_setTimer(conf->mfcPollInterval * 1000, pollRouteCounters, NULL);
+    }
+}
+
+/**
+*   Calls 'fn' for every activated source of every route.
+*/
+void forEachRouteSource(void (*fn)(uint32_t group, uint32_t origin, void *arg), void *arg) {
+    struct RouteTable   *croute;
+    struct RouteSource  *rs;
+
+    for(croute = routing_table; croute != NULL; croute = croute->nextroute) {
+        for(rs = croute->sources; rs != NULL; rs = rs->next)
+            fn(croute->group, rs->originAddr, arg);
+    }
+}
+
+/**
+*   Logs the kernel counters of every route source, and a summary.
+*/
+void logRouteCounters(void) {
+    struct RouteTable   *croute;
+    struct RouteSource  *rs;
+    unsigned long long  pkts = 0, bytes = 0;
+
+    for(croute = routing_table; croute != NULL; croute = croute->nextroute) {
+        for(rs = croute->sources; rs != NULL; rs = rs->next) {
+            my_log(LOG_INFO, 0, "Route %I from %I: %llu packets, %llu bytes, %u pkt/s, %u B/s",
+                croute->group, rs->originAddr,
+                (unsigned long long)rs->pkts, (unsigned long long)rs->bytes,
+                rs->pktRate, rs->byteRate);
+            pkts  += rs->pkts;
+            bytes += rs->bytes;
+        }
+    }
+    my_log(LOG_NOTICE, 0, "Kernel routes: %u sources, %llu packets, %llu bytes, %lu reaped idle",
+        activeHash.count, pkts, bytes, reapedSources);
+}
+
+/*
+*   Drops all sources of a route. Their kernel entries must
+*   have been removed already.
+*/
+static void routeSourcesFree(struct RouteTable *croute) {
+    struct RouteSource *rs;
+
+    while((rs = croute->sources) != NULL) {
+        croute->sources = rs->next;
+        sgHashRemove(&activeHash, rs->originAddr, croute->group);
+        poolFree(POOL_ROUTESRC, rs);
+    }
+    croute->nsources = 0;
+}
+
+/*
+*   Takes a route and its sources out of the list and the indexes.
+*/
+static void unlinkRoute(struct RouteTable *croute) {
+    if(croute->prevroute == NULL) {
+        // Topmost node...
+        routing_table = croute->nextroute;
+    } else {
+        croute->prevroute->nextroute = croute->nextroute;
+    }
+    if(croute->nextroute == NULL) {
+        routing_table_tail = croute->prevroute;
+    } else {
+        croute->nextroute->prevroute = croute->prevroute;
+    }
+
+    addrHashRemove(&routeHash, croute->group);
+    routeSourcesFree(croute);
 }
 
 /**
@@ -247,12 +516,13 @@ int insertRoute(uint32_t group, int ifx) {
     
     struct Config *conf = getCommonConfig();
     struct RouteTable*  croute;
+    struct RouteSource* rs;
     int result = 1;
 
     // Sanitycheck the group adress...
     if( ! IN_MULTICAST( ntohl(group) )) {
-        my_log(LOG_WARNING, 0, "The group address %s is not a valid Multicast group. Table insert failed.",
-            inetFmt(group, s1));
+        my_log(LOG_WARNING, 0, "The group address %I is not a valid Multicast group. Table insert failed.",
+            group);
         return 0;
     }
 
@@ -268,15 +538,22 @@ int insertRoute(uint32_t group, int ifx) {
     if(croute==NULL) {
         struct RouteTable*  newroute;
 
-        my_log(LOG_DEBUG, 0, "No existing route for %s. Create new.",
-                     inetFmt(group, s1));
+        my_log(LOG_DEBUG, 0, "No existing route for %I. Create new.",
+                     group);
 
 
         // Create and initialize the new route table entry..
         newroute = (struct RouteTable*)malloc(sizeof(struct RouteTable));
+        if(newroute == NULL || !addrHashInsert(&routeHash, group, newroute)) {
+            my_log(LOG_WARNING, 0, "Unable to allocate the route for %I.",
+                group);
+            free(newroute);
+            return 0;
+        }
         // Insert the route desc and clear all pointers...
         newroute->group      = group;
-        newroute->originAddr = 0;
+        newroute->sources    = NULL;
+        newroute->nsources   = 0;
         newroute->nextroute  = NULL;
         newroute->prevroute  = NULL;
 
@@ -295,72 +572,41 @@ int insertRoute(uint32_t group, int ifx) {
             BIT_SET(newroute->vifBits, ifx);
         }
 
-        // Check if there is a table already....
-        if(routing_table == NULL) {
-            // No location set, so insert in on the table top.
+        // Append the route at the end of the table...
+        newroute->prevroute = routing_table_tail;
+        if(routing_table_tail == NULL) {
             routing_table = newroute;
-            my_log(LOG_DEBUG, 0, "No routes in table. Insert at beginning.");
         } else {
-
-            my_log(LOG_DEBUG, 0, "Found existing routes. Find insert location.");
-
-            // Check if the route could be inserted at the beginning...
-            if(routing_table->group > group) {
-                my_log(LOG_DEBUG, 0, "Inserting at beginning, before route %s",inetFmt(routing_table->group,s1));
-
-                // Insert at beginning...
-                newroute->nextroute = routing_table;
-                newroute->prevroute = NULL;
-                routing_table = newroute;
-
-                // If the route has a next node, the previous pointer must be updated.
-                if(newroute->nextroute != NULL) {
-                    newroute->nextroute->prevroute = newroute;
-                }
-
-            } else {
-
-                // Find the location which is closest to the route.
-                for( croute = routing_table; croute->nextroute != NULL; croute = croute->nextroute ) {
-                    // Find insert position.
-                    if(croute->nextroute->group > group) {
-                        break;
-                    }
-                }
-
-                my_log(LOG_DEBUG, 0, "Inserting after route %s",inetFmt(croute->group,s1));
-                
-                // Insert after current...
-                newroute->nextroute = croute->nextroute;
-                newroute->prevroute = croute;
-                if(croute->nextroute != NULL) {
-                    croute->nextroute->prevroute = newroute; 
-                }
-                croute->nextroute = newroute;
-            }
+            routing_table_tail->nextroute = newroute;
         }
+        routing_table_tail = newroute;
 
         // Set the new route as the current...
         croute = newroute;
 
         // Log the cleanup in debugmode...
-        my_log(LOG_INFO, 0, "Inserted route table entry for %s on VIF #%d",
-            inetFmt(croute->group, s1),ifx);
+        my_log(LOG_INFO, 0, "Inserted route table entry for %I on VIF #%d",
+            croute->group,ifx);
 
     } else if(ifx >= 0) {
 
         // The route exists already, so just update it.
         BIT_SET(croute->vifBits, ifx);
+#if defined(IGMPv3_PROXY)
+        for(rs = croute->sources; rs != NULL; rs = rs->next) {
+            BIT_SET(rs->vifBits, ifx);
+        }
+#endif
         
         // Register the VIF activity for the aging routine
         BIT_SET(croute->ageVifBits, ifx);
 
         // Log the cleanup in debugmode...
-        my_log(LOG_INFO, 0, "Updated route entry for %s on VIF #%d",
-            inetFmt(croute->group, s1), ifx);
+        my_log(LOG_INFO, 0, "Updated route entry for %I on VIF #%d",
+            croute->group, ifx);
 
         // If the route is active, it must be reloaded into the Kernel..
-        if(croute->originAddr != 0) {
+        if(croute->sources != NULL) {
 
             // Update route in kernel...
             if(!internUpdateKernelRoute(croute, 1)) {
@@ -384,10 +630,11 @@ int insertRoute(uint32_t group, int ifx) {
 int updateRoute(uint32_t group)
 {
     struct RouteTable*  croute;
+    struct RouteSource* rs;
     int result = 0;
 
     croute = findRoute(group);
-    if(croute && croute->originAddr > 0) {
+    if(croute && croute->sources != NULL) {
         unsigned Ix;
         struct IfDesc *Dp = NULL;
         struct group *gp = NULL;
@@ -403,26 +650,33 @@ int updateRoute(uint32_t group)
                 my_log(LOG_INFO, 0, "Find the group in interface.");
                 gp = interfaceGroupLookup(Dp, group);
                 if(gp) {
-                    my_log(LOG_INFO, 0, "Find the source in group.");
-                    src = groupSourceLookup(gp, croute->originAddr);
-
-                    my_log(LOG_INFO, 0, "Find the route entry.");
-                    if((gp->fmode == IGMP_V3_FMODE_INCLUDE && src) || (gp->fmode == IGMP_V3_FMODE_EXCLUDE && ((!src) || (src && src->fstate == 1)))) {
-                        BIT_SET(croute->vifBits, Dp->index);
-                        my_log(LOG_INFO, 0, "Setting vifBits %d.", Dp->index);
-                    } else {
-                        BIT_CLR(croute->vifBits, Dp->index);
-                        my_log(LOG_INFO, 0, "Cleaning vifBits %d.", Dp->index);
+                    // Each source is forwarded where the group filter lets it through.
+                    for(rs = croute->sources; rs != NULL; rs = rs->next) {
+                        src = groupSourceLookup(gp, rs->originAddr);
+
+                        if((gp->fmode == IGMP_V3_FMODE_INCLUDE && src) || (gp->fmode == IGMP_V3_FMODE_EXCLUDE && ((!src) || (src && src->fstate == 1)))) {
+                            BIT_SET(rs->vifBits, Dp->index);
+                            my_log(LOG_INFO, 0, "Setting vifBits %d for %I.", Dp->index, rs->originAddr);
+                        } else {
+                            BIT_CLR(rs->vifBits, Dp->index);
+                            my_log(LOG_INFO, 0, "Cleaning vifBits %d for %I.", Dp->index, rs->originAddr);
+                        }
                     }
                 }
             }
         }
         my_log(LOG_INFO, 0, "=====================================");
 
-        // Only update kernel table if there are listeners !
-        if(croute->vifBits > 0) {
-            result = internUpdateKernelRoute(croute, 1);
-            my_log(LOG_INFO, 0, "Setting route entry to kernel.");
+        // Sources without listeners stay in the kernel with no outputs,
+        // only entries that changed are reloaded.
+        BIT_ZERO(croute->vifBits);
+        result = 1;
+        for(rs = croute->sources; rs != NULL; rs = rs->next) {
+            croute->vifBits |= rs->vifBits;
+            if(!rs->installed || rs->installedBits != rs->vifBits) {
+                if(!internUpdateKernelSource(croute, rs, 1))
+                    result = 0;
+            }
         }
     }
 
@@ -446,8 +700,8 @@ int deleteRoute(uint32_t group) {
     }
 
     // Log the cleanup in debugmode...
-    my_log(LOG_DEBUG, 0, "Delete route entry for %s from table.",
-                 inetFmt(croute->group, s1));
+    my_log(LOG_DEBUG, 0, "Delete route entry for %I from table.",
+                 croute->group);
 
     //BIT_ZERO(croute->vifBits);
 
@@ -465,19 +719,8 @@ int deleteRoute(uint32_t group) {
     }
 
     // Update pointers...
-    if(croute->prevroute == NULL) {
-        // Topmost node...
-        if(croute->nextroute != NULL) {
-            croute->nextroute->prevroute = NULL;
-        }
-        routing_table = croute->nextroute;
+    unlinkRoute(croute);
 
-    } else {
-        croute->prevroute->nextroute = croute->nextroute;
-        if(croute->nextroute != NULL) {
-            croute->nextroute->prevroute = croute->prevroute;
-        }
-    }
     // Free the memory, and set the route to NULL...
     free(croute);
     croute = NULL;
@@ -497,14 +740,16 @@ int deleteRoute(uint32_t group) {
 */
 int activateRoute(uint32_t group, uint32_t originAddr) {
     struct RouteTable*  croute;
+    struct RouteSource* rs;
     int result = 0;
 
-    // Find the requested route.
-    croute = findRoute(group);
+    // Find the requested route, the known sources first.
+    rs = sgHashLookup(&activeHash, originAddr, group);
+    croute = rs != NULL ? rs->route : findRoute(group);
     if(croute == NULL) {
         my_log(LOG_DEBUG, 0,
-		"No table entry for %s [From: %s]. Inserting route.",
-		inetFmt(group, s1),inetFmt(originAddr, s2));
+		"No table entry for %I [From: %I]. Inserting route.",
+		group,originAddr);
 
         // Insert route, but no interfaces have yet requested it downstream.
         insertRoute(group, -1);
@@ -514,27 +759,29 @@ int activateRoute(uint32_t group, uint32_t originAddr) {
     }
 
     if(croute != NULL) {
-        // If the origin address is set, update the route data.
-        if(originAddr > 0) {
-            if(croute->originAddr > 0 && croute->originAddr!=originAddr) {
-                my_log(LOG_WARNING, 0, "The origin for route %s changed from %s to %s",
-                    inetFmt(croute->group, s1),
-                    inetFmt(croute->originAddr, s2),
-                    inetFmt(originAddr, s3));
-            } else {
-                my_log(LOG_WARNING, 0, "get {S/G} with (%s / %s)", inetFmt(originAddr, s1), inetFmt(croute->group, s2));
-            }
-            croute->originAddr = originAddr;
+        // If the origin address is set, add it to the sources of the route.
+        if(rs != NULL) {
+            // The kernel only asks for entries it does not have.
+            my_log(LOG_DEBUG, 0, "Repeated upcall for {S/G} (%I / %I)",
+                originAddr, croute->group);
+            rs->installed = 0;
+        } else if(originAddr > 0) {
+            my_log(LOG_INFO, 0, "get {S/G} with (%I / %I), %u other sources",
+                originAddr, croute->group, croute->nsources);
+            rs = routeSourceAdd(croute, originAddr);
         }
+        if(rs == NULL) {
+            logRouteTable("Activate Route");
+            return 0;
+        }
+        rs->upcalls++;
 
 #if defined(IGMPv3_PROXY)
         /* This is chance to update vifBits */
-        updateRoute(group);
+        result = updateRoute(group);
 #else
-        // Only update kernel table if there are listeners !
-        if(croute->vifBits > 0) {
-            result = internUpdateKernelRoute(croute, 1);
-        }
+        // Installed even without listeners, so the kernel stops asking.
+        result = internUpdateKernelSource(croute, rs, 1);
 #endif
     }
     logRouteTable("Activate Route");
@@ -622,8 +869,8 @@ int removeRoute(struct RouteTable*  croute) {
     }
 
     // Log the cleanup in debugmode...
-    my_log(LOG_DEBUG, 0, "Removed route entry for %s from table.",
-                 inetFmt(croute->group, s1));
+    my_log(LOG_DEBUG, 0, "Removed route entry for %I from table.",
+                 croute->group);
 
     //BIT_ZERO(croute->vifBits);
 
@@ -641,19 +888,8 @@ int removeRoute(struct RouteTable*  croute) {
     }
 
     // Update pointers...
-    if(croute->prevroute == NULL) {
-        // Topmost node...
-        if(croute->nextroute != NULL) {
-            croute->nextroute->prevroute = NULL;
-        }
-        routing_table = croute->nextroute;
+    unlinkRoute(croute);
 
-    } else {
-        croute->prevroute->nextroute = croute->nextroute;
-        if(croute->nextroute != NULL) {
-            croute->nextroute->prevroute = croute->prevroute;
-        }
-    }
     // Free the memory, and set the route to NULL...
     free(croute);
     croute = NULL;
@@ -714,8 +950,8 @@ int internAgeRoute(struct RouteTable*  croute) {
         // Check for activity in the aging process,
         if(croute->ageActivity>0) {
             
-            my_log(LOG_DEBUG, 0, "Updating route after aging : %s",
-                         inetFmt(croute->group,s1));
+            my_log(LOG_DEBUG, 0, "Updating route after aging : %I",
+                         croute->group);
             
             // Just update the routing settings in kernel...
             internUpdateKernelRoute(croute, 1);
@@ -723,14 +959,14 @@ int internAgeRoute(struct RouteTable*  croute) {
             // We append the activity counter to the age, and continue...
             croute->ageValue = croute->ageActivity;
             croute->ageActivity = 0;
-            my_log(LOG_DEBUG, 0, "Removing group %s. Died of old age.",
-                         inetFmt(croute->group,s1));
+            my_log(LOG_DEBUG, 0, "Removing group %I. Died of old age.",
+                         croute->group);
 
 
         } else {
 
-            my_log(LOG_DEBUG, 0, "Removing group %s. Died of old age.",
-                         inetFmt(croute->group,s1));
+            my_log(LOG_DEBUG, 0, "Removing group %I. Died of old age.",
+                         croute->group);
 
             // No activity was registered within the timelimit, so remove the route.
             removeRoute(croute);
@@ -745,126 +981,112 @@ int internAgeRoute(struct RouteTable*  croute) {
     return result;
 }
 
-#if MC4_CHANGES
-/* This function checks if the given interface is VLAN if or not
- * If its VLAN interface the forwarding is done by FPP
- * so we disable forwarding on those interfaces by Linux
- * The only interface allowed is wifi(ath0) interface
- */
-int IsIfVlan(char * ifName)
-{
-    int err, rc = 1;
-    struct vlan_ioctl_args if_request;
-    int vlan_fd;
-	
-    memset(&if_request, 0, sizeof(if_request));
-
-    /*Open a socket fd */
-    if ((vlan_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-    {
-	my_log(LOG_DEBUG, 0,  "%s:, Unable to create a soket\n", __func__);
-	return 0;
-    }   
+/**
+*   Updates the Kernel routing table. If activate is 1, the route
+*   is (re-)activated. If activate is false, the route is removed.
+*/
+int internUpdateKernelRoute(struct RouteTable *route, int activate) {
+    struct RouteSource      *rs;
 
-    /*
-     * Check if the interface has real device, then its VLAN interface
-     */
-    if_request.cmd = GET_VLAN_REALDEV_NAME_CMD;
-    strcpy(&if_request.device1[0], (char *)ifName);
+    if(route->sources != NULL) {
+        for(rs = route->sources; rs != NULL; rs = rs->next) {
+            internUpdateKernelSource(route, rs, activate);
+        }
+    } else {
+        my_log(LOG_NOTICE, 0, "Route is not active. No kernel updates done.");
+    }
 
-    if ((err = ioctl(vlan_fd, SIOCGIFVLAN, &if_request)) < 0)
-    {
-	switch(errno)
-	{
-	    case EINVAL:
-    		my_log(LOG_DEBUG, 0, "EINVAL\n");
-		rc = 0;
-		break;
-	    case ENODEV:
-		my_log(LOG_DEBUG, 0, "%s: Warning, Found no information about %s interface\n", __func__, ifName);
-		rc = 0;
-		break;
-	    default:
-		my_log(LOG_DEBUG, 0, "%s: ioctl error %d\n", __func__, errno);
-		rc = 0;
-		break;
-	}
-    }
-    //my_log(LOG_DEBUG, 0, "Real devname:%s\n",if_request.u.device2);
-    close(vlan_fd);
-    return rc;
+    return 1;
 }
-#endif
 
 /**
-*   Updates the Kernel routing table. If activate is 1, the route
-*   is (re-)activated. If activate is false, the route is removed.
+*   Updates the Kernel entry of one source of a route.
 */
-int internUpdateKernelRoute(struct RouteTable *route, int activate) {
+static int internUpdateKernelSource(struct RouteTable *route, struct RouteSource *rs, int activate) {
     struct   MRouteDesc     mrDesc;
     struct   IfDesc         *Dp;
     unsigned                Ix;
-    
-    if(route->originAddr>0) {
+#if defined(IGMPv3_PROXY)
+    uint32_t                vifBits = rs->vifBits;
+#else
+    uint32_t                vifBits = route->vifBits;
+#endif
 
-        // Build route descriptor from table entry...
-        // Set the source address and group address...
-        mrDesc.McAdr.s_addr     = route->group;
-        mrDesc.OriginAdr.s_addr = route->originAddr;
-    
-        // clear output interfaces 
-        memset( mrDesc.TtlVc, 0, sizeof( mrDesc.TtlVc ) );
-    
-        my_log(LOG_DEBUG, 0, "Vif bits : 0x%08x", route->vifBits);
+    // Build route descriptor from table entry...
+    // Set the source address and group address...
+    mrDesc.McAdr.s_addr     = route->group;
+    mrDesc.OriginAdr.s_addr = rs->originAddr;
 
-        // Set the TTL's for the route descriptor...
-        for ( Ix = 0; (Dp = getIfByIx(Ix)); Ix++ ) {
-            if(Dp->state == IF_STATE_UPSTREAM) {
-                my_log(LOG_DEBUG, 0, "Identified VIF #%d as upstream.", Dp->index);
-                mrDesc.InVif = Dp->index;
-            }
-            else if(BIT_TST(route->vifBits, Dp->index)) {
-                my_log(LOG_DEBUG, 0, "Setting TTL for %s (Vif) %d to %d", Dp->Name, Dp->index, Dp->threshold);
+    // clear output interfaces 
+    memset( mrDesc.TtlVc, 0, sizeof( mrDesc.TtlVc ) );
+
+    my_log(LOG_DEBUG, 0, "Vif bits : 0x%08x", vifBits);
+
+    // Set the TTL's for the route descriptor...
+    for ( Ix = 0; (Dp = getIfByIx(Ix)); Ix++ ) {
+        if(Dp->state == IF_STATE_UPSTREAM) {
+            my_log(LOG_DEBUG, 0, "Identified VIF #%d as upstream.", Dp->index);
+            mrDesc.InVif = Dp->index;
+        }
+        else if(BIT_TST(vifBits, Dp->index)) {
+            my_log(LOG_DEBUG, 0, "Setting TTL for %s (Vif) %d to %d", Dp->Name, Dp->index, Dp->threshold);
 #if MC4_CHANGES
-		/* If its ethernet interface then forwarding is done by FPP, also check if its VLAN
-		 * interface since that is also taken care by FPP*/
-		if(!strncasecmp(Dp->Name,"eth",3)|| IsIfVlan(Dp->Name)) {
+		/* If its ethernet or VLAN interface then forwarding is done by FPP,
+		 * classified once by classifyIf() */
+		if(Dp->fppForwarded) {
 		  	my_log(LOG_DEBUG, 0, "Setting TTL for %s (Vif) %d to %d", Dp->Name, Dp->index, 255);
 			/* Setting ttl vector as 255 means kernel will not forward on that interface */
 			mrDesc.TtlVc[ Dp->index ] = 255;
 		} else 
-                	mrDesc.TtlVc[ Dp->index ] = Dp->threshold;
+            	mrDesc.TtlVc[ Dp->index ] = Dp->threshold;
 #else
 		mrDesc.TtlVc[ Dp->index ] = Dp->threshold;
 #endif
-            }
         }
-    
-        // Do the actual Kernel route update...
-        if(activate) {
-            // Add route in kernel...
-            addMRoute( &mrDesc );
+    }
 
-    
-        } else {
-            // Delete the route from Kernel...
-            delMRoute( &mrDesc );
-        }
+    // Do the actual Kernel route update...
+    if(activate) {
+        // Add route in kernel...
+        rs->installed = addMRoute( &mrDesc ) == 0;
+        rs->installedBits = vifBits;
+        if(!rs->installed)
+            return 0;
 
     } else {
-        my_log(LOG_NOTICE, 0, "Route is not active. No kernel updates done.");
+        // Delete the route from Kernel...
+        if(rs->installed)
+            delMRoute( &mrDesc );
+        rs->installed = 0;
     }
 
     return 1;
 }
 
+/**
+*   Reloads all active routes into the Kernel, after the
+*   classification of an interface changed.
+*/
+void reloadKernelRoutes(void) {
+    struct RouteTable   *croute;
+
+    for(croute = routing_table; croute != NULL; croute = croute->nextroute) {
+        internUpdateKernelRoute(croute, 1);
+    }
+}
+
 /**
 *   Debug function that writes the routing table entries
 *   to the log.
 */
 void logRouteTable(char *header) {
         struct RouteTable*  croute = routing_table;
+        struct RouteSource* rs;
         unsigned            rcount = 0;
+
+        // Walking a large table is not free, skip it unless it is logged.
+        if(!LOG_ENABLED(LOG_DEBUG))
+            return;
     
         my_log(LOG_DEBUG, 0, "");
         my_log(LOG_DEBUG, 0, "Current routing table (%s):", header);
@@ -874,15 +1096,21 @@ void logRouteTable(char *header) {
         } else {
             do {
                 /*
-                my_log(LOG_DEBUG, 0, "#%d: Src: %s, Dst: %s, Age:%d, St: %s, Prev: 0x%08x, T: 0x%08x, Next: 0x%08x",
-                    rcount, inetFmt(croute->originAddr, s1), inetFmt(croute->group, s2),
+                my_log(LOG_DEBUG, 0, "#%d: Src: %I, Dst: %I, Age:%d, St: %s, Prev: 0x%08x, T: 0x%08x, Next: 0x%08x",
+                    rcount, croute->originAddr, croute->group,
                     croute->ageValue,(croute->originAddr>0?"A":"I"),
                     croute->prevroute, croute, croute->nextroute);
                 */
-                my_log(LOG_DEBUG, 0, "#%d: Src: %s, Dst: %s, Age:%d, St: %s, OutVifs: 0x%08x",
-                    rcount, inetFmt(croute->originAddr, s1), inetFmt(croute->group, s2),
-                    croute->ageValue,(croute->originAddr>0?"A":"I"),
-                    croute->vifBits);
+                my_log(LOG_DEBUG, 0, "#%d: Dst: %I, Age:%d, St: %s, OutVifs: 0x%08x, Sources: %u",
+                    rcount, croute->group,
+                    croute->ageValue,(croute->sources!=NULL?"A":"I"),
+                    croute->vifBits, croute->nsources);
+                for(rs = croute->sources; rs != NULL; rs = rs->next) {
+                    my_log(LOG_DEBUG, 0, "    Src: %I, OutVifs: 0x%08x, Upcalls: %u, Pkts: %llu, Rate: %u B/s%s",
+                        rs->originAddr, rs->vifBits, rs->upcalls,
+                        (unsigned long long)rs->pkts, rs->byteRate,
+                        rs->installed ? "" : ", not installed");
+                }
                   
                 croute = croute->nextroute; 
         
@@ -0,0 +1,398 @@
+/*
+**  igmpproxy - IGMP proxy based multicast router
+**  Copyright (C) 2005 Johnny Egeland <johnny@rlo.org>
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+**
+**----------------------------------------------------------------------------
+**
+**  This software is derived work from the following software. The original
+**  source code has been modified from it's original state by the author
+**  of igmpproxy.
+**
+**  smcroute 0.92 - Copyright (C) 2001 Carsten Schill <carsten@cschill.de>
+**  - Licensed under the GNU General Public License, version 2
+**
+**  mrouted 3.9-beta3 - COPYRIGHT 1989 by The Board of Trustees of
+**  Leland Stanford Junior University.
+**  - Original license can be found in the "doc/mrouted-LINCESE" file.
+**
+*/
+/**
+*   state.c - Snapshot of the membership state for warm restarts.
+*
+*   The groups and sources of the downstream interfaces, with the time
+*   left on their timers, and the sources of every route are written
+*   to the state file periodically and on exit. On start they are read
+*   back: the groups are replayed as current state reports, which also
+*   rebuilds the member database, and the route sources are activated
+*   again, so forwarding resumes without waiting for the hosts.
+*
+*   The file holds a header and a list of records, each led by its
+*   type. It is written to a temporary file that is then renamed, so a
+*   crash never leaves half a snapshot behind.
+*/
+
+#include "defs.h"
+#include "igmpproxy.h"
+
+#include <stdint.h>
+#include <time.h>
+
+/* Seconds between two snapshots while running */
+#define STATE_SAVE_INTERVAL 60
+/* Sources a group record may hold, to reject damaged files */
+#define STATE_MAX_SOURCES   65536
+
+#define STATE_MAGIC         0x49475053  /* "IGPS" */
+#define STATE_VERSION       1
+
+enum {
+    STATE_REC_END,
+    STATE_REC_GROUP,    /* struct stateGroup, then nsrcs struct stateSource */
+    STATE_REC_ROUTE,    /* struct stateRoute */
+};
+
+struct stateHeader {
+    uint32_t    magic;
+    uint32_t    version;
+    int64_t     savedAt;        // Wall clock time of the snapshot, in seconds
+};
+
+struct stateGroup {
+    char        ifName[IF_NAMESIZE];
+    uint32_t    mcast;
+    int32_t     fmode;
+    int32_t     version;
+    uint32_t    groupLeft;      // Time left in ms, 0 when not running
+    uint32_t    v1Left;
+    uint32_t    v2Left;
+    uint32_t    nsrcs;
+};
+
+struct stateSource {
+    uint32_t    addr;
+    int32_t     fstate;
+    uint32_t    left;
+};
+
+struct stateRoute {
+    uint32_t    group;
+    uint32_t    origin;
+};
+
+static int      stateTimer = INVAILD_TIMER;
+
+/*
+*   Returns the time left on a timer, 0 if it is not running.
+*/
+static uint32_t stateTimeLeft(int timer) {
+    int left = timer_leftTimer(timer);
+
+    return left > 0 ? left : 0;
+}
+
+static int stateWrite(FILE *fp, uint32_t type, const void *data, size_t len) {
+    if(fwrite(&type, sizeof(type), 1, fp) != 1)
+        return 0;
+    return len == 0 || fwrite(data, len, 1, fp) == 1;
+}
+
+/*
+*   Writes the groups of one downstream interface.
+*/
+static int stateSaveGroups(FILE *fp, struct IfDesc *Dp, unsigned *count) {
+    struct group        *gp;
+    struct stateGroup   sg;
+    struct stateSource  ss;
+    int                 i;
+
+    list_for_each(&Dp->groups, gp, list) {
+        memset(&sg, 0, sizeof(sg));
+        snprintf(sg.ifName, sizeof(sg.ifName), "%s", Dp->Name);
+        sg.mcast     = gp->mcast.s_addr;
+        sg.fmode     = gp->fmode;
+        sg.version   = gp->version;
+        sg.groupLeft = gp->fmode == IGMP_V3_FMODE_EXCLUDE ? stateTimeLeft(gp->timer) : 0;
+        sg.v1Left    = stateTimeLeft(gp->v1_host_timer);
+        sg.v2Left    = stateTimeLeft(gp->v2_host_timer);
+        sg.nsrcs     = gp->nsrcs;
+        if(!stateWrite(fp, STATE_REC_GROUP, &sg, sizeof(sg)))
+            return 0;
+
+        for(i = 0; i < gp->nsrcs; i++) {
+            ss.addr   = gp->srcaddrs[i];
+            ss.fstate = gp->srcs[i]->fstate;
+            ss.left   = stateTimeLeft(gp->srcs[i]->timer);
+            if(fwrite(&ss, sizeof(ss), 1, fp) != 1)
+                return 0;
+        }
+        (*count)++;
+    }
+    return 1;
+}
+
+static void stateSaveRoute(uint32_t group, uint32_t origin, void *arg) {
+    struct stateRoute sr = { group, origin };
+    FILE *fp = arg;
+
+    stateWrite(fp, STATE_REC_ROUTE, &sr, sizeof(sr));
+}
+
+/**
+*   Writes the snapshot to the state file. Returns 1 on success.
+*/
+int stateSave(void) {
+    struct Config       *conf = getCommonConfig();
+    struct stateHeader  hdr;
+    struct IfDesc       *Dp;
+    char                tmpName[PATH_MAX];
+    unsigned            Ix, groups = 0;
+    FILE                *fp;
+    int                 ok;
+
+    if(conf->stateFile == NULL)
+        return 0;
+
+    snprintf(tmpName, sizeof(tmpName), "%s.tmp", conf->stateFile);
+    fp = fopen(tmpName, "w");
+    if(fp == NULL) {
+        my_log(LOG_WARNING, errno, "Cannot write state file %s", tmpName);
+        return 0;
+    }
+
+    hdr.magic   = STATE_MAGIC;
+    hdr.version = STATE_VERSION;
+    hdr.savedAt = time(NULL);
+    ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+
+    for(Ix = 0; ok && (Dp = getIfByIx(Ix)); Ix++) {
+        if(Dp->state == IF_STATE_DOWNSTREAM)
+            ok = stateSaveGroups(fp, Dp, &groups);
+    }
+    if(ok) {
+        forEachRouteSource(stateSaveRoute, fp);
+        ok = stateWrite(fp, STATE_REC_END, NULL, 0);
+    }
+
+    if(ferror(fp))
+        ok = 0;
+    if(fclose(fp) != 0 || !ok) {
+        my_log(LOG_WARNING, errno, "Cannot write state file %s", tmpName);
+        unlink(tmpName);
+        return 0;
+    }
+    if(rename(tmpName, conf->stateFile) < 0) {
+        my_log(LOG_WARNING, errno, "Cannot rename %s to %s", tmpName, conf->stateFile);
+        unlink(tmpName);
+        return 0;
+    }
+
+    my_log(LOG_DEBUG, 0, "Saved %u groups to %s", groups, conf->stateFile);
+    return 1;
+}
+
+/*
+*   Restores one group from its record. The time the daemon was down
+*   is taken off every timer, and what expired meanwhile is dropped:
+*   an EXCLUDE group whose timer ran out falls back to INCLUDE of its
+*   requested sources, as it would have while running.
+*/
+static int stateRestoreGroup(struct stateGroup *sg, struct stateSource *ss, uint32_t elapsed) {
+    struct IfDesc   *Dp = getIfByName(sg->ifName);
+    struct group    *gp;
+    struct source   *src;
+    uint32_t        *live, *blocked;
+    int             fmode = sg->fmode;
+    int             nlive = 0, nblocked = 0;
+    uint32_t        i;
+
+    if(Dp == NULL || Dp->state != IF_STATE_DOWNSTREAM || !IN_MULTICAST(ntohl(sg->mcast)))
+        return 0;
+
+    live    = malloc(sg->nsrcs * sizeof(uint32_t) + 1);
+    blocked = malloc(sg->nsrcs * sizeof(uint32_t) + 1);
+    if(live == NULL || blocked == NULL) {
+        free(live);
+        free(blocked);
+        return 0;
+    }
+
+    if(fmode == IGMP_V3_FMODE_EXCLUDE && sg->groupLeft <= elapsed)
+        fmode = IGMP_V3_FMODE_INCLUDE;
+
+    // The sources are saved sorted, as the set operations want them.
+    for(i = 0; i < sg->nsrcs; i++) {
+        if(ss[i].fstate && ss[i].left > elapsed)
+            live[nlive++] = ss[i].addr;
+        else if(fmode == IGMP_V3_FMODE_EXCLUDE)
+            blocked[nblocked++] = ss[i].addr;
+    }
+
+    gp = NULL;
+    if(fmode == IGMP_V3_FMODE_EXCLUDE || nlive > 0)
+        gp = interfaceGroupAdd(Dp, sg->mcast);
+
+    if(gp != NULL) {
+        // EXCLUDE (X,Y) is IS_EX (Y) followed by IS_IN (X).
+        if(fmode == IGMP_V3_FMODE_EXCLUDE) {
+            processModeIsExclude(Dp, gp, nblocked, blocked);
+            if(nlive > 0)
+                processModeIsInclude(Dp, gp, nlive, live);
+
+            timer_clearTimer(gp->timer);
+            gp->timer = timer_setTimer(sg->groupLeft - elapsed, groupTimerTimeout, gp);
+        } else {
+            processModeIsInclude(Dp, gp, nlive, live);
+        }
+
+        for(i = 0; i < sg->nsrcs; i++) {
+            if(!ss[i].fstate || ss[i].left <= elapsed)
+                continue;
+            src = groupSourceLookup(gp, ss[i].addr);
+            if(src != NULL) {
+                timer_clearTimer(src->timer);
+                src->timer = timer_setTimer(ss[i].left - elapsed, sourceTimerTimeout, src);
+            }
+        }
+
+        // Older hosts still present keep the group in their version.
+        if(sg->v2Left > elapsed) {
+            gp->v2_host_timer = timer_setTimer(sg->v2Left - elapsed, oldHostTimerTimeout, gp);
+            gp->version = IGMP_V2;
+        }
+        if(sg->v1Left > elapsed) {
+            gp->v1_host_timer = timer_setTimer(sg->v1Left - elapsed, oldHostTimerTimeout, gp);
+            gp->version = IGMP_V1;
+        }
+
+        // The hosts are not known until they report again.
+        if(Dp->explicitTracking)
+            gp->untracked = 1;
+    }
+
+    free(live);
+    free(blocked);
+    return gp != NULL;
+}
+
+/*
+*   Reads the state file back. The route sources follow the groups in
+*   the file, and are activated once the groups made their routes.
+*/
+static void stateRestore(const char *fileName) {
+    struct stateHeader  hdr;
+    struct stateGroup   sg;
+    struct stateSource  *ss;
+    struct stateRoute   sr;
+    uint32_t            type, elapsed;
+    unsigned            groups = 0, sources = 0, flushed = 0;
+    int64_t             age;
+    FILE                *fp;
+
+    fp = fopen(fileName, "r");
+    if(fp == NULL) {
+        my_log(LOG_INFO, errno, "No state in %s, starting cold", fileName);
+        return;
+    }
+
+    if(fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != STATE_MAGIC
+       || hdr.version != STATE_VERSION) {
+        my_log(LOG_WARNING, 0, "State file %s is not usable, starting cold", fileName);
+        fclose(fp);
+        return;
+    }
+
+    // Everything has timed out once a membership interval has passed.
+    age = time(NULL) - hdr.savedAt;
+    if(age < 0)
+        age = 0;
+    if(age * 1000 >= IGMP_GMI) {
+        my_log(LOG_NOTICE, 0, "State in %s is %lld s old, starting cold", fileName, (long long)age);
+        fclose(fp);
+        return;
+    }
+    elapsed = age * 1000;
+
+    while(fread(&type, sizeof(type), 1, fp) == 1 && type != STATE_REC_END) {
+        if(type == STATE_REC_GROUP) {
+            if(fread(&sg, sizeof(sg), 1, fp) != 1 || sg.nsrcs > STATE_MAX_SOURCES)
+                break;
+            sg.ifName[IF_NAMESIZE - 1] = '\0';
+
+            ss = malloc(sg.nsrcs * sizeof(*ss) + 1);
+            if(ss == NULL)
+                break;
+            if(sg.nsrcs > 0 && fread(ss, sizeof(*ss), sg.nsrcs, fp) != sg.nsrcs) {
+                free(ss);
+                break;
+            }
+            groups += stateRestoreGroup(&sg, ss, elapsed);
+            free(ss);
+        } else if(type == STATE_REC_ROUTE) {
+            if(fread(&sr, sizeof(sr), 1, fp) != 1)
+                break;
+
+            // Turn the groups into routes before adding their sources.
+            if(!flushed) {
+                memberDatabaseFlush();
+                flushed = 1;
+            }
+            if(findRoute(sr.group) != NULL) {
+                activateRoute(sr.group, sr.origin);
+                sources++;
+            }
+        } else {
+            break;
+        }
+    }
+
+    if(type != STATE_REC_END)
+        my_log(LOG_WARNING, 0, "State file %s is damaged, restored what was read", fileName);
+    fclose(fp);
+
+    memberDatabaseFlush();
+    flushMRoutes();
+
+    my_log(LOG_NOTICE, 0, "Restored %u groups and %u route sources saved %lld s ago",
+        groups, sources, (long long)age);
+}
+
+static void stateSaveTimeout(void *data) {
+    stateSave();
+    stateTimer = timer_setTimer(STATE_SAVE_INTERVAL * 1000, stateSaveTimeout, NULL);
+}
+
+/**
+*   Restores the state saved by the previous run and starts the
+*   periodic snapshots, when a state file is configured.
+*/
+void stateInit(void) {
+    struct Config *conf = getCommonConfig();
+
+    if(conf->stateFile == NULL)
+        return;
+
+    stateRestore(conf->stateFile);
+    stateTimer = timer_setTimer(STATE_SAVE_INTERVAL * 1000, stateSaveTimeout, NULL);
+}
+
+/**
+*   Writes the last snapshot on exit, for the next start to restore.
+*/
+void stateCleanUp(void) {
+    stateTimer = INVAILD_TIMER;
+    stateSave();
+}
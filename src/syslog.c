@@ -34,23 +34,422 @@
 #include "defs.h"
 #include "igmpproxy.h"
 
+#include <pthread.h>
+#include <sys/eventfd.h>
+
 int LogLevel = LOG_WARNING;
 bool Log2Stderr = false;
 
-void my_log( int Severity, int Errno, const char *FmtSt, ... )
+#define LOG_MSG_SIZE    128
+
+// Arguments and string bytes kept in a log ring slot. Messages needing
+// more are formatted when recorded.
+#define LOG_RING_ARGS   16
+#define LOG_RING_STRS   160
+
+enum { LOG_ARG_INT, LOG_ARG_LONG, LOG_ARG_LLONG, LOG_ARG_DOUBLE, LOG_ARG_PTR, LOG_ARG_STR,
+       LOG_ARG_ADDR };
+
+/*
+*   A message and its raw arguments. The format string is the message
+*   id. In the log ring, the writer thread formats the arguments.
+*/
+struct logRecord {
+    const char          *fmt;           // NULL if text holds the message
+    int                 err;
+    unsigned char       nargs;
+    unsigned char       type[LOG_RING_ARGS];
+    union {
+        long long       i;
+        double          d;
+        const void      *p;
+        unsigned        str;            // Offset of the copy in text
+    } arg[LOG_RING_ARGS];
+    char                text[LOG_RING_STRS];
+};
+
+// Single producer, single consumer ring. Only the daemon moves head,
+// only the writer thread moves tail.
+static struct {
+    struct logRecord    *slots;
+    uint32_t            mask;
+    uint32_t            head;
+    uint32_t            tail;
+    unsigned long       recorded;
+    unsigned long       dropped;
+    int                 wakeFd;
+    int                 stop;
+    bool                running;
+    pthread_t           writer;
+} logRing;
+
+/*
+*   Appends the errno text and writes a formatted message.
+*/
+static void logOutput( char *LogMsg, int Errno )
 {
-    char LogMsg[ 128 ];
+    size_t Ln = strlen( LogMsg );
 
-    va_list ArgPt;
-    unsigned Ln;
-    va_start( ArgPt, FmtSt );
-    Ln = vsnprintf( LogMsg, sizeof( LogMsg ), FmtSt, ArgPt );
     if( Errno > 0 )
-        snprintf( LogMsg + Ln, sizeof( LogMsg ) - Ln,
+        snprintf( LogMsg + Ln, LOG_MSG_SIZE - Ln,
                 "; Errno(%d): %s", Errno, strerror(Errno) );
-    va_end( ArgPt );
     if (Log2Stderr)
 	    fprintf(stderr, "%s\n", LogMsg);
+}
+
+/*
+*   Skips the flags, width, precision and length of a conversion. Sets
+*   *lng to 1 for long and 2 for long long arguments, -1 for ones
+*   the ring can not keep.
+*/
+static const char *logSpecEnd( const char *p, int *lng )
+{
+    *lng = 0;
+    while (*p && strchr("-+ #0", *p))
+        p++;
+    while ((*p >= '0' && *p <= '9') || *p == '.')
+        p++;
+    if (*p == 'h') {
+        p++;
+        if (*p == 'h')
+            p++;
+    } else if (*p == 'l') {
+        *lng = 1;
+        if (*++p == 'l') {
+            *lng = 2;
+            p++;
+        }
+    } else if (*p == 'z' || *p == 't') {
+        *lng = 1;
+        p++;
+    } else if (*p == '*' || *p == 'j' || *p == 'L' || *p == 'q') {
+        *lng = -1;
+    }
+    return p;
+}
+
+/*
+*   Keeps the arguments of a message in a record. Strings are copied, as
+*   the caller's buffers do not outlive the call, and cut when the record
+*   is full. %I takes an IPv4 address in network order, which is only
+*   formatted with the message. Returns 0 for messages needing more
+*   arguments or conversions the record can not keep.
+*/
+static int logCapture( struct logRecord *rec, const char *fmt, va_list ap )
+{
+    unsigned used = 0, n = 0;
+    const char *p, *s;
+    size_t len, room;
+    int lng;
+
+    for (p = fmt; *p; p++) {
+        if (*p != '%')
+            continue;
+        if (*++p == '%')
+            continue;
+        p = logSpecEnd(p, &lng);
+        if (lng < 0 || n == LOG_RING_ARGS)
+            return 0;
+
+        switch (*p) {
+        case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+            rec->type[n] = lng == 2 ? LOG_ARG_LLONG : lng ? LOG_ARG_LONG : LOG_ARG_INT;
+            rec->arg[n].i = lng == 2 ? va_arg(ap, long long) :
+                            lng ? va_arg(ap, long) : va_arg(ap, int);
+            break;
+        case 'f': case 'e': case 'g': case 'E': case 'G':
+            rec->type[n] = LOG_ARG_DOUBLE;
+            rec->arg[n].d = va_arg(ap, double);
+            break;
+        case 'p':
+            rec->type[n] = LOG_ARG_PTR;
+            rec->arg[n].p = va_arg(ap, void *);
+            break;
+        case 's':
+            s = va_arg(ap, const char *);
+            if (s == NULL)
+                s = "(null)";
+            rec->type[n] = LOG_ARG_STR;
+            room = LOG_RING_STRS - used;
+            if (room == 0) {
+                // The end of the last string is an empty one.
+                rec->arg[n].str = used - 1;
+                break;
+            }
+            len = strnlen(s, room - 1);
+            memcpy(rec->text + used, s, len);
+            rec->text[used + len] = '\0';
+            rec->arg[n].str = used;
+            used += len + 1;
+            break;
+        case 'I':
+            rec->type[n] = LOG_ARG_ADDR;
+            rec->arg[n].i = va_arg(ap, uint32_t);
+            break;
+        default:
+            return 0;
+        }
+        n++;
+    }
+    rec->nargs = n;
+    return 1;
+}
+
+/*
+*   Formats a record, one conversion at a time.
+*/
+static void logRender( const struct logRecord *rec, char *msg, size_t size )
+{
+    const char *p, *q;
+    char spec[16], addr[INET_FMT_SIZE];
+    size_t len = 0;
+    unsigned n = 0;
+    int lng, r;
+
+    if (rec->fmt == NULL) {
+        len = strnlen(rec->text, size - 1);
+        memcpy(msg, rec->text, len);
+        msg[len] = '\0';
+        return;
+    }
+
+    for (p = rec->fmt; *p && len < size - 1; p++) {
+        if (*p != '%') {
+            msg[len++] = *p;
+            continue;
+        }
+        if (p[1] == '%') {
+            msg[len++] = '%';
+            p++;
+            continue;
+        }
+        q = logSpecEnd(p + 1, &lng);
+        if (n == rec->nargs || (size_t)(q - p) + 2 > sizeof(spec))
+            break;
+        memcpy(spec, p, q - p + 1);
+        spec[q - p + 1] = '\0';
+
+        switch (rec->type[n]) {
+        case LOG_ARG_INT:
+            r = snprintf(msg + len, size - len, spec, (int)rec->arg[n].i);
+            break;
+        case LOG_ARG_LONG:
+            r = snprintf(msg + len, size - len, spec, (long)rec->arg[n].i);
+            break;
+        case LOG_ARG_LLONG:
+            r = snprintf(msg + len, size - len, spec, rec->arg[n].i);
+            break;
+        case LOG_ARG_DOUBLE:
+            r = snprintf(msg + len, size - len, spec, rec->arg[n].d);
+            break;
+        case LOG_ARG_PTR:
+            r = snprintf(msg + len, size - len, spec, rec->arg[n].p);
+            break;
+        case LOG_ARG_ADDR:
+            spec[q - p] = 's';
+            r = snprintf(msg + len, size - len, spec, inetFmt(rec->arg[n].i, addr));
+            break;
+        default:
+            r = snprintf(msg + len, size - len, spec, rec->text + rec->arg[n].str);
+            break;
+        }
+        if (r > 0)
+            len += r;
+        if (len > size - 1)
+            len = size - 1;
+        n++;
+        p = q;
+    }
+    msg[len] = '\0';
+}
+
+/*
+*   Fills a record with a message, formatting it at once if the
+*   arguments can not be kept.
+*/
+static void logFill( struct logRecord *rec, int Errno, const char *FmtSt, va_list ArgPt )
+{
+    va_list Copy;
+
+    rec->fmt = FmtSt;
+    rec->err = Errno;
+    va_copy(Copy, ArgPt);
+    if (!logCapture(rec, FmtSt, ArgPt)) {
+        vsnprintf(rec->text, sizeof(rec->text), FmtSt, Copy);
+        rec->fmt = NULL;
+    }
+    va_end(Copy);
+}
+
+/*
+*   Puts a message in the log ring. Never blocks, a message not fitting
+*   in a full ring is counted and dropped.
+*/
+static void logRingRecord( int Errno, const char *FmtSt, va_list ArgPt )
+{
+    uint32_t head = logRing.head;
+    uint64_t one = 1;
+
+    if (head - __atomic_load_n(&logRing.tail, __ATOMIC_ACQUIRE) > logRing.mask) {
+        __atomic_store_n(&logRing.dropped, logRing.dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    logFill(&logRing.slots[head & logRing.mask], Errno, FmtSt, ArgPt);
+    logRing.recorded++;
+
+    __atomic_store_n(&logRing.head, head + 1, __ATOMIC_RELEASE);
+
+    // Wake the writer only if it may have found the ring empty.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&logRing.tail, __ATOMIC_RELAXED) == head) {
+        if (write(logRing.wakeFd, &one, sizeof(one)) < 0)
+            return;
+    }
+}
+
+/*
+*   Writer thread. Formats and writes the ring slots, and sleeps on the
+*   eventfd while the ring is empty. Must not call my_log().
+*/
+static void *logRingWriter( void *arg )
+{
+    char LogMsg[ LOG_MSG_SIZE ];
+    unsigned long reported = 0, dropped;
+    uint32_t tail = logRing.tail;
+    uint64_t count;
+
+    (void)arg;
+    for (;;) {
+        uint32_t head = __atomic_load_n(&logRing.head, __ATOMIC_ACQUIRE);
+
+        while (tail != head) {
+            const struct logRecord *rec = &logRing.slots[tail & logRing.mask];
+
+            logRender(rec, LogMsg, sizeof(LogMsg));
+            logOutput(LogMsg, rec->err);
+            __atomic_store_n(&logRing.tail, ++tail, __ATOMIC_RELEASE);
+        }
+
+        dropped = __atomic_load_n(&logRing.dropped, __ATOMIC_RELAXED);
+        if (dropped != reported) {
+            snprintf(LogMsg, sizeof(LogMsg), "Log ring full, %lu messages dropped",
+                     dropped - reported);
+            logOutput(LogMsg, 0);
+            reported = dropped;
+        }
+
+        // Recheck after publishing tail, the daemon skips the wakeup
+        // for messages recorded before it saw the new tail.
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&logRing.head, __ATOMIC_ACQUIRE) != tail)
+            continue;
+        if (__atomic_load_n(&logRing.stop, __ATOMIC_ACQUIRE))
+            break;
+        if (read(logRing.wakeFd, &count, sizeof(count)) < 0 && errno != EINTR)
+            break;
+    }
+    return NULL;
+}
+
+/*
+*   Starts writing log messages from a thread, through a ring of the
+*   given number of slots, rounded up to a power of two. Signals must
+*   be blocked already, so the thread never takes them.
+*/
+int logRingInit( unsigned slots )
+{
+    unsigned size = 1;
+    int err;
+
+    if (slots == 0 || logRing.running)
+        return 0;
+    while (size < slots)
+        size <<= 1;
+
+    logRing.slots = calloc(size, sizeof(*logRing.slots));
+    if (logRing.slots == NULL) {
+        my_log(LOG_WARNING, errno, "No memory for a log ring of %u slots", size);
+        return -1;
+    }
+    logRing.wakeFd = eventfd(0, EFD_CLOEXEC);
+    if (logRing.wakeFd < 0) {
+        my_log(LOG_WARNING, errno, "Can not create the log ring eventfd");
+        free(logRing.slots);
+        logRing.slots = NULL;
+        return -1;
+    }
+    logRing.mask = size - 1;
+    logRing.head = logRing.tail = 0;
+    logRing.recorded = logRing.dropped = 0;
+    logRing.stop = 0;
+
+    err = pthread_create(&logRing.writer, NULL, logRingWriter, NULL);
+    if (err) {
+        my_log(LOG_WARNING, err, "Can not start the log writer thread");
+        close(logRing.wakeFd);
+        free(logRing.slots);
+        logRing.slots = NULL;
+        return -1;
+    }
+    logRing.running = true;
+    my_log(LOG_DEBUG, 0, "Log ring of %u slots started", size);
+    return 0;
+}
+
+/*
+*   Logs the number of messages passed through and dropped by the ring.
+*/
+void logRingLogStats( void )
+{
+    if (logRing.running)
+        my_log(LOG_INFO, 0, "Log ring: %lu messages, %lu dropped",
+               logRing.recorded,
+               __atomic_load_n(&logRing.dropped, __ATOMIC_RELAXED));
+}
+
+/*
+*   Writes the messages left in the ring and stops the writer thread.
+*   Later messages are written synchronously.
+*/
+void logRingCleanUp( void )
+{
+    uint64_t one = 1;
+
+    if (!logRing.running)
+        return;
+
+    __atomic_store_n(&logRing.stop, 1, __ATOMIC_RELEASE);
+    if (write(logRing.wakeFd, &one, sizeof(one)) < 0)
+        my_log(LOG_WARNING, errno, "Can not wake the log writer thread");
+    pthread_join(logRing.writer, NULL);
+    logRing.running = false;
+
+    close(logRing.wakeFd);
+    free(logRing.slots);
+    logRing.slots = NULL;
+}
+
+/*
+*   Writes a message. Called by my_log() for the enabled levels only.
+*   With a log ring running the message is only recorded here.
+*/
+void logWrite( int Severity, int Errno, const char *FmtSt, ... )
+{
+    char LogMsg[ LOG_MSG_SIZE ];
+    struct logRecord Rec;
+
+    va_list ArgPt;
+    va_start( ArgPt, FmtSt );
+    if (logRing.running) {
+        logRingRecord( Errno, FmtSt, ArgPt );
+        va_end( ArgPt );
+        return;
+    }
+    logFill( &Rec, Errno, FmtSt, ArgPt );
+    va_end( ArgPt );
+    logRender( &Rec, LogMsg, sizeof( LogMsg ) );
+    logOutput( LogMsg, Errno );
     return;
 #if 0
     if (Severity <= LogLevel) {